@@ -14,6 +14,7 @@
 
 
 #include "cdb_bloomfilter.h"
+#include "cdb_hugepage.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -28,6 +29,9 @@ static uint64_t BFSEEDS[CDBBFHASHNUM] = {217636919,290182597,386910137,515880193
 struct CDBBLOOMFILTER
 {
     uint8_t *bitmap[1<<CDBBFSPLITPOW];
+    /* the bitmaps are split from one region */
+    uint8_t *region;
+    bool huge;
     uint64_t rnum;
     uint64_t size;
     int hnum;
@@ -35,7 +39,7 @@ struct CDBBLOOMFILTER
 };
 
 
-CDBBLOOMFILTER *cdb_bf_new(uint64_t rnum, uint64_t size)
+CDBBLOOMFILTER *cdb_bf_new(uint64_t rnum, uint64_t size, int hugepage)
 {
     CDBBLOOMFILTER *bf = (CDBBLOOMFILTER *)malloc(sizeof(CDBBLOOMFILTER));
     bf->rnum = 0;
@@ -47,11 +51,14 @@ CDBBLOOMFILTER *cdb_bf_new(uint64_t rnum, uint64_t size)
         bf->hnum = CDBBFHASHNUM;
     if (bf->hnum == 0)
         bf->hnum = 1;
-    /* avoid malloc too much memory once */
-    for(int i = 0; i < (1 << CDBBFSPLITPOW); i++) {
-        bf->bitmap[i] = (uint8_t*)malloc(size >> CDBBFSPLITPOW);
-        memset(bf->bitmap[i], 0, size >> CDBBFSPLITPOW);
+    /* one zeroed region for all bitmaps, lookups touch random places of it */
+    bf->region = (uint8_t*)cdb_hp_alloc(size, hugepage, &bf->huge);
+    if (bf->region == NULL) {
+        free(bf);
+        return NULL;
     }
+    for(int i = 0; i < (1 << CDBBFSPLITPOW); i++) 
+        bf->bitmap[i] = bf->region + i * (size >> CDBBFSPLITPOW);
     return bf;
 }
 
@@ -108,12 +115,17 @@ void cdb_bf_clean(CDBBLOOMFILTER *bf)
 
 void cdb_bf_destroy(CDBBLOOMFILTER *bf)
 {
-    for(int i = 0; i < (1 << CDBBFSPLITPOW); i++) 
-        free(bf->bitmap[i]);
+    cdb_hp_free(bf->region, bf->size);
     free(bf);
 }
 
 
+uint64_t cdb_bf_hugesize(CDBBLOOMFILTER *bf)
+{
+    return bf->huge? bf->size : 0;
+}
+
+
 #ifdef _UT_CDBBF_
 #include <stdio.h>
 #include <stdlib.h>
@@ -128,7 +140,7 @@ int main(int argc, char *argv[])
     if (argc > 2)
         size = atoi(argv[2]);
 
-    CDBBLOOMFILTER *bf = cdb_bf_new(rnum, size);
+    CDBBLOOMFILTER *bf = cdb_bf_new(rnum, size, 0);
     for(int i = 0; i < rnum; i++) {
         int j = 2 * i;
         cdb_bf_set(bf, &j, 4);
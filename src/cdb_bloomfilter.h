@@ -25,10 +25,13 @@ typedef struct CDBBLOOMFILTER CDBBLOOMFILTER;
 
 #define CDBBFRATIO 8
 
-CDBBLOOMFILTER *cdb_bf_new(uint64_t rnum, uint64_t size);
+/* 'hugepage' is one of CDB_HUGEPAGE*, how the bitmap is mapped */
+CDBBLOOMFILTER *cdb_bf_new(uint64_t rnum, uint64_t size, int hugepage);
 void cdb_bf_set(CDBBLOOMFILTER *bf, void *key, int ksize);
 bool cdb_bf_exist(CDBBLOOMFILTER *bf, void *key, int ksize);
 void cdb_bf_clean(CDBBLOOMFILTER *bf);
 void cdb_bf_destroy(CDBBLOOMFILTER *bf);
+/* size of the bitmap if it got huge pages, or 0 */
+uint64_t cdb_bf_hugesize(CDBBLOOMFILTER *bf);
 
 #endif
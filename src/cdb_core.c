@@ -18,7 +18,12 @@
 #include "cdb_types.h"
 #include "cdb_hashtable.h"
 #include "cdb_bloomfilter.h"
+#include "cdb_sketch.h"
+#include "cdb_fpcache.h"
 #include "cdb_lock.h"
+#include "cdb_epoch.h"
+#include "cdb_scratch.h"
+#include "cdb_hugepage.h"
 #include "cdb_bgtask.h"
 #include "cdb_errno.h"
 #include "cdb_vio.h"
@@ -27,15 +32,79 @@
 #include <string.h>
 #include <time.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
 
-static void _cdb_pageout(CDB *db);
+static void _cdb_pageout(CDB *db, uint32_t sid, uint64_t limit);
 static void _cdb_defparam(CDB *db);
-static void _cdb_recout(CDB *db);
+static void _cdb_recout(CDB *db, uint32_t sid, uint64_t limit);
+static void _cdb_pccheck(CDB *db, uint32_t sid);
+static void _cdb_rccheck(CDB *db, uint32_t sid);
+static void *_cdb_evictorthread(void *arg);
+static void _cdb_startevictor(CDB *db);
+static void _cdb_stopevictor(CDB *db);
+static void _cdb_wakeevictor(CDB *db);
+static uint64_t _cdb_dpcachenum(CDB *db);
+static void _cdb_rcputhead(char *cval, FOFF off, uint32_t expire);
+static uint32_t _cdb_rcgethead(const char *cval, FOFF *off, uint32_t *expire);
+static bool _cdb_rcadmit(CDB *db, uint32_t sid, uint64_t hash, uint32_t size);
+static bool _cdb_pcadmit(CDB *db, uint32_t sid, uint32_t bid, uint32_t size);
 static uint32_t _pagehash(const void *key, int len);
 static void _cdb_flushdpagetask(void *arg);
+static uint32_t _cdb_flushshard(CDB *db, uint32_t sid, uint32_t expire, uint64_t limit);
+static void *_cdb_flusherthread(void *arg);
+static void _cdb_startflushers(CDB *db);
+static void _cdb_stopflushers(CDB *db);
+static void _cdb_wakeflusher(CDB *db, uint32_t sid);
+static void _cdb_reclaimtask(void *arg);
 static void _cdb_timerreset(struct timespec *ts);
 static uint32_t _cdb_timermicrosec(struct timespec *ts);
 static void _cdb_pagewarmup(CDB *db, bool loadbf);
+static uint32_t _cdb_statshard();
+static bool _cdb_ghosthit(CDBFPCACHE *ghost, uint64_t hash);
+static void _cdb_budgetsetup(CDB *db, bool memdb);
+static void _cdb_budgettask(void *arg);
+static uint64_t _cdb_steplimit(uint64_t cur, uint64_t goal, bool fast);
+static void _cdb_movelimits(CDB *db, bool fast);
+static bool _cdb_checkpressure(CDB *db);
+static void _cdb_limittask(void *arg);
+static void _cdb_runthreads(void *(*fn)(void *), void *ranges, size_t rsize, uint32_t tnum);
+static void _cdb_savehotkeys(CDB *db);
+static void _cdb_hotsavetask(void *arg);
+static void _cdb_savehotpages(CDB *db);
+static void _cdb_rcachewarmup(CDB *db);
+
+/* add to a statistics counter in the shard of current thread */
+#define STATADD(db, field, n) __atomic_fetch_add(&(db)->stats[_cdb_statshard()].field, \
+    (n), __ATOMIC_RELAXED)
+
+
+/* a cached record value starts with a compact header: a flag byte, the offset of 
+ the record, and the expire time only if the record has one */
+#define RCFEXPIRE 0x01
+#define RCHSIZE(expire) (1 + SFOFF + ((expire)? SI4: 0))
+
+static void _cdb_rcputhead(char *cval, FOFF off, uint32_t expire)
+{
+    cval[0] = expire? RCFEXPIRE: 0;
+    memcpy(cval + 1, &off, SFOFF);
+    if (expire)
+        memcpy(cval + 1 + SFOFF, &expire, SI4);
+}
+
+
+/* returns the size of header, 'off' can be NULL */
+static uint32_t _cdb_rcgethead(const char *cval, FOFF *off, uint32_t *expire)
+{
+    if (off)
+        memcpy(off, cval + 1, SFOFF);
+    *expire = 0;
+    if (cval[0] & RCFEXPIRE)
+        memcpy(expire, cval + 1 + SFOFF, SI4);
+    return RCHSIZE(*expire);
+}
 
 
 /* it isn't necessary to rehash bid in hash table cache */
@@ -72,236 +141,1263 @@ static void _cdb_defparam(CDB *db)
     db->rclimit = 128 * MB;
     db->pclimit = 1024 * MB;
     db->hsize = 1000000; 
-    db->rcache = db->pcache = db->dpcache = NULL;
+    for(int i = 0; i < CACHESHARDNUM; i++)
+        db->rcache[i] = db->pcache[i] = db->dpcache[i] = NULL;
+    db->epoch = NULL;
     db->bf = NULL;
+    db->rcsketch = db->pcsketch = NULL;
+    db->negcache = NULL;
+    db->ncnum = 0;
+    db->offcache = NULL;
+    db->ocnum = 0;
+    db->rcghost = db->pcghost = NULL;
+    db->membudget = db->budgetavail = 0;
+    db->lastrcghosthit = db->lastpcghosthit = 0;
+    db->splitnum = 0;
+    memset(db->splithist, 0, sizeof(db->splithist));
+    db->rctarget = db->pctarget = 0;
+    db->cachescale = 100;
+    db->pressurenum = 0;
+    db->rcwarmnum = 0;
+    free(db->psifile);
+    db->psifile = NULL;
+    db->psilimit = 0;
+    db->rcvalmax = 0;
     db->opened = false;
     db->vio = NULL;
     db->mtable = NULL;
+    db->mtnum = 0;
+    db->mthuge = false;
+    db->mtmmap = false;
+    db->mtmap = NULL;
+    db->mtmapsize = 0;
+    db->hugepage = CDB_HUGEPAGEOFF;
     db->oid = 0;
     db->roid = 0;
+    memset(db->ckoids, 0, sizeof(db->ckoids));
+    db->ckpos = 0;
+    db->cktime = 0;
+    db->ckroundtime = CKPROUNDTIME;
+    db->flushers = NULL;
+    db->flushernum = 0;
+    db->flstop = false;
+    db->dphigh = DPHIGHRATIO;
+    db->dplow = DPLOWRATIO;
+    db->evrunning = db->evwake = db->evstop = false;
     db->errcbarg = NULL;
     db->errcb = NULL;
+    db->flushcbarg = NULL;
+    db->flushcb = NULL;
     db->areadsize = 4 * KB;
     return;
 }
 
 
-/* flush all dirty pages */
+/* number of dirty pages in all shards */
+static uint64_t _cdb_dpcachenum(CDB *db)
+{
+    uint64_t num = 0;
+    for(int i = 0; i < CACHESHARDNUM; i++)
+        num += cdb_ht_num(db->dpcache[i]);
+    return num;
+}
+
+
+/* dirty pages of sorted buckets written by a thread */
+typedef struct {
+    CDB *db;
+    uint32_t *bids;
+    uint32_t num;
+    /* pages written by all threads, and the total */
+    uint64_t *done;
+    uint64_t total;
+    /* pages failed to write, they are left dirty */
+    uint64_t *failed;
+    /* progress callback is called one at a time */
+    CDBLOCK *cblock;
+} DPFLUSHRANGE;
+
+
+static void *_cdb_dpflushthread(void *arg)
+{
+    DPFLUSHRANGE *range = (DPFLUSHRANGE *)arg;
+    CDB *db = range->db;
+    CDBHTITEM **items = (CDBHTITEM **)malloc(FLUSHBATCHNUM * sizeof(CDBHTITEM *));
+    CDBPAGE **pages = (CDBPAGE **)malloc(FLUSHBATCHNUM * sizeof(CDBPAGE *));
+    FOFF *offs = (FOFF *)malloc(FLUSHBATCHNUM * sizeof(FOFF));
+    uint32_t i = 0;
+
+    while(i < range->num) {
+        uint32_t num = 0;
+        uint64_t done;
+
+        for(; i < range->num && num < FLUSHBATCHNUM; i++) {
+            uint32_t bid = range->bids[i];
+            uint32_t sid = PCSHARD(bid);
+            cdb_lock_lock(db->dpclock[sid]);
+            items[num] = cdb_ht_del(db->dpcache[sid], &bid, SI4);
+            cdb_lock_unlock(db->dpclock[sid]);
+            if (items[num]) {
+                pages[num] = (CDBPAGE *)cdb_ht_itemval(db->dpcache[sid], items[num]);
+                OFFZERO(offs[num]);
+                num++;
+            }
+        }
+
+        /* pages in a row are written by large writes */
+        if (db->vio->wpages(db->vio, pages, num, offs) < 0) {
+            /* pages written before the failure are at their new offset already */
+            for(uint32_t j = 0; j < num; j++) {
+                if (OFFNOTNULL(offs[j]) && OFFEQ(pages[j]->ooff, offs[j]))
+                    continue;
+                if (db->vio->wpage(db->vio, pages[j], &offs[j]) < 0)
+                    OFFZERO(offs[j]);
+            }
+        }
+        for(uint32_t j = 0; j < num; j++) {
+            uint32_t bid = pages[j]->bid;
+            uint32_t sid = PCSHARD(bid);
+            if (OFFNULL(offs[j])) {
+                /* still dirty, the old page stays in main table */
+                cdb_lock_lock(db->dpclock[sid]);
+                cdb_ht_insert(db->dpcache[sid], items[j]);
+                cdb_lock_unlock(db->dpclock[sid]);
+                __atomic_add_fetch(range->failed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            db->mtable[bid] = offs[j];
+            cdb_ht_freeitem(db->dpcache[sid], items[j]);
+        }
+
+        done = __atomic_add_fetch(range->done, num, __ATOMIC_RELAXED);
+        if (db->flushcb && num) {
+            cdb_lock_lock(range->cblock);
+            db->flushcb(db->flushcbarg, done, range->total);
+            cdb_lock_unlock(range->cblock);
+        }
+    }
+    free(offs);
+    free(pages);
+    free(items);
+    return NULL;
+}
+
+
+static int _cdb_bidcmp(const void *p1, const void *p2)
+{
+    uint32_t b1 = *(const uint32_t *)p1, b2 = *(const uint32_t *)p2;
+    return b1 < b2? -1: b1 > b2;
+}
+
+
+/* flush all dirty pages, several threads write them in bucket order */
 void cdb_flushalldpage(CDB *db)
 {
-    if (db->dpcache) {
-        while (db->dpcache->num) {
-            CDBHTITEM *item = cdb_ht_poptail(db->dpcache);    
-            uint32_t bid = *(uint32_t*)cdb_ht_itemkey(db->dpcache, item);
-            FOFF off;
-            db->vio->wpage(db->vio, (CDBPAGE*)cdb_ht_itemval(db->dpcache, item), &off);
-            db->mtable[bid] = off;
-            free(item);
-        } 
+    if (db->dpcache[0]) {
+        DPFLUSHRANGE ranges[FLUSHTHREADNUM];
+        uint64_t num = 0, done = 0, failed = 0;
+        uint32_t *bids = (uint32_t *)malloc((_cdb_dpcachenum(db) + 1) * sizeof(uint32_t));
+        CDBLOCK *cblock = cdb_lock_new(CDB_LOCKMUTEX);
+        uint32_t tnum;
+
+        for(int i = 0; i < CACHESHARDNUM; i++) {
+            CDBHASHTABLE *dpcache = db->dpcache[i];
+            for(CDBHTITEM *item = cdb_ht_iterbegin(dpcache); item; item = cdb_ht_iternext(dpcache, item))
+                bids[num++] = *(uint32_t *)cdb_ht_itemkey(dpcache, item);
+        }
+        qsort(bids, num, sizeof(uint32_t), _cdb_bidcmp);
+
+        tnum = num < FLUSHBATCHNUM? 1: FLUSHTHREADNUM;
+        for(uint32_t i = 0; i < tnum; i++) {
+            ranges[i].db = db;
+            ranges[i].bids = bids + num * i / tnum;
+            ranges[i].num = num * (i + 1) / tnum - num * i / tnum;
+            ranges[i].done = &done;
+            ranges[i].total = num;
+            ranges[i].failed = &failed;
+            ranges[i].cblock = cblock;
+        }
+        _cdb_runthreads(_cdb_dpflushthread, ranges, sizeof(DPFLUSHRANGE), tnum);
+        cdb_lock_destory(cblock);
+        free(bids);
 
-        db->roid = db->oid; 
+        /* the recovery point can't pass the pages still dirty */
+        if (failed) {
+            cdb_seterrno(db, CDB_WRITEERR, __FILE__, __LINE__);
+            return;
+        }
+        db->roid = __atomic_load_n(&db->oid, __ATOMIC_RELAXED);
+        for(int i = 0; i < CKPRANGENUM; i++)
+            db->ckoids[i] = db->roid;
         db->vio->cleanpoint(db->vio);
     }
 }
 
 
-/* flush oldest dirty index page to disk, it runs in another thread and triggered by timer */
+/* write out the dirty page of a bucket if it has one, and move it into clean page cache */
+static void _cdb_flushdpage(CDB *db, uint32_t bid)
+{
+    uint32_t sid = PCSHARD(bid);
+    CDBHTITEM *item;
+    FOFF off;
+
+    if (cdb_ht_num(db->dpcache[sid]) == 0)
+        return;
+
+    cdb_lock_lock(MLOCK(db, bid));
+    cdb_lock_lock(db->dpclock[sid]);
+    item = cdb_ht_del(db->dpcache[sid], &bid, SI4);
+    cdb_lock_unlock(db->dpclock[sid]);
+    if (item) {
+        struct timespec ts;
+        _cdb_timerreset(&ts);
+        db->vio->wpage(db->vio, (CDBPAGE *)cdb_ht_itemval(db->dpcache[sid], item), &off);
+        STATADD(db, wcount, 1);
+        STATADD(db, wtime, _cdb_timermicrosec(&ts));
+        db->mtable[bid] = off;
+
+        /* move the clean page into pcache of the same shard */
+        cdb_lock_lock(db->pclock[sid]);
+        cdb_ht_insert(db->pcache[sid], item);
+        cdb_lock_unlock(db->pclock[sid]);
+    }
+    cdb_lock_unlock(MLOCK(db, bid));
+}
+
+
+/* flush dirty pages of the bucket ranges due, a range remembers the oid before its flush
+ as its recovery point, the oldest one of all ranges is the recovery point of db */
+static void _cdb_checkpointranges(CDB *db, uint32_t now)
+{
+    uint32_t due, *bids = NULL, bcap = 0;
+    uint64_t roid;
+
+    /* a round of all ranges takes about ckroundtime */
+    due = (uint64_t)(now - db->cktime) * CKPRANGENUM / db->ckroundtime;
+    if (due == 0)
+        return;
+    db->cktime = now;
+
+    for(due = CDBMIN(due, CKPRANGENUM); due; due--) {
+        uint32_t range = db->ckpos;
+        uint64_t oid = __atomic_load_n(&db->oid, __ATOMIC_RELAXED);
+        uint32_t bstart = (uint64_t)db->hsize * range / CKPRANGENUM;
+        uint32_t bend = (uint64_t)db->hsize * (range + 1) / CKPRANGENUM;
+        uint32_t num = 0;
+
+        /* only buckets with a dirty page in the range, found in the dirty page caches */
+        for(int i = 0; i < CACHESHARDNUM; i++) {
+            CDBHASHTABLE *dpcache = db->dpcache[i];
+            cdb_lock_lock(db->dpclock[i]);
+            if (num + dpcache->num > bcap) {
+                bcap = num + dpcache->num;
+                bids = (uint32_t *)realloc(bids, bcap * sizeof(uint32_t));
+            }
+            for(CDBHTITEM *item = cdb_ht_iterbegin(dpcache); item; item = cdb_ht_iternext(dpcache, item)) {
+                uint32_t bid = *(uint32_t *)cdb_ht_itemkey(dpcache, item);
+                if (bid >= bstart && bid < bend)
+                    bids[num++] = bid;
+            }
+            cdb_lock_unlock(db->dpclock[i]);
+        }
+        for(uint32_t i = 0; i < num; i++)
+            _cdb_flushdpage(db, bids[i]);
+        db->ckoids[range] = oid;
+        db->ckpos = (range + 1) % CKPRANGENUM;
+    }
+    free(bids);
+
+    roid = db->ckoids[0];
+    for(int i = 1; i < CKPRANGENUM; i++)
+        roid = CDBMIN(roid, db->ckoids[i]);
+    if (roid > db->roid) {
+        db->roid = roid;
+        db->vio->checkpoint(db->vio);
+    }
+}
+
+
+/* write out dirty pages of a shard from the oldest in batches, those modified before 'expire'
+ and the oldest ones while the shard holds more than 'limit' bytes of them. Buckets locked by
+ others are skipped instead of waited for, return the number of pages skipped */
+static uint32_t _cdb_flushshard(CDB *db, uint32_t sid, uint32_t expire, uint64_t limit)
+{
+    CDBHASHTABLE *dpcache = db->dpcache[sid];
+    CDBHTITEM *items[DPFLUSHBATCH];
+    CDBPAGE *pages[DPFLUSHBATCH];
+    CDBLOCK *locks[DPFLUSHBATCH];
+    FOFF offs[DPFLUSHBATCH];
+    uint32_t skipped = 0;
+    bool more = true;
+
+    while(more && cdb_ht_num(dpcache)) {
+        uint32_t num = 0, lnum = 0;
+        CDBHTITEM *item;
+
+        more = false;
+        skipped = 0;
+        cdb_lock_lock(db->dpclock[sid]);
+        item = cdb_ht_gettail(dpcache);
+        while(item) {
+            CDBHTITEM *prev = cdb_ht_getprev(dpcache, item);
+            CDBPAGE *page = (CDBPAGE *)cdb_ht_itemval(dpcache, item);
+            uint32_t bid = page->bid;
+            CDBLOCK *lock = MLOCK(db, bid);
+            uint32_t j;
+
+            /* the rest are newer */
+            if (page->mtime >= expire && dpcache->size <= limit)
+                break;
+            if (num == DPFLUSHBATCH) {
+                more = true;
+                break;
+            }
+
+            /* the stripe may be taken by this batch already. Others are not waited for,
+             to avoid dead lock since dpclock is holding */
+            for(j = 0; j < lnum && locks[j] != lock; j++);
+            if (j == lnum) {
+                if (cdb_lock_trylock(lock)) {
+                    skipped++;
+                    item = prev;
+                    continue;
+                }
+                locks[lnum++] = lock;
+            }
+            cdb_ht_del(dpcache, &bid, SI4);
+            items[num] = item;
+            pages[num++] = page;
+            item = prev;
+        }
+        cdb_lock_unlock(db->dpclock[sid]);
+
+        if (num) {
+            struct timespec ts;
+            _cdb_timerreset(&ts);
+            /* pages of the batch are packed in the index write buffer, and go out by large writes */
+            for(uint32_t j = 0; j < num; j++)
+                db->vio->wpage(db->vio, pages[j], &offs[j]);
+            STATADD(db, wcount, num);
+            STATADD(db, wtime, _cdb_timermicrosec(&ts));
+
+            /* move the clean pages into pcache of the same shard */
+            cdb_lock_lock(db->pclock[sid]);
+            for(uint32_t j = 0; j < num; j++) {
+                db->mtable[pages[j]->bid] = offs[j];
+                cdb_ht_insert(db->pcache[sid], items[j]);
+            }
+            cdb_lock_unlock(db->pclock[sid]);
+        }
+        for(uint32_t j = 0; j < lnum; j++)
+            cdb_lock_unlock(locks[j]);
+    }
+    return skipped;
+}
+
+
+/* make a recovery point by writing out all dirty pages if there are few of them and some time
+ passed since last clean, or checkpoint the bucket ranges due. It runs in the background task
+ thread every second, dirty pages are written out by age and amount in flusher threads */
 static void _cdb_flushdpagetask(void *arg)
 {
     CDB *db = (CDB *)arg;
-    CDBHTITEM *item;
-    CDBPAGE *page;
     time_t now = time(NULL);
-    bool cleandcache = false;
-    uint32_t bid;
+    uint64_t oid = __atomic_load_n(&db->oid, __ATOMIC_RELAXED);
 
-    if (!db->dpcache)
+    if (!db->dpcache[0])
         /* no dirty page cache */
         return;
 
-    /* if there isn't too much dirty page and some time passed since last clean,
-     write out all dirty pages to make a recovery point(oid) */
-    if (db->dpcache->num < 1024 && now > db->ndpltime + 120)
-        cleandcache = true;
-        
-    while(db->dpcache->num) {
-        FOFF off;
-        cdb_lock_lock(db->dpclock);
-        item = cdb_ht_gettail(db->dpcache);
-        /* no item in dpcache after lock */
-        if (item == NULL) {
-            cdb_lock_unlock(db->dpclock);
+    if (_cdb_dpcachenum(db) < 1024 && now > db->ndpltime + 120) {
+        uint32_t skipped = 0;
+        for(int i = 0; i < CACHESHARDNUM; i++)
+            skipped += _cdb_flushshard(db, i, 0, 0);
+        /* some buckets were busy, try again next time */
+        if (skipped)
             return;
+
+        if (_cdb_dpcachenum(db) == 0)
+            db->ndpltime = now;
+        /* clean succeed if goes here, remember the recovery point */
+        /* it's not necessary to lock */
+        db->roid = oid;
+        for(int i = 0; i < CKPRANGENUM; i++)
+            db->ckoids[i] = db->roid;
+        db->cktime = now;
+        db->vio->cleanpoint(db->vio);
+    } else if (db->ckroundtime)
+        _cdb_checkpointranges(db, now);
+}
+
+
+/* a flusher thread writes out pages of its shards dirty for too long, and the oldest ones of
+ a shard above the high watermark until the low one. It runs once a second or when woken */
+static void *_cdb_flusherthread(void *arg)
+{
+    CDBFLUSHER *flusher = (CDBFLUSHER *)arg;
+    CDB *db = flusher->db;
+    sigset_t smask;
+
+    /* block all signals coming into current thread */
+    sigfillset(&smask);
+    pthread_sigmask(SIG_BLOCK, &smask, NULL);
+
+    pthread_mutex_lock(&db->flmutex);
+    while(!db->flstop) {
+        uint32_t expire = time(NULL) - DPAGETIMEOUT;
+        struct timespec timeout;
+
+        __atomic_store_n(&flusher->wake, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&db->flmutex);
+        for(uint32_t sid = flusher->id; sid < CACHESHARDNUM; sid += db->flushernum) {
+            uint64_t limit = UINT64_MAX;
+            if (DPOVERHIGH(db, sid))
+                limit = PCLIMIT(db) * db->dplow / 100 / CACHESHARDNUM;
+            _cdb_flushshard(db, sid, expire, limit);
         }
-        page = (CDBPAGE *)cdb_ht_itemval(db->dpcache, item);
-        /* bid = page->bid; also OK */
-        bid = *(uint32_t*)cdb_ht_itemkey(db->dpcache, item);
-        /* been dirty for too long? */
-        if (now > page->mtime + DPAGETIMEOUT || cleandcache) {
-            if (cdb_lock_trylock(db->mlock[page->bid % MLOCKNUM])) {
-                /* avoid dead lock, since dpclock is holding */
-                cdb_lock_unlock(db->dpclock);
-                return;
+        pthread_mutex_lock(&db->flmutex);
+
+        /* woken during the round */
+        if (flusher->wake || db->flstop)
+            continue;
+        timeout.tv_sec = time(NULL) + 1;
+        timeout.tv_nsec = 0;
+        pthread_cond_timedwait(&flusher->cond, &db->flmutex, &timeout);
+    }
+    pthread_mutex_unlock(&db->flmutex);
+    return NULL;
+}
+
+
+static void _cdb_startflushers(CDB *db)
+{
+    uint32_t num = CDBMIN(DPFLUSHERNUM, CACHESHARDNUM);
+
+    pthread_mutex_init(&db->flmutex, NULL);
+    db->flstop = false;
+    db->flushers = (CDBFLUSHER *)malloc(num * sizeof(CDBFLUSHER));
+    for(uint32_t i = 0; i < num; i++) {
+        db->flushers[i].db = db;
+        db->flushers[i].id = i;
+        db->flushers[i].wake = false;
+        pthread_cond_init(&db->flushers[i].cond, NULL);
+    }
+    /* set before any thread starts, they split the shards by it */
+    db->flushernum = num;
+    for(uint32_t i = 0; i < num; i++) {
+        if (pthread_create(&db->flushers[i].tid, NULL, _cdb_flusherthread, &db->flushers[i])) {
+            /* the threads started take the shards of the others */
+            db->flushernum = i;
+            break;
+        }
+    }
+}
+
+
+static void _cdb_stopflushers(CDB *db)
+{
+    if (db->flushers == NULL)
+        return;
+
+    pthread_mutex_lock(&db->flmutex);
+    db->flstop = true;
+    for(uint32_t i = 0; i < db->flushernum; i++)
+        pthread_cond_signal(&db->flushers[i].cond);
+    pthread_mutex_unlock(&db->flmutex);
+    for(uint32_t i = 0; i < db->flushernum; i++)
+        pthread_join(db->flushers[i].tid, NULL);
+    for(uint32_t i = 0; i < CDBMIN(DPFLUSHERNUM, CACHESHARDNUM); i++)
+        pthread_cond_destroy(&db->flushers[i].cond);
+    pthread_mutex_destroy(&db->flmutex);
+    free(db->flushers);
+    db->flushers = NULL;
+    db->flushernum = 0;
+}
+
+
+/* called by writers when dirty pages of a shard pass the high watermark, wake up the
+ flusher of the shard */
+static void _cdb_wakeflusher(CDB *db, uint32_t sid)
+{
+    CDBFLUSHER *flusher;
+
+    if (db->flushernum == 0)
+        return;
+
+    flusher = &db->flushers[sid % db->flushernum];
+    /* woken already, and no round started since then */
+    if (__atomic_load_n(&flusher->wake, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&db->flmutex);
+    __atomic_store_n(&flusher->wake, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&flusher->cond);
+    pthread_mutex_unlock(&db->flmutex);
+}
+
+
+/* free the records and pages retired by cache writers, when no reader could see them */
+static void _cdb_reclaimtask(void *arg)
+{
+    CDB *db = (CDB *)arg;
+    cdb_epoch_reclaim(db->epoch);
+}
+
+
+/* a miss of an item evicted lately, a larger cache would have hit */
+static bool _cdb_ghosthit(CDBFPCACHE *ghost, uint64_t hash)
+{
+    if (ghost == NULL || !cdb_fpc_get(ghost, hash, 0, NULL))
+        return false;
+    /* it's going to be cached again */
+    cdb_fpc_del(ghost, hash);
+    return true;
+}
+
+
+/* take the fixed-size parts from the memory budget, split the rest between the caches
+ at the ratio of their limits, and remember what are evicted if both caches are enabled */
+static void _cdb_budgetsetup(CDB *db, bool memdb)
+{
+    uint64_t ghostnum = db->membudget / GHOSTDIV;
+    /* about the sizes of bloom filter and fingerprint caches */
+    uint64_t fixed = db->bfsize + db->ncnum * 16 + db->ocnum * 32;
+    uint64_t rclimit = db->rclimit, pclimit = memdb? 0: db->pclimit;
+    bool split = !memdb && (rclimit || pclimit);
+
+    if (split && rclimit && pclimit)
+        fixed += ghostnum * 2 * 16;
+    /* caches get a quarter of the budget at least */
+    if (fixed > db->membudget / 4 * 3)
+        fixed = db->membudget / 4 * 3;
+    db->budgetavail = db->membudget - fixed;
+
+    if (!split) {
+        /* memdb has only record cache, or both limits are 0 */
+        db->rclimit = memdb? db->budgetavail : db->budgetavail / 2;
+        db->pclimit = memdb? db->pclimit : db->budgetavail - db->rclimit;
+    } else {
+        db->rclimit = (uint64_t)((double)db->budgetavail * rclimit / (rclimit + pclimit));
+        db->pclimit = pclimit? db->budgetavail - db->rclimit : 0;
+    }
+
+    if (!memdb && db->rclimit && db->pclimit) {
+        db->rcghost = cdb_fpc_new(ghostnum, 0);
+        db->pcghost = cdb_fpc_new(ghostnum, 0);
+    }
+}
+
+
+/* move a step of the budget toward the cache whose recently evicted items are missed
+ more, weighted by the size of items, so it's about the hits a byte may bring */
+static void _cdb_budgettask(void *arg)
+{
+    CDB *db = (CDB *)arg;
+    uint64_t rgh = 0, pgh = 0, rsize = 0, rnum = 0, psize = 0, pnum = 0;
+    uint64_t step, minsize;
+    double rgain, pgain;
+
+    for(int i = 0; i < STATSHARDNUM; i++) {
+        rgh += __atomic_load_n(&db->stats[i].rcghosthit, __ATOMIC_RELAXED);
+        pgh += __atomic_load_n(&db->stats[i].pcghosthit, __ATOMIC_RELAXED);
+    }
+    /* the counters may have been reset by cdb_stat() */
+    if (rgh < db->lastrcghosthit || pgh < db->lastpcghosthit)
+        db->lastrcghosthit = db->lastpcghosthit = 0;
+    /* too few samples, wait for more */
+    if (rgh - db->lastrcghosthit + pgh - db->lastpcghosthit < BUDGETMINHITS)
+        return;
+
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        rsize += cdb_ht_size(db->rcache[i]);
+        rnum += cdb_ht_num(db->rcache[i]);
+        psize += cdb_ht_size(db->pcache[i]) + cdb_ht_size(db->dpcache[i]);
+        pnum += cdb_ht_num(db->pcache[i]) + cdb_ht_num(db->dpcache[i]);
+    }
+    /* both ghost sets remember the same number of items */
+    rgain = (double)(rgh - db->lastrcghosthit) / (rnum? rsize / rnum : 1);
+    pgain = (double)(pgh - db->lastpcghosthit) / (pnum? psize / pnum : 1);
+    db->lastrcghosthit = rgh;
+    db->lastpcghosthit = pgh;
+
+    /* the user may set new limits meanwhile */
+    cdb_lock_lock(db->limitlock);
+    step = db->budgetavail / BUDGETSTEPDIV;
+    minsize = db->budgetavail / BUDGETMINDIV;
+    if (rgain > pgain * 1.25 && db->pctarget >= minsize + step) {
+        db->pctarget -= step;
+        db->rctarget += step;
+    } else if (pgain > rgain * 1.25 && db->rctarget >= minsize + step) {
+        db->rctarget -= step;
+        db->pctarget += step;
+    } else {
+        cdb_lock_unlock(db->limitlock);
+        return;
+    }
+    db->splitnum++;
+    memmove(db->splithist + 1, db->splithist, CDB_SPLITHISTNUM - 1);
+    db->splithist[0] = db->rctarget * 100 / db->budgetavail;
+    cdb_lock_unlock(db->limitlock);
+
+    /* the shrunk one is trimmed at once, it never goes over the budget */
+    _cdb_movelimits(db, true);
+}
+
+
+/* move a cache limit toward its goal, a shrink goes in steps unless 'fast' */
+static uint64_t _cdb_steplimit(uint64_t cur, uint64_t goal, bool fast)
+{
+    uint64_t step;
+
+    if (cur <= goal || fast)
+        return goal;
+    step = CDBMAX((cur - goal) / 4, LIMITSTEPMIN);
+    return cur - goal > step? cur - step : goal;
+}
+
+
+/* bring the limits to the targets scaled down by memory pressure, evict what exceeds */
+static void _cdb_movelimits(CDB *db, bool fast)
+{
+    uint64_t rclimit, pclimit;
+
+    /* the targets are changed by the user and the budget task, others read the limits only */
+    cdb_lock_lock(db->limitlock);
+    rclimit = _cdb_steplimit(db->rclimit, db->rctarget * db->cachescale / 100, fast);
+    pclimit = _cdb_steplimit(db->pclimit, db->pctarget * db->cachescale / 100, fast);
+    __atomic_store_n(&db->rclimit, rclimit, __ATOMIC_RELAXED);
+    __atomic_store_n(&db->pclimit, pclimit, __ATOMIC_RELAXED);
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        if (RCOVERFLOW(db, i))
+            _cdb_recout(db, i, rclimit / CACHESHARDNUM);
+        if (PCOVERFLOW(db, i))
+            _cdb_pageout(db, i, pclimit / CACHESHARDNUM);
+    }
+    cdb_lock_unlock(db->limitlock);
+}
+
+
+/* the system or cgroup is stalled on memory, give some back before OOM killer comes.
+ the caches grow back slowly once the pressure is gone */
+static bool _cdb_checkpressure(CDB *db)
+{
+    FILE *f = fopen(db->psifile, "r");
+    char buf[256];
+    double avg10 = 0;
+
+    if (f == NULL)
+        return false;
+    /* some avg10=0.00 avg60=0.00 avg300=0.00 total=0 */
+    if (fgets(buf, sizeof(buf), f))
+        sscanf(buf, "some avg10=%lf", &avg10);
+    fclose(f);
+
+    /* the scale is read by _cdb_movelimits on user threads */
+    cdb_lock_lock(db->limitlock);
+    if (avg10 >= db->psilimit) {
+        db->cachescale = CDBMAX(db->cachescale * 7 / 8, CACHESCALEMIN);
+        db->pressurenum++;
+    } else if (db->cachescale < 100)
+        db->cachescale = CDBMIN(db->cachescale + CACHESCALEUP, 100);
+    cdb_lock_unlock(db->limitlock);
+    return avg10 >= db->psilimit;
+}
+
+
+/* evict caches down to changed limits in background, a little every second */
+static void _cdb_limittask(void *arg)
+{
+    CDB *db = (CDB *)arg;
+    bool pressure = false;
+
+    if (db->psifile)
+        pressure = _cdb_checkpressure(db);
+    _cdb_movelimits(db, pressure);
+}
+
+
+/* allocate a zeroed main table of 'hsize' elements, the old one is dropped */
+int cdb_newmtable(CDB *db)
+{
+    cdb_freemtable(db);
+    db->mtable = (FOFF *)cdb_hp_alloc(sizeof(FOFF) * db->hsize, db->hugepage, &db->mthuge);
+    if (db->mtable == NULL) {
+        cdb_seterrno(db, CDB_INTERNALERR, __FILE__, __LINE__);
+        return -1;
+    }
+    db->mtnum = db->hsize;
+    return 0;
+}
+
+
+void cdb_freemtable(CDB *db)
+{
+    if (db->mtmap)
+        munmap(db->mtmap, db->mtmapsize);
+    else
+        cdb_hp_free(db->mtable, sizeof(FOFF) * db->mtnum);
+    db->mtmap = NULL;
+    db->mtmapsize = 0;
+    db->mtable = NULL;
+    db->mtnum = 0;
+    db->mthuge = false;
+}
+
+
+/* map the main table of 'hsize' elements at 'off' of file 'fd' shared, the old one is 
+ dropped. updates go to the file in place, the file is extended with empty buckets if
+ it is shorter */
+int cdb_mapmtable(CDB *db, int fd, uint64_t off)
+{
+    uint64_t size = off + sizeof(FOFF) * db->hsize;
+    struct stat st;
+    void *map;
+
+    cdb_freemtable(db);
+    if (fstat(fd, &st) < 0 || ((uint64_t)st.st_size < size && ftruncate(fd, size) < 0)) {
+        cdb_seterrno(db, CDB_WRITEERR, __FILE__, __LINE__);
+        return -1;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        cdb_seterrno(db, CDB_INTERNALERR, __FILE__, __LINE__);
+        return -1;
+    }
+    db->mtmap = map;
+    db->mtmapsize = size;
+    db->mtable = (FOFF *)((char *)map + off);
+    db->mtnum = db->hsize;
+    return 0;
+}
+
+
+/* generate an incremental global operation id */
+uint64_t cdb_genoid(CDB *db)
+{
+    return __atomic_fetch_add(&db->oid, 1, __ATOMIC_RELAXED);
+}
+
+
+/* the statistics shard of current thread, threads take the shards in turn */
+static uint32_t _cdb_statshard()
+{
+    static uint32_t next = 0;
+    static __thread int32_t mine = -1;
+
+    if (mine < 0)
+        mine = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % STATSHARDNUM;
+    return mine;
+}
+
+
+/* get a new record iterator */
+void *cdb_iterate_new(CDB *db, uint64_t oid)
+{
+    return db->vio->recitfirst(db->vio, oid);
+}
+
+
+
+/* iterate the database by callback */
+uint64_t cdb_iterate(CDB *db, CDB_ITERCALLBACK itcb, void *arg, void *iter)
+{
+    CDBREC *rec;
+    uint64_t cnt = 0;
+
+    if (iter == NULL)
+        return cnt;
+    /* the rec is a copy from file, in a per-thread scratch buffer */
+    rec = (CDBREC *)cdb_scratch_get(RECSBUFSIZE(db));
+    for(;;) {
+        bool ret = true;
+        if (db->vio->recitnext(db->vio, &rec, iter) < 0) 
+            break;
+        
+        if (cdb_checkoff(db, CDBHASH64(rec->key, rec->ksize), rec->ooff, CDB_NOTLOCKED)) {
+            ret = itcb(arg, rec->key, rec->ksize, rec->val, rec->vsize, rec->expire, rec->oid);
+            cnt++;
+        }
+        if (!ret) 
+            break;
+    }
+    cdb_scratch_put(rec);
+    return cnt;
+}
+
+
+
+/* destroy the iterator */
+void cdb_iterate_destroy(CDB *db, void *iter)
+{
+    db->vio->recitdestroy(db->vio, iter);
+}
+
+
+/* hot files: magic, number of items, crc of items, then items in order of frequency */
+#define HOTMAGICLEN 8
+#define HOTHSIZE (HOTMAGICLEN + SI4 + SI8)
+#define HOTKEYMAGIC "CDBHOTK1"
+#define HOTPAGEMAGIC "CDBHOTP1"
+
+typedef struct {
+    HOTKEY hk;
+    uint32_t freq;
+} HOTKEYRANK;
+
+typedef struct {
+    uint32_t bid;
+    uint32_t freq;
+} HOTPAGERANK;
+
+/* a range of hot keys read by a warmup thread */
+typedef struct {
+    CDB *db;
+    HOTKEY *keys;
+    uint32_t num;
+    uint32_t loaded;
+} RCWARMUPRANGE;
+
+/* a range of page offsets read by a warmup thread */
+typedef struct {
+    CDB *db;
+    FOFF *offs;
+    uint32_t num;
+    bool loadbf;
+} PCWARMUPRANGE;
+
+
+static int _cdb_offcmp(const FOFF *o1, const FOFF *o2)
+{
+    if (o1->i4 != o2->i4)
+        return o1->i4 < o2->i4? -1: 1;
+    if (o1->i2 != o2->i2)
+        return o1->i2 < o2->i2? -1: 1;
+    return 0;
+}
+
+
+static int _cdb_offcmp2(const void *p1, const void *p2)
+{
+    return _cdb_offcmp((const FOFF *)p1, (const FOFF *)p2);
+}
+
+
+static int _cdb_hotkeycmpoff(const void *p1, const void *p2)
+{
+    return _cdb_offcmp(&((const HOTKEY *)p1)->off, &((const HOTKEY *)p2)->off);
+}
+
+
+static int _cdb_hotkeycmpfreq(const void *p1, const void *p2)
+{
+    const HOTKEYRANK *r1 = (const HOTKEYRANK *)p1;
+    const HOTKEYRANK *r2 = (const HOTKEYRANK *)p2;
+
+    return r1->freq < r2->freq? 1: (r1->freq > r2->freq? -1: 0);
+}
+
+
+static int _cdb_hotpagecmpfreq(const void *p1, const void *p2)
+{
+    const HOTPAGERANK *r1 = (const HOTPAGERANK *)p1;
+    const HOTPAGERANK *r2 = (const HOTPAGERANK *)p2;
+
+    return r1->freq < r2->freq? 1: (r1->freq > r2->freq? -1: 0);
+}
+
+
+/* write 'num' items of 'isize' bytes to a hot file */
+static void _cdb_savehot(CDB *db, const char *name, const char *magic, 
+        const void *items, uint32_t num, uint32_t isize)
+{
+    char *buf = (char *)malloc(HOTHSIZE + (uint64_t)isize * num);
+
+    memcpy(buf, magic, HOTMAGICLEN);
+    *(uint32_t *)(buf + HOTMAGICLEN) = num;
+    *(uint64_t *)(buf + HOTMAGICLEN + SI4) = cdb_crc64(items, (uint64_t)isize * num);
+    memcpy(buf + HOTHSIZE, items, (uint64_t)isize * num);
+    db->vio->wside(db->vio, name, buf, HOTHSIZE + (uint64_t)isize * num);
+    free(buf);
+}
+
+
+/* read a hot file, the items start at HOTHSIZE of the returned buffer.
+ returns NULL if it doesn't exist or is broken */
+static char *_cdb_loadhot(CDB *db, const char *name, const char *magic, 
+        uint32_t isize, uint32_t *num)
+{
+    void *buf;
+    uint64_t size;
+
+    if (db->vio->rside(db->vio, name, &buf, &size) < 0)
+        return NULL;
+    if (size < HOTHSIZE || memcmp(buf, magic, HOTMAGICLEN)
+        || size != HOTHSIZE + (uint64_t)isize * *(uint32_t *)((char *)buf + HOTMAGICLEN)
+        || cdb_crc64((char *)buf + HOTHSIZE, size - HOTHSIZE) 
+            != *(uint64_t *)((char *)buf + HOTMAGICLEN + SI4)) {
+        free(buf);
+        return NULL;
+    }
+    *num = *(uint32_t *)((char *)buf + HOTMAGICLEN);
+    return (char *)buf;
+}
+
+
+/* save where the cached records are, the most frequently used first */
+static void _cdb_savehotkeys(CDB *db)
+{
+    HOTKEYRANK *ranks = NULL;
+    HOTKEY *keys;
+    uint32_t num = 0, cap = 0;
+    uint32_t now = time(NULL);
+
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        CDBHASHTABLE *rcache = db->rcache[i];
+        cdb_lock_lock(db->rclock[i]);
+        for(CDBHTITEM *item = cdb_ht_iterbegin(rcache); item; item = cdb_ht_iternext(rcache, item)) {
+            HOTKEYRANK *rank;
+            uint32_t expire, hsize;
+            FOFF off;
+
+            hsize = _cdb_rcgethead(cdb_ht_itemval(rcache, item), &off, &expire);
+            if (expire && expire <= now)
+                continue;
+            if (num == cap) {
+                cap = cap? cap * 2: 1024;
+                ranks = (HOTKEYRANK *)realloc(ranks, sizeof(HOTKEYRANK) * cap);
             }
-            /* remove it from dpcache */
-            cdb_ht_poptail(db->dpcache);
-            cdb_lock_unlock(db->dpclock);
+            rank = &ranks[num++];
+            rank->hk.hash = CDBHASH64(cdb_ht_itemkey(rcache, item), item->ksize);
+            rank->hk.off = off;
+            rank->hk.rsize = RECHSIZE + item->ksize + item->vsize - hsize;
+            rank->freq = db->rcsketch? cdb_sketch_estimate(db->rcsketch, rank->hk.hash): 0;
+        }
+        cdb_lock_unlock(db->rclock[i]);
+    }
 
-            /* write to disk */
-            struct timespec ts;
-            _cdb_timerreset(&ts);
-            db->vio->wpage(db->vio, page, &off);
-            db->wcount++;
-            db->wtime += _cdb_timermicrosec(&ts);
-            db->mtable[bid] = off;
+    if (num)
+        qsort(ranks, num, sizeof(HOTKEYRANK), _cdb_hotkeycmpfreq);
+    /* packed in place, a key never moves forward */
+    keys = (HOTKEY *)ranks;
+    for(uint32_t i = 0; i < num; i++)
+        memmove(&keys[i], &ranks[i].hk, sizeof(HOTKEY));
+    _cdb_savehot(db, HOTKEYFILE, HOTKEYMAGIC, keys, num, sizeof(HOTKEY));
+    free(ranks);
+}
 
-            /* move the clean page into pcache */
-            cdb_lock_lock(db->pclock);
-            cdb_ht_insert(db->pcache, item);
-            cdb_lock_unlock(db->pclock);
-            cdb_lock_unlock(db->mlock[bid % MLOCKNUM]);
-        } else {
-            /* tail in dpcache isn't expired */
-            cdb_lock_unlock(db->dpclock);
-            return;
+
+static void _cdb_pcrank(CDB *db, CDBHASHTABLE *ht, HOTPAGERANK **ranks, uint32_t *num, uint32_t *cap)
+{
+    for(CDBHTITEM *item = cdb_ht_iterbegin(ht); item; item = cdb_ht_iternext(ht, item)) {
+        if (*num == *cap) {
+            *cap = *cap? *cap * 2: 1024;
+            *ranks = (HOTPAGERANK *)realloc(*ranks, sizeof(HOTPAGERANK) * *cap);
+        }
+        (*ranks)[*num].bid = *(uint32_t *)cdb_ht_itemkey(ht, item);
+        (*ranks)[*num].freq = cdb_sketch_estimate(db->pcsketch, (*ranks)[*num].bid);
+        (*num)++;
+    }
+}
+
+
+/* save the buckets whose pages are cached, the most frequently used first */
+static void _cdb_savehotpages(CDB *db)
+{
+    HOTPAGERANK *ranks = NULL;
+    uint32_t *bids;
+    uint32_t num = 0, cap = 0;
+
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        cdb_lock_lock(db->pclock[i]);
+        _cdb_pcrank(db, db->pcache[i], &ranks, &num, &cap);
+        cdb_lock_unlock(db->pclock[i]);
+        cdb_lock_lock(db->dpclock[i]);
+        _cdb_pcrank(db, db->dpcache[i], &ranks, &num, &cap);
+        cdb_lock_unlock(db->dpclock[i]);
+    }
+
+    if (num)
+        qsort(ranks, num, sizeof(HOTPAGERANK), _cdb_hotpagecmpfreq);
+    bids = (uint32_t *)ranks;
+    for(uint32_t i = 0; i < num; i++)
+        bids[i] = ranks[i].bid;
+    _cdb_savehot(db, HOTPAGEFILE, HOTPAGEMAGIC, bids, num, SI4);
+    free(ranks);
+}
+
+
+/* keep the hot files fresh in case the process never closes the db */
+static void _cdb_hotsavetask(void *arg)
+{
+    CDB *db = (CDB *)arg;
+
+    if (db->rcache[0])
+        _cdb_savehotkeys(db);
+    if (db->pcache[0])
+        _cdb_savehotpages(db);
+}
+
+
+/* run threads on 'tnum' ranges of 'rsize' bytes each, and wait for them */
+static void _cdb_runthreads(void *(*fn)(void *), void *ranges, size_t rsize, uint32_t tnum)
+{
+    pthread_t threads[tnum];
+    bool started[tnum];
+
+    for(uint32_t i = 0; i < tnum; i++) {
+        /* do it here if no more thread can be created */
+        started[i] = pthread_create(&threads[i], NULL, fn, (char *)ranges + rsize * i) == 0;
+        if (!started[i])
+            fn((char *)ranges + rsize * i);
+    }
+    for(uint32_t i = 0; i < tnum; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+}
+
+
+/* read records of a range in offset order, and put them into record cache */
+static void *_cdb_rcwarmupthread(void *arg)
+{
+    RCWARMUPRANGE *range = (RCWARMUPRANGE *)arg;
+    CDB *db = range->db;
+    CDBREC *rec = (CDBREC *)cdb_scratch_get(RECSBUFSIZE(db));
+    uint32_t now = time(NULL);
+
+    for(uint32_t i = 0; i < range->num; i++) {
+        HOTKEY *hk = &range->keys[i];
+        uint32_t sid = RCSHARD(hk->hash);
+        CDBLOCK *mlock = MLOCK(db, (hk->hash >> 24) % db->hsize);
+        CDBHASHTABLE *rcache = db->rcache[sid];
+        CDBHTITEM *item = NULL;
+
+        cdb_lock_rdlock(mlock);
+        /* the record may have been overwritten or deleted since the key was saved */
+        if (cdb_checkoff(db, hk->hash, hk->off, CDB_LOCKED)
+            && db->vio->rrec2(db->vio, &rec, hk->off, hk->rsize) == 0
+            && CDBHASH64(rec->key, rec->ksize) == hk->hash
+            && (rec->expire == 0 || rec->expire > now)
+            && rec->vsize <= db->rcvalmax) {
+            char *cval;
+            item = cdb_ht_newitem(rcache, rec->ksize, rec->vsize + RCHSIZE(rec->expire));
+            memcpy(cdb_ht_itemkey(rcache, item), rec->key, rec->ksize);
+            cval = cdb_ht_itemval(rcache, item);
+            memcpy(cval + RCHSIZE(rec->expire), rec->val, rec->vsize);
+            _cdb_rcputhead(cval, hk->off, rec->expire);
+            cdb_lock_lock(db->rclock[sid]);
+            if (rcache->size + cdb_ht_itemsize(rcache, item) <= RCLIMIT(db) / CACHESHARDNUM) {
+                cdb_ht_insert(rcache, item);
+                range->loaded++;
+                item = NULL;
+            }
+            cdb_lock_unlock(db->rclock[sid]);
         }
+        cdb_lock_unlock(mlock);
+        if (item)
+            cdb_ht_dropitem(rcache, item);
     }
 
-    if (db->dpcache->num == 0 && cleandcache)
-        db->ndpltime = now;
-
-    if (cleandcache) {
-        /* clean succeed if goes here, remember the recovery point */
-        /* it's not necessary to lock */
-        db->roid = db->oid; 
-        db->vio->cleanpoint(db->vio);
-    }
+    cdb_scratch_put(rec);
+    return NULL;
 }
 
 
-/* fill the index page cache, and set the bloomfilter if necessary */
-static void _cdb_pagewarmup(CDB *db, bool loadbf)
+/* reload the hot records saved last time, as many as the record cache holds.
+ they are sorted by offset and read by several threads, each one goes forward in a range */
+static void _cdb_rcachewarmup(CDB *db)
 {
-    char sbuf[SBUFSIZE];
-    void *it = db->vio->pageitfirst(db->vio, 0);
+    RCWARMUPRANGE ranges[WARMUPTHREADNUM];
+    HOTKEY *keys;
+    uint64_t total = 0;
+    uint32_t num, tnum, pos = 0;
+    char *buf = _cdb_loadhot(db, HOTKEYFILE, HOTKEYMAGIC, sizeof(HOTKEY), &num);
 
-    if (it == NULL)
+    if (buf == NULL)
         return;
 
-    for(;;) {
-        CDBPAGE *page = (CDBPAGE *)sbuf;
-        if (db->vio->pageitnext(db->vio, &page, it) < 0)
+    /* the most frequently used ones which fit in the cache */
+    keys = (HOTKEY *)(buf + HOTHSIZE);
+    for(uint32_t i = 0; i < num; i++) {
+        total += keys[i].rsize;
+        if (total > RCLIMIT(db)) {
+            num = i;
             break;
-
-        /* the page is the newest one because its offset matches the one in main table */
-        if (OFFEQ(page->ooff, db->mtable[page->bid])) {
-            if (loadbf) {
-                /* iterate key hashes in page, set to the filter */
-                cdb_lock_lock(db->bflock);
-                for(uint32_t i = 0; i < page->num; i++) {
-                    uint64_t hash = (page->bid << 24) | (page->items[i].hash.i2 << 8)
-                        | (page->items[i].hash.i1);
-                    /* bloom filter use the combined record hash as key */
-                    cdb_bf_set(db->bf, &hash, SI8);
-                }
-                cdb_lock_unlock(db->bflock);
-            }
-
-            /* set the page to pcache if it doesn't exceed the limit size */
-            if (db->pcache && db->pcache->size < db->pclimit) {
-                cdb_lock_lock(db->pclock);
-                cdb_ht_insert2(db->pcache, &page->bid, SI4, page, MPAGESIZE(page));
-                cdb_lock_unlock(db->pclock);
-            }
         }
-        /* the page may not be still in stack */
-        if (page != (CDBPAGE *)sbuf)
-            free(page);
-
-        if (!loadbf && (db->pcache && db->pcache->size > db->pclimit))
-            break;
     }
-
-    db->vio->pageitdestroy(db->vio, it);
+    qsort(keys, num, sizeof(HOTKEY), _cdb_hotkeycmpoff);
+
+    tnum = CDBMIN(WARMUPTHREADNUM, num / 256 + 1);
+    for(uint32_t i = 0; i < tnum; i++) {
+        ranges[i].db = db;
+        ranges[i].keys = keys + pos;
+        ranges[i].num = num / tnum + (i < num % tnum);
+        ranges[i].loaded = 0;
+        pos += ranges[i].num;
+    }
+    _cdb_runthreads(_cdb_rcwarmupthread, ranges, sizeof(RCWARMUPRANGE), tnum);
+    for(uint32_t i = 0; i < tnum; i++)
+        db->rcwarmnum += ranges[i].loaded;
+    free(buf);
 }
 
 
-/* generate an incremental global operation id */
-uint64_t cdb_genoid(CDB *db)
+/* if every page cache shard reached its limit */
+static bool _cdb_pcfull(CDB *db)
 {
-    uint64_t oid;
-    cdb_lock_lock(db->oidlock);
-    oid = db->oid++;
-    cdb_lock_unlock(db->oidlock);
-    return oid;
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        if (db->pcache[i] && cdb_ht_size(db->pcache[i]) < PCLIMIT(db) / CACHESHARDNUM)
+            return false;
+    }
+    return true;
 }
 
 
-/* get a new record iterator */
-void *cdb_iterate_new(CDB *db, uint64_t oid)
+/* a page read in warmup, returns false to stop reading when nothing more to do */
+static bool _cdb_pcwarmuppage(void *arg, CDBPAGE *page)
 {
-    return db->vio->recitfirst(db->vio, oid);
-}
-
-
+    PCWARMUPRANGE *range = (PCWARMUPRANGE *)arg;
+    CDB *db = range->db;
+    uint32_t sid;
 
-/* iterate the database by callback */
-uint64_t cdb_iterate(CDB *db, CDB_ITERCALLBACK itcb, void *arg, void *iter)
-{
-    char sbuf[SBUFSIZE];
-    uint64_t cnt = 0;
+    /* the page is the newest one because its offset matches the one in main table */
+    if (page->bid >= db->hsize || !OFFEQ(page->ooff, db->mtable[page->bid]))
+        return true;
 
-    if (iter == NULL)
-        return cnt;
-    for(;;) {
-        /* the rec is a copy from file, may in stack or allocated in heap */
-        CDBREC *rec = (CDBREC *)sbuf;
-        bool ret = true;
-        if (db->vio->recitnext(db->vio, &rec, iter) < 0) 
-            break;
-        
-        if (cdb_checkoff(db, CDBHASH64(rec->key, rec->ksize), rec->ooff, CDB_NOTLOCKED)) {
-            ret = itcb(arg, rec->key, rec->ksize, rec->val, rec->vsize, rec->expire, rec->oid);
-            cnt++;
+    if (range->loadbf) {
+        /* iterate key hashes in page, set to the filter */
+        cdb_lock_lock(db->bflock);
+        for(uint32_t i = 0; i < page->num; i++) {
+            uint64_t hash = (page->bid << 24) | (page->items[i].hash.i2 << 8)
+                | (page->items[i].hash.i1);
+            /* bloom filter use the combined record hash as key */
+            cdb_bf_set(db->bf, &hash, SI8);
         }
-        if (rec != (CDBREC *)sbuf)
-            free(rec);
-        if (!ret) 
-            break;
+        cdb_lock_unlock(db->bflock);
     }
-    return cnt;
+
+    /* set the page to pcache if it doesn't exceed the limit size */
+    sid = PCSHARD(page->bid);
+    if (db->pcache[sid] && cdb_ht_size(db->pcache[sid]) < PCLIMIT(db) / CACHESHARDNUM) {
+        cdb_lock_lock(db->pclock[sid]);
+        cdb_ht_insert2(db->pcache[sid], &page->bid, SI4, page, MPAGESIZE(page));
+        cdb_lock_unlock(db->pclock[sid]);
+    } else if (!range->loadbf && _cdb_pcfull(db))
+        return false;
+    return true;
 }
 
 
+static void *_cdb_pcwarmupthread(void *arg)
+{
+    PCWARMUPRANGE *range = (PCWARMUPRANGE *)arg;
 
-/* destroy the iterator */
-void cdb_iterate_destroy(CDB *db, void *iter)
+    range->db->vio->rpages(range->db->vio, range->offs, range->num, _cdb_pcwarmuppage, range);
+    return NULL;
+}
+
+
+/* read pages at 'offs' in offset order by several threads */
+static void _cdb_pcwarmuprun(CDB *db, FOFF *offs, uint32_t num, bool loadbf)
 {
-    db->vio->recitdestroy(db->vio, iter);
+    PCWARMUPRANGE ranges[WARMUPTHREADNUM];
+    uint32_t tnum, pos = 0;
+
+    qsort(offs, num, SFOFF, _cdb_offcmp2);
+    tnum = CDBMIN(WARMUPTHREADNUM, num / 256 + 1);
+    for(uint32_t i = 0; i < tnum; i++) {
+        ranges[i].db = db;
+        ranges[i].offs = offs + pos;
+        ranges[i].num = num / tnum + (i < num % tnum);
+        ranges[i].loadbf = loadbf;
+        pos += ranges[i].num;
+    }
+    _cdb_runthreads(_cdb_pcwarmupthread, ranges, sizeof(PCWARMUPRANGE), tnum);
 }
 
 
-/* difficult to implement */
-/*
-static void _cdb_rcachewarmup(CDB *db)
+/* fill the index page cache, and set the bloomfilter if necessary. only the newest pages
+ in main table are read, buckets hot at last close go first. the rest are read by slices
+ of the main table only if the page cache has room or the bloom filter needs them */
+static void _cdb_pagewarmup(CDB *db, bool loadbf)
 {
+    uint32_t num = 0, hotnum = 0;
+    FOFF *offs = NULL;
+    char *buf = NULL;
+
+    if (db->pcache[0])
+        buf = _cdb_loadhot(db, HOTPAGEFILE, HOTPAGEMAGIC, SI4, &hotnum);
+    if (buf) {
+        uint32_t *bids = (uint32_t *)(buf + HOTHSIZE);
+        offs = (FOFF *)malloc(SFOFF * hotnum);
+        for(uint32_t i = 0; offs && i < hotnum; i++) {
+            uint32_t bid = bids[i];
+            if (bid < db->hsize && OFFNOTNULL(db->mtable[bid]))
+                offs[num++] = db->mtable[bid];
+        }
+        free(buf);
+        /* a bucket listed twice is cached once */
+        if (offs)
+            _cdb_pcwarmuprun(db, offs, num, loadbf);
+        free(offs);
+    }
+
+    if (!loadbf && _cdb_pcfull(db))
+        return;
+
+    offs = (FOFF *)malloc(SFOFF * CDBMIN(db->hsize, WARMUPSLICE));
+    if (offs == NULL)
+        return;
+    for(uint32_t sbid = 0; sbid < db->hsize; sbid += WARMUPSLICE) {
+        uint32_t ebid = CDBMIN((uint64_t)sbid + WARMUPSLICE, db->hsize);
+
+        num = 0;
+        for(uint32_t bid = sbid; bid < ebid; bid++) {
+            uint32_t sid = PCSHARD(bid);
+            bool cached = false;
+
+            if (!OFFNOTNULL(db->mtable[bid]))
+                continue;
+            /* read already if it was hot, the bloom filter got its hashes then */
+            if (hotnum && db->pcache[sid]) {
+                cdb_lock_lock(db->pclock[sid]);
+                cached = cdb_ht_exist(db->pcache[sid], &bid, SI4);
+                cdb_lock_unlock(db->pclock[sid]);
+            }
+            if (!cached)
+                offs[num++] = db->mtable[bid];
+        }
+        _cdb_pcwarmuprun(db, offs, num, loadbf);
+        if (!loadbf && _cdb_pcfull(db))
+            break;
+    }
+    free(offs);
 }
-*/
 
 
 CDB *cdb_new()
 {
     CDB *db;
     db = (CDB *)malloc(sizeof(CDB));
-    /* I assume all operation in this layer is 'fast', so no mutex used here */
-    for(int i = 0; i < MLOCKNUM; i++) 
-        db->mlock[i] = cdb_lock_new(CDB_LOCKSPIN);
-    db->dpclock = cdb_lock_new(CDB_LOCKSPIN);
-    db->pclock = cdb_lock_new(CDB_LOCKSPIN);
-    db->rclock = cdb_lock_new(CDB_LOCKSPIN);
-    db->stlock = cdb_lock_new(CDB_LOCKSPIN);
-    db->oidlock = cdb_lock_new(CDB_LOCKSPIN);
-    db->bflock = cdb_lock_new(CDB_LOCKSPIN);
+    /* statistics shards don't share cache lines */
+    if (posix_memalign((void **)&db->stats, CDBLOCKALIGN, sizeof(CDBSTATSHARD) * STATSHARDNUM)) {
+        free(db);
+        return NULL;
+    }
+    memset(db->stats, 0, sizeof(CDBSTATSHARD) * STATSHARDNUM);
+    /* operations in this layer are mostly 'fast', but a holder of mlock may read disk,
+     and any holder may be preempted, so spin a while and then sleep */
+    db->mlock = NULL;
+    db->psifile = NULL;
+    cdb_option_mlocknum(db, MLOCKNUM);
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        db->dpclock[i] = cdb_lock_new(CDB_LOCKADAPT);
+        db->pclock[i] = cdb_lock_new(CDB_LOCKADAPT);
+        db->rclock[i] = cdb_lock_new(CDB_LOCKADAPT);
+    }
+    db->bflock = cdb_lock_new(CDB_LOCKADAPT);
+    db->limitlock = cdb_lock_new(CDB_LOCKMUTEX);
     db->bgtask = cdb_bgtask_new();
     /* every thread should has its own errno */
     db->errkey = (pthread_key_t *)malloc(sizeof(pthread_key_t));
@@ -325,11 +1421,121 @@ int cdb_option(CDB *db, int bnum, int rcacheMB, int pcacheMB)
 }
 
 
+int cdb_set_cache_limits(CDB *db, int rcacheMB, int pcacheMB)
+{
+    uint64_t rclimit, pclimit;
+
+    if (!db->opened)
+        return cdb_option(db, db->hsize, rcacheMB, pcacheMB);
+
+    rclimit = rcacheMB >= 0? (uint64_t)rcacheMB * MB : db->rctarget;
+    pclimit = pcacheMB >= 0? (uint64_t)pcacheMB * MB : db->pctarget;
+    if (db->vio == NULL && rclimit == 0) {
+        cdb_seterrno(db, CDB_MEMDBNOCACHE, __FILE__, __LINE__);
+        return -1;
+    }
+    /* lock-free readers rely on the cache tables staying, they can't be created now */
+    if ((rclimit && db->rcache[0] == NULL) || (pclimit && db->vio && db->pcache[0] == NULL)) {
+        cdb_seterrno(db, CDB_CACHEDISABLED, __FILE__, __LINE__);
+        return -1;
+    }
+
+    cdb_lock_lock(db->limitlock);
+    db->rctarget = rclimit;
+    db->pctarget = pclimit;
+    /* under a memory budget, it's a new total and split */
+    if (db->membudget)
+        db->budgetavail = rclimit + pclimit;
+    /* a growing cache takes effect at once, _cdb_limittask shrinks the others by steps */
+    rclimit = db->rctarget * db->cachescale / 100;
+    pclimit = db->pctarget * db->cachescale / 100;
+    if (rclimit > db->rclimit)
+        __atomic_store_n(&db->rclimit, rclimit, __ATOMIC_RELAXED);
+    if (pclimit > db->pclimit)
+        __atomic_store_n(&db->pclimit, pclimit, __ATOMIC_RELAXED);
+    cdb_lock_unlock(db->limitlock);
+
+    /* a memdb has no background thread, evict in the caller */
+    if (db->bgtask == NULL)
+        _cdb_movelimits(db, true);
+    return 0;
+}
+
+
 void cdb_option_bloomfilter(CDB *db, uint64_t size)
 {
     db->bfsize = size;
 }
 
+void cdb_option_mlocknum(CDB *db, uint32_t num)
+{
+    if (num == 0)
+        num = 1;
+    for(int i = 0; db->mlock && i < db->mlocknum; i++)
+        cdb_lock_destory(db->mlock[i]);
+    free(db->mlock);
+    db->mlocknum = num;
+    db->mlock = (CDBLOCK **)malloc(sizeof(CDBLOCK *) * num);
+    for(int i = 0; i < num; i++)
+        db->mlock[i] = cdb_lock_new(CDB_LOCKRW);
+}
+
+void cdb_option_negcache(CDB *db, uint32_t num)
+{
+    db->ncnum = num;
+}
+
+void cdb_option_offcache(CDB *db, uint32_t num)
+{
+    db->ocnum = num;
+}
+
+void cdb_option_rcvalmax(CDB *db, uint32_t size)
+{
+    db->rcvalmax = size;
+}
+
+void cdb_option_membudget(CDB *db, int budgetMB)
+{
+    db->membudget = budgetMB >= 16? (uint64_t)budgetMB * MB : 0;
+}
+
+void cdb_option_mempressure(CDB *db, const char *psifile, int avg10)
+{
+    free(db->psifile);
+    db->psifile = NULL;
+    if (avg10 > 0)
+        db->psifile = strdup(psifile? psifile: "/proc/pressure/memory");
+    db->psilimit = avg10;
+}
+
+void cdb_option_hugepage(CDB *db, int mode)
+{
+    db->hugepage = mode;
+}
+
+void cdb_option_mmaptable(CDB *db, bool enable)
+{
+    db->mtmmap = enable;
+}
+
+void cdb_option_recoverytime(CDB *db, uint32_t seconds)
+{
+    db->ckroundtime = seconds;
+}
+
+void cdb_option_dirtyratio(CDB *db, uint32_t high, uint32_t low)
+{
+    db->dphigh = CDBMIN(high, 100);
+    db->dplow = CDBMIN(low, db->dphigh);
+}
+
+void cdb_setflushcb(CDB *db, CDB_FLUSHCALLBACK flushcb, void *arg)
+{
+    db->flushcb = flushcb;
+    db->flushcbarg = arg;
+}
+
 void cdb_option_areadsize(CDB *db, uint32_t size)
 {
     db->areadsize = size;
@@ -345,10 +1551,31 @@ int cdb_open(CDB *db, const char *file_name, int mode)
     /* if will become into a hash table when file_name == CDB_MEMDB */
     int memdb = (strcmp(file_name, CDB_MEMDB) == 0);
 
-    if (db->rclimit)
-        /* record cache is enabled */
-        db->rcache = cdb_ht_new(true, NULL);
-    else if (memdb) {
+    if (db->membudget)
+        _cdb_budgetsetup(db, memdb);
+    db->rctarget = db->rclimit;
+    db->pctarget = db->pclimit;
+
+    /* cached records and pages are looked up without rclock/pclock/dpclock */
+    if (db->rclimit || (db->pclimit && !memdb))
+        db->epoch = cdb_epoch_new();
+
+    if (db->rclimit) {
+        /* record cache is enabled, a hit only sets the reference flag */
+        for(int i = 0; i < CACHESHARDNUM; i++) {
+            CDBSLAB *slab = cdb_slab_new(db->hugepage);
+            db->rcache[i] = cdb_ht_new(CDB_HTCLOCK | CDB_HTOPENADDR, NULL);
+            cdb_ht_setepoch(db->rcache[i], db->epoch);
+            cdb_ht_setslab(db->rcache[i], slab);
+            cdb_slab_release(slab);
+        }
+        /* a memdb keeps everything in cache, nothing to filter */
+        if (!memdb)
+            db->rcsketch = cdb_sketch_new(db->rclimit / 256);
+        /* by default, a value may take 1/64 of a shard at most */
+        if (db->rcvalmax == 0)
+            db->rcvalmax = db->rclimit / CACHESHARDNUM / 64;
+    } else if (memdb) {
         /* record cache is disabled, but in MEMDB mode */
         cdb_seterrno(db, CDB_MEMDBNOCACHE, __FILE__, __LINE__);
         goto ERRRET;
@@ -356,30 +1583,66 @@ int cdb_open(CDB *db, const char *file_name, int mode)
 
     if (db->pclimit && !memdb) {
         /* page cache enabled. page cache is meaningless under MEMDB  mode */
-        db->dpcache = cdb_ht_new(true, _pagehash);
-        db->pcache = cdb_ht_new(true, _pagehash);
+        for(int i = 0; i < CACHESHARDNUM; i++) {
+            /* pages move between the clean and dirty cache of a shard, they share a slab */
+            CDBSLAB *slab = cdb_slab_new(db->hugepage);
+            db->dpcache[i] = cdb_ht_new(CDB_HTLRU | CDB_HTOPENADDR, _pagehash);
+            db->pcache[i] = cdb_ht_new(CDB_HTLRU | CDB_HTOPENADDR, _pagehash);
+            cdb_ht_setepoch(db->dpcache[i], db->epoch);
+            cdb_ht_setepoch(db->pcache[i], db->epoch);
+            cdb_ht_setslab(db->dpcache[i], slab);
+            cdb_ht_setslab(db->pcache[i], slab);
+            cdb_slab_release(slab);
+        }
+        db->pcsketch = cdb_sketch_new(CDBMIN(db->hsize, db->pclimit / 128));
     }
 
 
     if (!memdb) {
         if (db->bfsize) {
             /* bloom filter enabled */
-            db->bf = cdb_bf_new(db->bfsize, db->bfsize);
+            db->bf = cdb_bf_new(db->bfsize, db->bfsize, db->hugepage);
+            if (db->bf == NULL) {
+                cdb_seterrno(db, CDB_INTERNALERR, __FILE__, __LINE__);
+                goto ERRRET;
+            }
+        }
+        if (db->ncnum) {
+            /* negative cache enabled, it only needs the fingerprints */
+            db->negcache = cdb_fpc_new(db->ncnum, 0);
         }
+        if (db->ocnum) {
+            /* offset cache enabled */
+            db->offcache = cdb_fpc_new(db->ocnum, sizeof(OCITEM));
+        }
+
         /* now only one storage format is supported */
         db->vio = cdb_vio_new(CDBVIOAPND2);
         db->vio->db = db;
         if (db->vio->open(db->vio, file_name, mode) < 0)
             goto ERRRET;
-        if (db->vio->rhead(db->vio) < 0) {
-            db->mtable = (FOFF*)malloc(sizeof(FOFF) * db->hsize);
-            memset(db->mtable, 0, sizeof(FOFF) * db->hsize);
-        }
+        if (db->vio->rhead(db->vio) < 0 && cdb_newmtable(db) < 0)
+            goto ERRRET;
         /* dirty index page would be swap to disk by timer control */
         cdb_bgtask_add(db->bgtask, _cdb_flushdpagetask, db, 1);
+        if (db->epoch)
+            cdb_bgtask_add(db->bgtask, _cdb_reclaimtask, db, 1);
+        if (db->rcghost && db->pcghost)
+            cdb_bgtask_add(db->bgtask, _cdb_budgettask, db, BUDGETINTERVAL);
+        cdb_bgtask_add(db->bgtask, _cdb_limittask, db, 1);
+        if (db->rcache[0] || db->pcache[0])
+            cdb_bgtask_add(db->bgtask, _cdb_hotsavetask, db, HOTSAVEINTERVAL);
         db->ndpltime = time(NULL);
+        /* every range starts from the recovery point just read or made */
+        for(int i = 0; i < CKPRANGENUM; i++)
+            db->ckoids[i] = db->roid;
+        db->cktime = db->ndpltime;
         /* start background task thread */
         cdb_bgtask_start(db->bgtask);
+        if (db->dpcache[0])
+            _cdb_startflushers(db);
+        if (db->rcache[0] || db->pcache[0])
+            _cdb_startevictor(db);
     } else {
         /* no persistent storage under MEMDB mode */
         db->vio = NULL;
@@ -387,97 +1650,308 @@ int cdb_open(CDB *db, const char *file_name, int mode)
         db->mtable = NULL;
     }
 
-    if (db->bf || ((mode & CDB_PAGEWARMUP) && db->pcache)) {
+    if (db->bf || ((mode & CDB_PAGEWARMUP) && db->pcache[0])) {
         /* fill the bloom filter if it is enabled, and fill the page cache */
         _cdb_pagewarmup(db, !!db->bf);
     }
 
+    if ((mode & CDB_RCACHEWARMUP) && db->rcache[0] && db->vio) {
+        /* after the page cache, the index lookups to validate records go faster */
+        _cdb_rcachewarmup(db);
+    }
+
     /* reset the statistic info */
     cdb_stat(db, NULL);
     db->opened = true;
     return 0;
 
 ERRRET:
-    if (db->rcache)
-        cdb_ht_destroy(db->rcache);
-    if (db->pcache)
-        cdb_ht_destroy(db->pcache);
-    if (db->dpcache)
-        cdb_ht_destroy(db->dpcache);
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        if (db->rcache[i])
+            cdb_ht_destroy(db->rcache[i]);
+        if (db->pcache[i])
+            cdb_ht_destroy(db->pcache[i]);
+        if (db->dpcache[i])
+            cdb_ht_destroy(db->dpcache[i]);
+    }
+    if (db->epoch)
+        cdb_epoch_destroy(db->epoch);
+    if (db->rcsketch)
+        cdb_sketch_destroy(db->rcsketch);
+    if (db->pcsketch)
+        cdb_sketch_destroy(db->pcsketch);
     if (db->bf)
         cdb_bf_destroy(db->bf);
+    if (db->negcache)
+        cdb_fpc_destroy(db->negcache);
+    if (db->offcache)
+        cdb_fpc_destroy(db->offcache);
+    if (db->rcghost)
+        cdb_fpc_destroy(db->rcghost);
+    if (db->pcghost)
+        cdb_fpc_destroy(db->pcghost);
     cdb_bgtask_stop(db->bgtask);
     _cdb_defparam(db);
     return -1;
 }
 
 
-/* check if the page cache size exceed the limit. clean oldest page if necessary */
-static void _cdb_pageout(CDB *db)
+/* evict oldest pages from a page cache shard until it takes no more than 'limit' bytes,
+ clean pages go first */
+static void _cdb_pageout(CDB *db, uint32_t sid, uint64_t limit)
 {
-    while (PCOVERFLOW(db)) {
-        if (db->pcache->num) {
+    CDBHASHTABLE *pcache = db->pcache[sid];
+    CDBHASHTABLE *dpcache = db->dpcache[sid];
+
+    while (cdb_ht_size(dpcache) + cdb_ht_size(pcache) > limit) {
+        if (cdb_ht_num(pcache)) {
             /* clean page cache is prior */
-            cdb_lock_lock(db->pclock);
-            cdb_ht_removetail(db->pcache);
-            cdb_lock_unlock(db->pclock);
-        } else if (db->dpcache->num) {
+            CDBHTITEM *item;
+            cdb_lock_lock(db->pclock[sid]);
+            item = cdb_ht_poptail(pcache);
+            if (item && db->pcghost)
+                cdb_fpc_set(db->pcghost, PGHOSTHASH(*(uint32_t*)cdb_ht_itemkey(pcache, item)), 0, NULL);
+            if (item)
+                cdb_ht_freeitem(pcache, item);
+            cdb_lock_unlock(db->pclock[sid]);
+        } else if (cdb_ht_num(dpcache)) {
             CDBHTITEM *item;
             uint32_t bid;
             FOFF off;
-            cdb_lock_lock(db->dpclock);
-            item = cdb_ht_gettail(db->dpcache);    
+            cdb_lock_lock(db->dpclock[sid]);
+            item = cdb_ht_gettail(dpcache);    
             if (item == NULL) {
-                cdb_lock_unlock(db->dpclock);
+                cdb_lock_unlock(db->dpclock[sid]);
                 break;
             }
 
-            bid = *(uint32_t*)cdb_ht_itemkey(db->dpcache, item);
+            bid = *(uint32_t*)cdb_ht_itemkey(dpcache, item);
             /* must lock the main table inside the dpclock protection */
-            if (cdb_lock_trylock(db->mlock[bid % MLOCKNUM]) < 0) {
+            if (cdb_lock_trylock(MLOCK(db, bid))) {
                 /* avoid dead lock since dpclock is holding */
-                cdb_lock_unlock(db->dpclock);
+                cdb_lock_unlock(db->dpclock[sid]);
                 /* do nothing this time */
                 break;
             }
-            cdb_ht_poptail(db->dpcache);
-            cdb_lock_unlock(db->dpclock);
+            /* remove the very item, a reader may have marked the tail meanwhile and
+             poptail would take another page whose bucket is not locked */
+            cdb_ht_del(dpcache, &bid, SI4);
+            cdb_lock_unlock(db->dpclock[sid]);
 
             /* write out dirty page */
             struct timespec ts;
             _cdb_timerreset(&ts);
-            db->vio->wpage(db->vio, (CDBPAGE*)cdb_ht_itemval(db->dpcache, item), &off);
-            db->wcount++;
-            db->wtime += _cdb_timermicrosec(&ts);
+            db->vio->wpage(db->vio, (CDBPAGE*)cdb_ht_itemval(dpcache, item), &off);
+            STATADD(db, wcount, 1);
+            STATADD(db, wtime, _cdb_timermicrosec(&ts));
             db->mtable[bid] = off;
-            cdb_lock_unlock(db->mlock[bid % MLOCKNUM]);
-            free(item);
+            cdb_lock_unlock(MLOCK(db, bid));
+            cdb_ht_freeitem(dpcache, item);
+            if (db->pcghost)
+                cdb_fpc_set(db->pcghost, PGHOSTHASH(bid), 0, NULL);
+        } else
+            break;
+    }
+}
+
+
+/* evict oldest records from a record cache shard until it takes no more than 'limit' bytes */
+static void _cdb_recout(CDB *db, uint32_t sid, uint64_t limit)
+{
+    while (cdb_ht_size(db->rcache[sid]) > limit) {
+        CDBHASHTABLE *rcache = db->rcache[sid];
+        CDBHTITEM *item = NULL;
+        bool empty;
+        cdb_lock_lock(db->rclock[sid]);
+        empty = (rcache->num == 0);
+        if (!empty)
+            item = cdb_ht_poptail(rcache);
+        if (item && db->rcghost)
+            cdb_fpc_set(db->rcghost, CDBHASH64(cdb_ht_itemkey(rcache, item), item->ksize), 0, NULL);
+        if (item)
+            cdb_ht_freeitem(rcache, item);
+        cdb_lock_unlock(db->rclock[sid]);
+        /* only the table itself is left */
+        if (empty)
+            break;
+    }
+}
+
+
+/* called after a page cache shard is added to. The evictor keeps it below the high watermark,
+ the caller evicts by itself only if the shard is past the limit */
+static void _cdb_pccheck(CDB *db, uint32_t sid)
+{
+    if (PCOVER(db, sid, EVICTHIGHRATIO))
+        _cdb_wakeevictor(db);
+    if (PCOVERFLOW(db, sid)) {
+        struct timespec ts;
+        _cdb_timerreset(&ts);
+        _cdb_pageout(db, sid, PCLIMIT(db) / CACHESHARDNUM);
+        STATADD(db, evstall, 1);
+        STATADD(db, evstalltime, _cdb_timermicrosec(&ts));
+    }
+}
+
+
+/* same as above for a record cache shard */
+static void _cdb_rccheck(CDB *db, uint32_t sid)
+{
+    if (RCOVER(db, sid, EVICTHIGHRATIO))
+        _cdb_wakeevictor(db);
+    if (RCOVERFLOW(db, sid)) {
+        struct timespec ts;
+        _cdb_timerreset(&ts);
+        _cdb_recout(db, sid, RCLIMIT(db) / CACHESHARDNUM);
+        STATADD(db, evstall, 1);
+        STATADD(db, evstalltime, _cdb_timermicrosec(&ts));
+    }
+}
+
+
+/* the evictor thread brings cache shards past the high watermark down to the low one,
+ it runs once a second or when woken */
+static void *_cdb_evictorthread(void *arg)
+{
+    CDB *db = (CDB *)arg;
+    sigset_t smask;
+
+    /* block all signals coming into current thread */
+    sigfillset(&smask);
+    pthread_sigmask(SIG_BLOCK, &smask, NULL);
+
+    pthread_mutex_lock(&db->evmutex);
+    while(!db->evstop) {
+        struct timespec timeout;
+
+        __atomic_store_n(&db->evwake, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&db->evmutex);
+        for(int i = 0; i < CACHESHARDNUM; i++) {
+            if (RCOVER(db, i, EVICTHIGHRATIO))
+                _cdb_recout(db, i, RCLIMIT(db) * EVICTLOWRATIO / 100 / CACHESHARDNUM);
+            if (PCOVER(db, i, EVICTHIGHRATIO))
+                _cdb_pageout(db, i, PCLIMIT(db) * EVICTLOWRATIO / 100 / CACHESHARDNUM);
         }
+        pthread_mutex_lock(&db->evmutex);
+
+        /* woken during the round */
+        if (db->evwake || db->evstop)
+            continue;
+        timeout.tv_sec = time(NULL) + 1;
+        timeout.tv_nsec = 0;
+        pthread_cond_timedwait(&db->evcond, &db->evmutex, &timeout);
     }
+    pthread_mutex_unlock(&db->evmutex);
+    return NULL;
 }
 
 
-/* check if the record cache size exceed the limit. clean oldest record if necessary */
-static void _cdb_recout(CDB *db)
+static void _cdb_startevictor(CDB *db)
 {
-    while (RCOVERFLOW(db)) {
-        cdb_lock_lock(db->rclock);
-        if (db->rcache->num)
-            cdb_ht_removetail(db->rcache);
-        cdb_lock_unlock(db->rclock);
+    pthread_mutex_init(&db->evmutex, NULL);
+    pthread_cond_init(&db->evcond, NULL);
+    db->evwake = db->evstop = false;
+    db->evrunning = true;
+    if (pthread_create(&db->evtid, NULL, _cdb_evictorthread, db)) {
+        /* callers evict by themselves */
+        db->evrunning = false;
+        pthread_cond_destroy(&db->evcond);
+        pthread_mutex_destroy(&db->evmutex);
     }
 }
 
 
+static void _cdb_stopevictor(CDB *db)
+{
+    if (!db->evrunning)
+        return;
+
+    pthread_mutex_lock(&db->evmutex);
+    db->evstop = true;
+    pthread_cond_signal(&db->evcond);
+    pthread_mutex_unlock(&db->evmutex);
+    pthread_join(db->evtid, NULL);
+    pthread_cond_destroy(&db->evcond);
+    pthread_mutex_destroy(&db->evmutex);
+    db->evrunning = false;
+}
+
+
+static void _cdb_wakeevictor(CDB *db)
+{
+    /* no evictor for a memdb, or woken already and no round started since then */
+    if (!db->evrunning || __atomic_load_n(&db->evwake, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&db->evmutex);
+    __atomic_store_n(&db->evwake, true, __ATOMIC_RELAXED);
+    pthread_cond_signal(&db->evcond);
+    pthread_mutex_unlock(&db->evmutex);
+}
+
+
+/* TinyLFU admission, called with rclock of the shard holding. If the shard is full, 
+ a new record replaces the eviction victim only if it is accessed at least as frequently.
+ Hot records are protected from scans, ties are admitted so recency still counts among cold ones */
+static bool _cdb_rcadmit(CDB *db, uint32_t sid, uint64_t hash, uint32_t size)
+{
+    CDBHASHTABLE *rcache = db->rcache[sid];
+    CDBHTITEM *victim;
+    uint64_t vhash;
+
+    if (db->rcsketch == NULL || rcache->size + size <= RCLIMIT(db) / CACHESHARDNUM)
+        return true;
+
+    victim = cdb_ht_gettail(rcache);
+    if (victim == NULL)
+        return true;
+
+    vhash = CDBHASH64(cdb_ht_itemkey(rcache, victim), victim->ksize);
+    if (cdb_sketch_estimate(db->rcsketch, hash) >= cdb_sketch_estimate(db->rcsketch, vhash))
+        return true;
+
+    STATADD(db, rcreject, 1);
+    if (db->rcghost)
+        cdb_fpc_set(db->rcghost, hash, 0, NULL);
+    return false;
+}
+
+
+/* same as above for a clean page read from disk, called with pclock of the shard holding */
+static bool _cdb_pcadmit(CDB *db, uint32_t sid, uint32_t bid, uint32_t size)
+{
+    CDBHASHTABLE *pcache = db->pcache[sid];
+    CDBHTITEM *victim;
+
+    if (pcache->size + cdb_ht_size(db->dpcache[sid]) + size <= PCLIMIT(db) / CACHESHARDNUM)
+        return true;
+
+    victim = cdb_ht_gettail(pcache);
+    if (victim == NULL)
+        /* only dirty pages in the shard, let _cdb_pageout flush them */
+        return true;
+
+    if (cdb_sketch_estimate(db->pcsketch, bid) 
+        >= cdb_sketch_estimate(db->pcsketch, *(uint32_t*)cdb_ht_itemkey(pcache, victim)))
+        return true;
+
+    STATADD(db, pcreject, 1);
+    if (db->pcghost)
+        cdb_fpc_set(db->pcghost, PGHOSTHASH(bid), 0, NULL);
+    return false;
+}
+
+
 /* get all offsets from index(page) by key, even if only one of them at most is valid.
  Others are due to the hash collision */
 int cdb_getoff(CDB *db, uint64_t hash, FOFF **offs, int locked) 
 {
-    char sbuf[SBUFSIZE];
     CDBPAGE *page = NULL;
     int rnum;
     bool incache = true;
     uint32_t bid = (hash >> 24) % db->hsize;
+    uint32_t sid = PCSHARD(bid);
+    CDBHASHTABLE *pcache = db->pcache[sid], *dpcache = db->dpcache[sid];
     PHASH phash;
 
     phash.i1 = hash & 0xff;
@@ -494,41 +1968,44 @@ int cdb_getoff(CDB *db, uint64_t hash, FOFF **offs, int locked)
         cdb_lock_unlock(db->bflock);
     }
 
-    if (locked == CDB_NOTLOCKED) cdb_lock_lock(db->mlock[bid % MLOCKNUM]);
-    /* page exists in clean page cache? */
-    if (db->pcache) {
-        cdb_lock_lock(db->pclock);
-        page = cdb_ht_get2(db->pcache, &bid, SI4, true);
-        cdb_lock_unlock(db->pclock);
-    }
-
-    /* not in pcache, exists in dirty page cache? */
-    if (page == NULL && db->dpcache) {
-        cdb_lock_lock(db->dpclock);
-        page = cdb_ht_get2(db->dpcache, &bid, SI4, true);
-        cdb_lock_unlock(db->dpclock);
+    if (db->pcsketch)
+        cdb_sketch_add(db->pcsketch, bid);
+
+    if (locked == CDB_NOTLOCKED) cdb_lock_rdlock(MLOCK(db, bid));
+    /* the page content is stable under mlock, the caches are looked up lock-free.
+     A page evicted meanwhile stays valid until we leave the epoch */
+    if (pcache) {
+        cdb_epoch_enter(db->epoch);
+        /* page exists in clean page cache? */
+        page = cdb_ht_rdget(pcache, &bid, SI4, NULL, true);
+        /* not in pcache, exists in dirty page cache? */
+        if (page == NULL)
+            page = cdb_ht_rdget(dpcache, &bid, SI4, NULL, true);
+        if (page == NULL)
+            cdb_epoch_exit(db->epoch);
     }
 
     if (page == NULL) {
         /* not in dpcache either, read from disk */
         incache = false;
-        db->pcmiss++;
-        /* page stays in stack by default */
-        page = (CDBPAGE *)sbuf;
+        STATADD(db, pcmiss, 1);
+        if (_cdb_ghosthit(db->pcghost, PGHOSTHASH(bid)))
+            STATADD(db, pcghosthit, 1);
+        /* page is read into scratch buffer of the thread */
+        page = (CDBPAGE *)cdb_scratch_get(PAGESBUFSIZE);
         if (OFFNOTNULL(db->mtable[bid])) {
             /* page offset not null in main table */
             int ret;
             struct timespec ts;
             _cdb_timerreset(&ts);
             ret = db->vio->rpage(db->vio, &page, db->mtable[bid]);
-            db->rcount++;
-            db->rtime += _cdb_timermicrosec(&ts);
+            STATADD(db, rcount, 1);
+            STATADD(db, rtime, _cdb_timermicrosec(&ts));
 
             /* read page error, return */
             if (ret < 0) {
-                if (locked == CDB_NOTLOCKED) cdb_lock_unlock(db->mlock[bid % MLOCKNUM]);
-                if (page != (CDBPAGE *)sbuf)
-                    free(page);
+                if (locked == CDB_NOTLOCKED) cdb_lock_unlock(MLOCK(db, bid));
+                cdb_scratch_put(page);
                 return -1;
             }
         } else {
@@ -538,7 +2015,7 @@ int cdb_getoff(CDB *db, uint64_t hash, FOFF **offs, int locked)
             OFFZERO(page->ooff);
         }
     } else {
-        db->pchit++;
+        STATADD(db, pchit, 1);
     }
 
     rnum = 0;
@@ -557,23 +2034,22 @@ int cdb_getoff(CDB *db, uint64_t hash, FOFF **offs, int locked)
         }
     }
 
-    if (!incache) {
-        /* set into clean page cache if not exists before */
-        if (db->pcache) {
-            cdb_lock_lock(db->pclock);
-            cdb_ht_insert2(db->pcache, &bid, SI4, page, MPAGESIZE(page));
-            cdb_lock_unlock(db->pclock);
-        }
-        /* if page now points to heap memory, free it */
-        if (page != (CDBPAGE *)sbuf) {
-            free(page);
+    if (incache)
+        cdb_epoch_exit(db->epoch);
+    else {
+        /* set into clean page cache if not exists before, and it's hot enough */
+        if (pcache) {
+            cdb_lock_lock(db->pclock[sid]);
+            if (_cdb_pcadmit(db, sid, bid, sizeof(CDBHTITEM) + SI4 + MPAGESIZE(page)))
+                cdb_ht_insert2(pcache, &bid, SI4, page, MPAGESIZE(page));
+            cdb_lock_unlock(db->pclock[sid]);
         }
+        cdb_scratch_put(page);
     }
-    if (locked == CDB_NOTLOCKED) cdb_lock_unlock(db->mlock[bid % MLOCKNUM]);
+    if (locked == CDB_NOTLOCKED) cdb_lock_unlock(MLOCK(db, bid));
 
     /* check page cache overflow */
-    if (PCOVERFLOW(db))
-        _cdb_pageout(db);
+    _cdb_pccheck(db, sid);
 
     return rnum;
 }
@@ -583,50 +2059,58 @@ int cdb_getoff(CDB *db, uint64_t hash, FOFF **offs, int locked)
  off indicates its previous offset, noff is the new offset. return negative if not found */
 int cdb_replaceoff(CDB *db, uint64_t hash, FOFF off, FOFF noff, int locked)
 {
-    char sbuf[SBUFSIZE];
     CDBPAGE *page = NULL;
     CDBHTITEM *pitem = NULL;
     bool indpcache = false;
     uint32_t bid = (hash >> 24) % db->hsize;
+    uint32_t sid = PCSHARD(bid);
+    CDBHASHTABLE *pcache = db->pcache[sid], *dpcache = db->dpcache[sid];
     PHASH phash;
     bool found = false;
 
     phash.i1 = hash & 0xff;
     phash.i2 = (hash >> 8) & 0xffff;
 
-    if (locked == CDB_NOTLOCKED) cdb_lock_lock(db->mlock[bid % MLOCKNUM]);
-    if (db->pcache) {
+    if (locked == CDB_NOTLOCKED) cdb_lock_lock(MLOCK(db, bid));
+    /* the key is alive, it mustn't be remembered as missing */
+    if (db->negcache)
+        cdb_fpc_del(db->negcache, hash);
+    /* the record is moved */
+    if (db->offcache)
+        cdb_fpc_del(db->offcache, hash);
+    if (pcache) {
         /* in clean page cache, since it would be modified, it should be deleted from pcache */
-        cdb_lock_lock(db->pclock);
-        pitem = cdb_ht_del(db->pcache, &bid, SI4);
-        cdb_lock_unlock(db->pclock);
+        cdb_lock_lock(db->pclock[sid]);
+        pitem = cdb_ht_del(pcache, &bid, SI4);
+        cdb_lock_unlock(db->pclock[sid]);
         if (pitem)
-            page = (CDBPAGE *)cdb_ht_itemval(db->pcache, pitem);
+            page = (CDBPAGE *)cdb_ht_itemval(pcache, pitem);
     }
-    if (page == NULL && db->dpcache) {
+    if (page == NULL && dpcache) {
         /* not in pcache, but in dirty page cache */
-        cdb_lock_lock(db->dpclock);
-        page = cdb_ht_get2(db->dpcache, &bid, SI4, true);
-        cdb_lock_unlock(db->dpclock);
+        cdb_lock_lock(db->dpclock[sid]);
+        page = cdb_ht_get2(dpcache, &bid, SI4, true);
+        cdb_lock_unlock(db->dpclock[sid]);
         if (page)
             indpcache = true;
     }
     if (page == NULL) {
         /* not exists either, read from disk */
-        db->pcmiss++;
-        page = (CDBPAGE *)sbuf;
+        STATADD(db, pcmiss, 1);
+        if (_cdb_ghosthit(db->pcghost, PGHOSTHASH(bid)))
+            STATADD(db, pcghosthit, 1);
+        page = (CDBPAGE *)cdb_scratch_get(PAGESBUFSIZE);
         if (OFFNOTNULL(db->mtable[bid])) {
             int ret;
             struct timespec ts;
             _cdb_timerreset(&ts);
             ret = db->vio->rpage(db->vio, &page, db->mtable[bid]);
-            db->rcount++;
-            db->rtime += _cdb_timermicrosec(&ts);
+            STATADD(db, rcount, 1);
+            STATADD(db, rtime, _cdb_timermicrosec(&ts));
             
             if (ret < 0) {
-                if (locked == CDB_NOTLOCKED) cdb_lock_unlock(db->mlock[bid % MLOCKNUM]);
-                if (page != (CDBPAGE *)sbuf)
-                    free(page);
+                if (locked == CDB_NOTLOCKED) cdb_lock_unlock(MLOCK(db, bid));
+                cdb_scratch_put(page);
                 return -1;
             }
         } else {
@@ -636,7 +2120,7 @@ int cdb_replaceoff(CDB *db, uint64_t hash, FOFF off, FOFF noff, int locked)
             OFFZERO(page->ooff);
         }
     } else {
-        db->pchit++;
+        STATADD(db, pchit, 1);
     }
 
     /* check and modify */
@@ -649,50 +2133,53 @@ int cdb_replaceoff(CDB *db, uint64_t hash, FOFF off, FOFF noff, int locked)
         }
     }
 
-    if (db->dpcache && !indpcache) {
+    if (dpcache && !indpcache) {
         /* if page already dirty in cache, need not do anything */
         /* dirty page cache is enabled but not exists before */
         if (pitem) {
             /* pitem not NULL indicates it belongs to pcache */
             if (found) {
                 /* modified page */
-                cdb_lock_lock(db->dpclock);
-                cdb_ht_insert(db->dpcache, pitem);
-                cdb_lock_unlock(db->dpclock);
+                cdb_lock_lock(db->dpclock[sid]);
+                cdb_ht_insert(dpcache, pitem);
+                cdb_lock_unlock(db->dpclock[sid]);
             } else {
                 /* got from pcache, but not modified */
-                cdb_lock_lock(db->pclock);
-                cdb_ht_insert(db->pcache, pitem);
-                cdb_lock_unlock(db->pclock);
+                cdb_lock_lock(db->pclock[sid]);
+                cdb_ht_insert(pcache, pitem);
+                cdb_lock_unlock(db->pclock[sid]);
             }
             /* page belongs to memory in 'cache', must not free */
         } else if (page != NULL) {
             /* page read from disk, but not in cache */
-            cdb_lock_lock(db->dpclock);
-            cdb_ht_insert2(db->dpcache, &bid, SI4, page, MPAGESIZE(page));
-            cdb_lock_unlock(db->dpclock);
+            cdb_lock_lock(db->dpclock[sid]);
+            cdb_ht_insert2(dpcache, &bid, SI4, page, MPAGESIZE(page));
+            cdb_lock_unlock(db->dpclock[sid]);
             /* the 'page' won't be use anymore */
-            if (page != (CDBPAGE *)sbuf) 
-                free(page);
+            cdb_scratch_put(page);
         }
-    } else if (!db->dpcache){
+    } else if (!dpcache){
         /* no page cache. Write out dirty page immediately */
         FOFF poff;
         struct timespec ts;
         _cdb_timerreset(&ts);
         db->vio->wpage(db->vio, page, &poff);
-        db->wcount++;
-        db->wtime += _cdb_timermicrosec(&ts);
+        STATADD(db, wcount, 1);
+        STATADD(db, wtime, _cdb_timermicrosec(&ts));
 
         db->mtable[bid] = poff;
-        if (page != (CDBPAGE *)sbuf) 
-                free(page);
+        if (pitem)
+            cdb_ht_freeitem(pcache, pitem);
+        else
+            cdb_scratch_put(page);
     }
-    if (locked == CDB_NOTLOCKED) cdb_lock_unlock(db->mlock[bid % MLOCKNUM]);
+    if (locked == CDB_NOTLOCKED) cdb_lock_unlock(MLOCK(db, bid));
 
+    /* let the flushers write out the oldest dirty pages before the cache gets full */
+    if (DPOVERHIGH(db, sid))
+        _cdb_wakeflusher(db, sid);
     /* check page cache overflow */
-    if (PCOVERFLOW(db))
-        _cdb_pageout(db);
+    _cdb_pccheck(db, sid);
 
     return 0;
 }
@@ -701,60 +2188,62 @@ int cdb_replaceoff(CDB *db, uint64_t hash, FOFF off, FOFF noff, int locked)
 /* insert/delete a key-offset pair from index page */
 int cdb_updatepage(CDB *db, uint64_t hash, FOFF off, int opt, int locked)
 {
-    char sbuf[SBUFSIZE], sbuf2[SBUFSIZE];
     CDBPAGE *page = NULL, *npage = NULL;
     CDBHTITEM *pitem = NULL, *nitem = NULL;
     CDBHASHTABLE *tmpcache = NULL;
     CDBLOCK *tmpclock = NULL;
     int npsize = 0;
     uint32_t bid = (hash >> 24) % db->hsize;
+    uint32_t sid = PCSHARD(bid);
+    CDBHASHTABLE *pcache = db->pcache[sid], *dpcache = db->dpcache[sid];
     PHASH phash;
 
     phash.i1 = hash & 0xff;
     phash.i2 = (hash >> 8) & 0xffff;
 
-    if (locked == CDB_NOTLOCKED) cdb_lock_lock(db->mlock[bid % MLOCKNUM]);
+    if (locked == CDB_NOTLOCKED) cdb_lock_lock(MLOCK(db, bid));
     /* firstly, try move the page out of the cache if possible, 
     it assumes that the page would be modified(pair exists) */
-    if (db->pcache) {
+    if (pcache) {
         /* try clean page cache */
-        cdb_lock_lock(db->pclock);
-        pitem = cdb_ht_del(db->pcache, &bid, SI4);
-        cdb_lock_unlock(db->pclock);
+        cdb_lock_lock(db->pclock[sid]);
+        pitem = cdb_ht_del(pcache, &bid, SI4);
+        cdb_lock_unlock(db->pclock[sid]);
         if (pitem) {
-            page = (CDBPAGE *)cdb_ht_itemval(db->pcache, pitem);
-            tmpcache = db->pcache;
-            tmpclock = db->pclock;
+            page = (CDBPAGE *)cdb_ht_itemval(pcache, pitem);
+            tmpcache = pcache;
+            tmpclock = db->pclock[sid];
         }
     }
-    if (page == NULL && db->dpcache) {
+    if (page == NULL && dpcache) {
         /* try dirty page cache */
-        cdb_lock_lock(db->dpclock);
-        pitem = cdb_ht_del(db->dpcache, &bid, SI4);
-        cdb_lock_unlock(db->dpclock);
+        cdb_lock_lock(db->dpclock[sid]);
+        pitem = cdb_ht_del(dpcache, &bid, SI4);
+        cdb_lock_unlock(db->dpclock[sid]);
         if (pitem) {
-            page = (CDBPAGE *)cdb_ht_itemval(db->dpcache, pitem);
-            tmpcache = db->dpcache;
-            tmpclock = db->dpclock;
+            page = (CDBPAGE *)cdb_ht_itemval(dpcache, pitem);
+            tmpcache = dpcache;
+            tmpclock = db->dpclock[sid];
         }
     }
 
     if (page == NULL) {
-        db->pcmiss++;
-        page = (CDBPAGE *)sbuf;
+        STATADD(db, pcmiss, 1);
+        if (_cdb_ghosthit(db->pcghost, PGHOSTHASH(bid)))
+            STATADD(db, pcghosthit, 1);
+        page = (CDBPAGE *)cdb_scratch_get(PAGESBUFSIZE);
         /* doesn't exist in cache, read from disk */
         if (OFFNOTNULL(db->mtable[bid])) {
             int ret;
             struct timespec ts;
             _cdb_timerreset(&ts);
             ret = db->vio->rpage(db->vio, &page, db->mtable[bid]);
-            db->rcount++;
-            db->rtime += _cdb_timermicrosec(&ts);
+            STATADD(db, rcount, 1);
+            STATADD(db, rtime, _cdb_timermicrosec(&ts));
 
             if (ret < 0) {
-                if (locked == CDB_NOTLOCKED) cdb_lock_unlock(db->mlock[bid % MLOCKNUM]);
-                if (page != (CDBPAGE *)sbuf)
-                    free(page);
+                if (locked == CDB_NOTLOCKED) cdb_lock_unlock(MLOCK(db, bid));
+                cdb_scratch_put(page);
                 return -1;
             }
         } else {
@@ -764,7 +2253,7 @@ int cdb_updatepage(CDB *db, uint64_t hash, FOFF off, int opt, int locked)
             OFFZERO(page->ooff);
         }
     } else {
-        db->pchit++;
+        STATADD(db, pchit, 1);
     }
 
     npsize = MPAGESIZE(page);
@@ -776,16 +2265,13 @@ int cdb_updatepage(CDB *db, uint64_t hash, FOFF off, int opt, int locked)
     else if (opt == CDB_PAGEINSERTOFF && page->cap == page->num) {
     /* get a new page, from dirty page cache if possible */
         npsize = MPAGESIZE(page) + CDB_PAGEINCR * sizeof(PITEM);
-        if (db->dpcache) {
-            nitem = cdb_ht_newitem(db->dpcache, SI4, npsize);
-            *(uint32_t*)cdb_ht_itemkey(db->dpcache, nitem) = bid;
-            npage = (CDBPAGE *)cdb_ht_itemval(db->dpcache, nitem);
+        if (dpcache) {
+            nitem = cdb_ht_newitem(dpcache, SI4, npsize);
+            *(uint32_t*)cdb_ht_itemkey(dpcache, nitem) = bid;
+            npage = (CDBPAGE *)cdb_ht_itemval(dpcache, nitem);
         } else {
-            /* no dpcache, use stack if size fits */
-            if (npsize > SBUFSIZE) 
-                npage = (CDBPAGE *)malloc(npsize);
-            else
-                npage = (CDBPAGE *)sbuf2;
+            /* no dpcache, use another scratch buffer */
+            npage = (CDBPAGE *)cdb_scratch_get(npsize);
         }
 
         /* initialize the new page */
@@ -798,12 +2284,12 @@ int cdb_updatepage(CDB *db, uint64_t hash, FOFF off, int opt, int locked)
         npage->cap = page->cap + CDB_PAGEINCR;
         npage->num = page->num;
         memcpy(npage->items, page->items, page->num * sizeof(PITEM)); 
-        /* old page got from cache */
+        /* old page got from cache, readers may still see it */
         if (pitem)
-            free(pitem);
-        /* old page read from disk, if in stack? */
-        else if (page != (CDBPAGE *)sbuf)
-            free(page);
+            cdb_ht_freeitem(tmpcache, pitem);
+        /* old page read from disk */
+        else
+            cdb_scratch_put(page);
 
         page = npage;
         pitem = nitem;
@@ -820,9 +2306,9 @@ int cdb_updatepage(CDB *db, uint64_t hash, FOFF off, int opt, int locked)
                 {
                     found = true;
                     /* records num is consistant with index */
-                    cdb_lock_lock(db->stlock);
-                    db->rnum--;
-                    cdb_lock_unlock(db->stlock);
+                    __atomic_fetch_sub(&db->rnum, 1, __ATOMIC_RELAXED);
+                    if (db->offcache)
+                        cdb_fpc_del(db->offcache, hash);
                 }
             }
             if (found && i + 1 < page->num)
@@ -848,9 +2334,12 @@ int cdb_updatepage(CDB *db, uint64_t hash, FOFF off, int opt, int locked)
             page->items[page->num].off = off;
             page->num++;
             /* records num is consistant with index */
-            cdb_lock_lock(db->stlock);
-            db->rnum++;
-            cdb_lock_unlock(db->stlock);
+            __atomic_fetch_add(&db->rnum, 1, __ATOMIC_RELAXED);
+            /* it's protected by mlock as the insertion into negative cache */
+            if (db->negcache)
+                cdb_fpc_del(db->negcache, hash);
+            if (db->offcache)
+                cdb_fpc_del(db->offcache, hash);
             if (db->bf) {
                 uint64_t bfkey = (((hash >> 24) % db->hsize) << 24) | (hash & 0xffffff);
                 cdb_lock_lock(db->bflock);
@@ -868,36 +2357,34 @@ int cdb_updatepage(CDB *db, uint64_t hash, FOFF off, int opt, int locked)
             cdb_ht_insert(tmpcache, pitem);
             cdb_lock_unlock(tmpclock);
         } else {
-            if (page != (CDBPAGE *)sbuf2
-                    && page != (CDBPAGE *)sbuf)
-                free(page);
+            cdb_scratch_put(page);
         }
-        if (locked == CDB_NOTLOCKED) cdb_lock_unlock(db->mlock[bid % MLOCKNUM]);
+        if (locked == CDB_NOTLOCKED) cdb_lock_unlock(MLOCK(db, bid));
         return -1;
     } else {
         if (pitem) {
-            cdb_lock_lock(db->dpclock);
-            cdb_ht_insert(db->dpcache, pitem);
-            cdb_lock_unlock(db->dpclock);
+            cdb_lock_lock(db->dpclock[sid]);
+            cdb_ht_insert(dpcache, pitem);
+            cdb_lock_unlock(db->dpclock[sid]);
         } else {
             struct timespec ts;
             _cdb_timerreset(&ts);
             db->vio->wpage(db->vio, page, &off);
-            db->wcount++;
-            db->wtime += _cdb_timermicrosec(&ts);
+            STATADD(db, wcount, 1);
+            STATADD(db, wtime, _cdb_timermicrosec(&ts));
 
             db->mtable[bid] = off;
-            if (page != (CDBPAGE *)sbuf2
-                    && page != (CDBPAGE *)sbuf)
-                free(page);
+            cdb_scratch_put(page);
         }
     }
 
-    if (locked == CDB_NOTLOCKED) cdb_lock_unlock(db->mlock[bid % MLOCKNUM]);
+    if (locked == CDB_NOTLOCKED) cdb_lock_unlock(MLOCK(db, bid));
 
+    /* let the flushers write out the oldest dirty pages before the cache gets full */
+    if (DPOVERHIGH(db, sid))
+        _cdb_wakeflusher(db, sid);
     /* check page cache overflow */
-    if (PCOVERFLOW(db))
-        _cdb_pageout(db);
+    _cdb_pccheck(db, sid);
 
     return 0;
 }
@@ -941,21 +2428,24 @@ int cdb_set2(CDB *db, const char *key, int ksize, const char *val, int vsize, in
     FOFF ooff, noff;
     uint32_t now = time(NULL);
     uint64_t hash;
-    uint32_t lockid;
+    uint32_t lockid, sid;
     bool expired = false;
+    bool cached = false;
  
+    hash = CDBHASH64(key, ksize);
+    sid = RCSHARD(hash);
     if (db->vio == NULL) {
         /* if it is a memdb, just operate on the record cache and return */
-        cdb_lock_lock(db->rclock);
-        cdb_ht_insert2(db->rcache, key, ksize, val, vsize);
-        cdb_lock_unlock(db->rclock);
-        if (RCOVERFLOW(db))
-            _cdb_recout(db);
+        cdb_lock_lock(db->rclock[sid]);
+        cdb_ht_insert2(db->rcache[sid], key, ksize, val, vsize);
+        cdb_lock_unlock(db->rclock[sid]);
+        _cdb_rccheck(db, sid);
         return 0;
     }
 
-    hash = CDBHASH64(key, ksize);
-    lockid = (hash >> 24) % db->hsize % MLOCKNUM;
+    lockid = (hash >> 24) % db->hsize % db->mlocknum;
+    if (db->rcsketch)
+        cdb_sketch_add(db->rcsketch, hash);
     OFFZERO(rec.ooff);
     OFFZERO(ooff);
     rec.osize = 0;
@@ -967,20 +2457,20 @@ int cdb_set2(CDB *db, const char *key, int ksize, const char *val, int vsize, in
     rec.expire = expire? now + expire : 0;
         
     cdb_lock_lock(db->mlock[lockid]);
-    if (db->rcache) {
+    if (db->rcache[sid]) {
         /* if record already exists, get its old meta info */
         int item_vsize;
         char *cval;
         uint32_t old_expire = 0;
-        cdb_lock_lock(db->rclock);
-        cval = cdb_ht_get(db->rcache, key, ksize, &item_vsize, false);
+        cdb_lock_lock(db->rclock[sid]);
+        cval = cdb_ht_get(db->rcache[sid], key, ksize, &item_vsize, false);
         if (cval) {
             /* record already exists */
-            ooff = rec.ooff = *(FOFF*)cval;
-            rec.osize = item_vsize - SFOFF - SI4;
-            old_expire = *(uint32_t*)(cval + SFOFF); 
+            cached = true;
+            rec.osize = item_vsize - _cdb_rcgethead(cval, &ooff, &old_expire);
+            rec.ooff = ooff;
         }
-        cdb_lock_unlock(db->rclock);
+        cdb_lock_unlock(db->rclock[sid]);
         if (old_expire && old_expire <= now)
             /* once exist but expired? */
             expired = true;
@@ -989,28 +2479,23 @@ int cdb_set2(CDB *db, const char *key, int ksize, const char *val, int vsize, in
     if (OFFNULL(ooff)) {
         FOFF soffs[SFOFFNUM];
         FOFF *soff = soffs;
-        char sbuf[SBUFSIZE];
-        CDBREC *rrec = (CDBREC*)sbuf;
+        CDBREC *rrec = (CDBREC*)cdb_scratch_get(RECSBUFSIZE(db));
         
         int retnum;
         if ((retnum = cdb_getoff(db, hash, &soff, CDB_LOCKED)) < 0) {
             cdb_lock_unlock(db->mlock[lockid]);
+            cdb_scratch_put(rrec);
             return -1;
         }
             
         for(int i = 0; i < retnum; i++) {
             /* check for duplicate records/older version*/
             int cret;
-            if (rrec != (CDBREC*)sbuf) {
-                free(rrec);
-                rrec = (CDBREC*)sbuf;
-            }
-            
             struct timespec ts;
             _cdb_timerreset(&ts);
             cret = db->vio->rrec(db->vio, &rrec, soff[i], false);
-            db->rcount++;
-            db->rtime += _cdb_timermicrosec(&ts);
+            STATADD(db, rcount, 1);
+            STATADD(db, rtime, _cdb_timermicrosec(&ts));
             
             if (cret < 0)
                 continue;
@@ -1027,8 +2512,7 @@ int cdb_set2(CDB *db, const char *key, int ksize, const char *val, int vsize, in
         }
         if (soff != soffs)
             free(soff);
-        if (rrec != (CDBREC*)sbuf) 
-            free(rrec);
+        cdb_scratch_put(rrec);
     }
     
     if (OFFNOTNULL(ooff) && !expired) {
@@ -1052,33 +2536,52 @@ int cdb_set2(CDB *db, const char *key, int ksize, const char *val, int vsize, in
         cdb_lock_unlock(db->mlock[lockid]);
         return -1;
     }
-    db->wcount++;
-    db->wtime += _cdb_timermicrosec(&ts);
+    STATADD(db, wcount, 1);
+    STATADD(db, wtime, _cdb_timermicrosec(&ts));
     
     if (OFFNOTNULL(ooff)) {
         cdb_replaceoff(db, hash, ooff, noff, CDB_LOCKED);
     } else {
         cdb_updatepage(db, hash, noff, CDB_PAGEINSERTOFF, CDB_LOCKED);
     }
+
+    if (db->offcache) {
+        /* after the index is updated, which drops the old one */
+        OCITEM oc;
+        oc.off = noff;
+        oc.rsize = RECSIZE(&rec);
+        oc.expire = rec.expire;
+        cdb_fpc_set(db->offcache, hash, cdb_fpc_tag(key, ksize), &oc);
+    }
     
-    if (db->rcache) {
-        if ((opt & CDB_INSERTCACHE) == CDB_INSERTCACHE) {
+    if (db->rcache[sid]) {
+        /* too large values are never cached, they would evict many small ones */
+        if ((opt & CDB_INSERTCACHE) == CDB_INSERTCACHE && vsize <= db->rcvalmax) {
             char *cval;
-            CDBHTITEM *item = cdb_ht_newitem(db->rcache, ksize, vsize + SI4 + SFOFF);
-            memcpy(cdb_ht_itemkey(db->rcache, item), key, ksize);
-            cval = cdb_ht_itemval(db->rcache, item);
-            memcpy(cval + SI4 + SFOFF, val, vsize);
-            *(FOFF*)(cval) = rec.ooff;
-            *(uint32_t*)(cval + SFOFF) = rec.expire;
-            cdb_lock_lock(db->rclock);
-            cdb_ht_insert(db->rcache, item);
-            cdb_lock_unlock(db->rclock);
+            CDBHTITEM *item = cdb_ht_newitem(db->rcache[sid], ksize, vsize + RCHSIZE(rec.expire));
+            memcpy(cdb_ht_itemkey(db->rcache[sid], item), key, ksize);
+            cval = cdb_ht_itemval(db->rcache[sid], item);
+            memcpy(cval + RCHSIZE(rec.expire), val, vsize);
+            _cdb_rcputhead(cval, rec.ooff, rec.expire);
+            cdb_lock_lock(db->rclock[sid]);
+            /* an already cached record is always updated */
+            if (cached || _cdb_rcadmit(db, sid, hash, cdb_ht_itemsize(db->rcache[sid], item))) {
+                cdb_ht_insert(db->rcache[sid], item);
+                item = NULL;
+            }
+            cdb_lock_unlock(db->rclock[sid]);
+            if (item)
+                cdb_ht_dropitem(db->rcache[sid], item);
+        } else if (cached) {
+            /* the cached copy is out of date */
+            cdb_lock_lock(db->rclock[sid]);
+            cdb_ht_del2(db->rcache[sid], key, ksize);
+            cdb_lock_unlock(db->rclock[sid]);
         }
     } 
     cdb_lock_unlock(db->mlock[lockid]);
     
-    if (RCOVERFLOW(db))
-        _cdb_recout(db);
+    _cdb_rccheck(db, sid);
 
     cdb_seterrno(db, CDB_SUCCESS, __FILE__, __LINE__);
     return 0;
@@ -1088,75 +2591,126 @@ int cdb_set2(CDB *db, const char *key, int ksize, const char *val, int vsize, in
 
 int cdb_get(CDB *db, const char *key, int ksize, void **val, int *vsize)
 {
-    char sbuf[SBUFSIZE];
-    CDBREC *rec = (CDBREC *)sbuf;
+    CDBREC *rec;
     FOFF soffs[SFOFFNUM];
     FOFF *offs;
     int dupnum, ret = -3;
     uint64_t hash;
     uint32_t now = time(NULL);
-    uint32_t lockid;
+    uint32_t lockid, sid, tag = 0;
+    /* any record with the key found in index, or any error while reading them */
+    bool matched = false, rerror = false;
+    /* got the record by offset cache */
+    bool ochit = false;
+    OCITEM oc;
 
     *vsize = 0;
     *val = NULL;
-    if (db->rcache) {
+    hash = CDBHASH64(key, ksize);
+    sid = RCSHARD(hash);
+    if (db->rcsketch)
+        cdb_sketch_add(db->rcsketch, hash);
+    if (db->rcache[sid]) {
         char *cval;
-        cdb_lock_lock(db->rclock);
-        cval = cdb_ht_get(db->rcache, key, ksize, vsize, true);
+        /* cached values are never modified in place, copy it out inside the epoch */
+        cdb_epoch_enter(db->epoch);
+        cval = cdb_ht_rdget(db->rcache[sid], key, ksize, vsize, true);
         if (cval) {
-            db->rchit++;
+            STATADD(db, rchit, 1);
             if (db->vio) {
-                (*vsize) -= SI4 + SFOFF;
-                if (*(uint32_t*)(cval + SFOFF)
-                    && *(uint32_t*)(cval + SFOFF) <= now) {
-                    cdb_lock_unlock(db->rclock);
+                uint32_t expire, hsize;
+                hsize = _cdb_rcgethead(cval, NULL, &expire);
+                (*vsize) -= hsize;
+                if (expire && expire <= now) {
+                    cdb_epoch_exit(db->epoch);
                     /* not found no not report error now */
                     //cdb_seterrno(db, CDB_NOTFOUND, __FILE__, __LINE__);
                     return -3;
                 }
-                cval = (void*)(cval + SI4 + SFOFF);
+                cval = (void*)(cval + hsize);
             }
             *val = malloc(*vsize);
             memcpy(*val, cval, *vsize);
-            cdb_lock_unlock(db->rclock);
+            cdb_epoch_exit(db->epoch);
             return 0;
         } else {
-            db->rcmiss++;
+            STATADD(db, rcmiss, 1);
+            if (_cdb_ghosthit(db->rcghost, hash))
+                STATADD(db, rcghosthit, 1);
             if (db->vio == NULL) {
-                cdb_lock_unlock(db->rclock);
+                cdb_epoch_exit(db->epoch);
                 return -3;
             }
         }
-        cdb_lock_unlock(db->rclock);
+        cdb_epoch_exit(db->epoch);
+    }
+
+    if (db->negcache || db->offcache)
+        tag = cdb_fpc_tag(key, ksize);
+
+    if (db->negcache) {
+        /* missed recently, and not inserted since then */
+        if (cdb_fpc_get(db->negcache, hash, tag, NULL)) {
+            cdb_seterrno(db, CDB_NOTFOUND, __FILE__, __LINE__);
+            return -3;
+        }
     }
 
     offs = soffs;
-    hash = CDBHASH64(key, ksize);
-    lockid = (hash >> 24) % db->hsize % MLOCKNUM;
-    cdb_lock_lock(db->mlock[lockid]);
-    dupnum = cdb_getoff(db, hash, &offs, CDB_LOCKED);
+    rec = (CDBREC *)cdb_scratch_get(RECSBUFSIZE(db));
+    lockid = (hash >> 24) % db->hsize % db->mlocknum;
+    /* lookups of the same stripe go in parallel */
+    cdb_lock_rdlock(db->mlock[lockid]);
+    if (db->offcache && cdb_fpc_get(db->offcache, hash, tag, &oc)) {
+        /* the offset is valid while holding mlock, read the record directly */
+        if (oc.expire && oc.expire <= now) {
+            cdb_lock_unlock(db->mlock[lockid]);
+            cdb_scratch_put(rec);
+            cdb_seterrno(db, CDB_NOTFOUND, __FILE__, __LINE__);
+            return -3;
+        }
+
+        struct timespec ts;
+        _cdb_timerreset(&ts);
+        if (db->vio->rrec2(db->vio, &rec, oc.off, oc.rsize) == 0
+            && ksize == rec->ksize && memcmp(rec->key, key, ksize) == 0) {
+            *vsize = rec->vsize;
+            *val = malloc(*vsize);
+            memcpy(*val, rec->val, *vsize);
+            ochit = true;
+            ret = 0;
+        }
+        STATADD(db, rcount, 1);
+        STATADD(db, rtime, _cdb_timermicrosec(&ts));
+    }
+
+    /* fall back to the index if the offset cache doesn't help */
+    if (ochit)
+        dupnum = 0;
+    else
+        dupnum = cdb_getoff(db, hash, &offs, CDB_LOCKED);
     if (dupnum < 0) {
         cdb_lock_unlock(db->mlock[lockid]);
+        cdb_scratch_put(rec);
         return -1;
     }
 
     for(int i = 0; i < dupnum; i++) {
         int cret;
-        if (rec != (CDBREC*)sbuf) {
-            free(rec);
-            rec = (CDBREC*)sbuf;
-        }
 
         struct timespec ts;
         _cdb_timerreset(&ts);
         cret = db->vio->rrec(db->vio, &rec, offs[i], true);
-        db->rcount++;
-        db->rtime += _cdb_timermicrosec(&ts);
+        STATADD(db, rcount, 1);
+        STATADD(db, rtime, _cdb_timermicrosec(&ts));
 
-        if (cret < 0)
+        if (cret < 0) {
+            rerror = true;
             continue;
+        }
 
         if (ksize == rec->ksize && memcmp(rec->key, key, ksize) == 0) {
+            matched = true;
             if (rec->expire && rec->expire <= now) {
                 break;
             }
@@ -1168,33 +2722,45 @@ int cdb_get(CDB *db, const char *key, int ksize, void **val, int *vsize)
         } 
     }
 
-    if (ret == 0 && db->rcache) {
+    if (matched && db->offcache) {
+        oc.off = rec->ooff;
+        oc.rsize = RECSIZE(rec);
+        oc.expire = rec->expire;
+        cdb_fpc_set(db->offcache, hash, tag, &oc);
+    }
+
+    if (ret == 0 && db->rcache[sid] && *vsize <= db->rcvalmax) {
         char *cval;
-        CDBHTITEM *item = cdb_ht_newitem(db->rcache, ksize, *vsize + SI4 + SFOFF);
-        memcpy(cdb_ht_itemkey(db->rcache, item), key, ksize);
-        cval = cdb_ht_itemval(db->rcache, item);
-        memcpy(cval + SI4 + SFOFF, *val, *vsize);
-        *(FOFF*)(cval) = rec->ooff;
-        *(uint32_t*)(cval + SFOFF) = rec->expire;
-        cdb_lock_lock(db->rclock);
-        cdb_ht_insert(db->rcache, item);
-        cdb_lock_unlock(db->rclock);
+        CDBHTITEM *item = cdb_ht_newitem(db->rcache[sid], ksize, *vsize + RCHSIZE(rec->expire));
+        memcpy(cdb_ht_itemkey(db->rcache[sid], item), key, ksize);
+        cval = cdb_ht_itemval(db->rcache[sid], item);
+        memcpy(cval + RCHSIZE(rec->expire), *val, *vsize);
+        _cdb_rcputhead(cval, rec->ooff, rec->expire);
+        cdb_lock_lock(db->rclock[sid]);
+        if (_cdb_rcadmit(db, sid, hash, cdb_ht_itemsize(db->rcache[sid], item))) {
+            cdb_ht_insert(db->rcache[sid], item);
+            item = NULL;
+        }
+        cdb_lock_unlock(db->rclock[sid]);
+        if (item)
+            cdb_ht_dropitem(db->rcache[sid], item);
+    } else if (ret < 0 && db->negcache && !matched && !rerror) {
+        /* confirmed missing under mlock, any later insertion will invalidate it */
+        cdb_fpc_set(db->negcache, hash, tag, NULL);
     }
     cdb_lock_unlock(db->mlock[lockid]);
     
-    if (RCOVERFLOW(db))
-        _cdb_recout(db);
+    _cdb_rccheck(db, sid);
             
     if (offs != soffs)
         free(offs);
         
-    if (rec != (CDBREC*)sbuf) 
-        free(rec);
+    cdb_scratch_put(rec);
 
     if (ret < 0)
         cdb_seterrno(db, CDB_NOTFOUND, __FILE__, __LINE__);
     else {
-        db->rcmiss++;
+        STATADD(db, rcmiss, 1);
         cdb_seterrno(db, CDB_SUCCESS, __FILE__, __LINE__);
     }
     return ret;
@@ -1213,7 +2779,7 @@ int cdb_del(CDB *db, const char *key, int ksize)
 {
     FOFF ooff;
     CDBREC rec;
-    uint32_t lockid;
+    uint32_t lockid, sid;
     uint64_t hash;
     
     OFFZERO(rec.ooff);
@@ -1224,59 +2790,55 @@ int cdb_del(CDB *db, const char *key, int ksize)
     rec.val = NULL;
     rec.vsize = 0;
     
+    hash = CDBHASH64(key, ksize);
+    sid = RCSHARD(hash);
     if (db->vio == NULL) {
         /* if it is a memdb, just operate on the record cache and return */
-        cdb_lock_lock(db->rclock);
-        cdb_ht_del2(db->rcache, key, ksize);
-        cdb_lock_unlock(db->rclock);
-        if (RCOVERFLOW(db))
-            _cdb_recout(db);
+        cdb_lock_lock(db->rclock[sid]);
+        cdb_ht_del2(db->rcache[sid], key, ksize);
+        cdb_lock_unlock(db->rclock[sid]);
+        _cdb_rccheck(db, sid);
         return 0;
     }
     
-    hash = CDBHASH64(key, ksize);
-    lockid = (hash >> 24) % db->hsize % MLOCKNUM;
+    lockid = (hash >> 24) % db->hsize % db->mlocknum;
     cdb_lock_lock(db->mlock[lockid]);
-    if (db->rcache) {
+    if (db->rcache[sid]) {
         /* if record already exists, get its old meta info */
         CDBHTITEM *item;
-        cdb_lock_lock(db->rclock);
-        item = cdb_ht_del(db->rcache, key, ksize);
-        cdb_lock_unlock(db->rclock);
+        cdb_lock_lock(db->rclock[sid]);
+        item = cdb_ht_del(db->rcache[sid], key, ksize);
+        cdb_lock_unlock(db->rclock[sid]);
         if (item) {
-            char *cval = cdb_ht_itemval(db->rcache, item);
-            ooff = rec.ooff = *(FOFF*)cval;
-            rec.osize = item->vsize - SFOFF - SI4;
-            rec.expire = *(uint32_t*)(cval + SFOFF);
-            free(item);
+            char *cval = cdb_ht_itemval(db->rcache[sid], item);
+            uint32_t expire;
+            rec.osize = item->vsize - _cdb_rcgethead(cval, &ooff, &expire);
+            rec.ooff = ooff;
+            rec.expire = expire;
+            cdb_ht_freeitem(db->rcache[sid], item);
         }
     }
     
     if (OFFNULL(ooff)) {
         FOFF soffs[SFOFFNUM];
         FOFF *soff = soffs;
-        char sbuf[SBUFSIZE];
-        CDBREC *rrec = (CDBREC*)sbuf;
+        CDBREC *rrec = (CDBREC*)cdb_scratch_get(RECSBUFSIZE(db));
         
         int retnum;
         if ((retnum = cdb_getoff(db, hash, &soff, CDB_LOCKED)) < 0) {
             cdb_lock_unlock(db->mlock[lockid]);
+            cdb_scratch_put(rrec);
             return -1;
         }
             
         for(int i = 0; i < retnum; i++) {
             /* check for duplicate records/older version*/
             int cret;
-            if (rrec != (CDBREC*)sbuf) {
-                free(rrec);
-                rrec = (CDBREC*)sbuf;
-            }
-            
             struct timespec ts;
             _cdb_timerreset(&ts);
             cret = db->vio->rrec(db->vio, &rrec, soff[i], false);
-            db->rcount++;
-            db->rtime += _cdb_timermicrosec(&ts);
+            STATADD(db, rcount, 1);
+            STATADD(db, rtime, _cdb_timermicrosec(&ts));
             
             if (cret < 0)
                 continue;
@@ -1291,8 +2853,7 @@ int cdb_del(CDB *db, const char *key, int ksize)
         }
         if (soff != soffs)
             free(soff);
-        if (rrec != (CDBREC*)sbuf) 
-            free(rrec);
+        cdb_scratch_put(rrec);
     }
     
     if (OFFNOTNULL(ooff)) {
@@ -1303,8 +2864,8 @@ int cdb_del(CDB *db, const char *key, int ksize)
         _cdb_timerreset(&ts);
         if (db->vio->drec(db->vio, &rec, ooff) < 0)
             ; // return -1;  succeed or not doesn't matter
-        db->wcount++;
-        db->wtime += _cdb_timermicrosec(&ts);
+        STATADD(db, wcount, 1);
+        STATADD(db, wtime, _cdb_timermicrosec(&ts));
         cdb_seterrno(db, CDB_SUCCESS, __FILE__, __LINE__);
         return 0;
     } else {
@@ -1318,23 +2879,99 @@ int cdb_del(CDB *db, const char *key, int ksize)
 void cdb_stat(CDB *db, CDBSTAT *stat)
 {
     if (stat == NULL) {
-        db->rchit = db->rcmiss = 0;
-        db->pchit = db->pcmiss = 0;
-        db->rcount = db->rtime = 0;
-        db->wcount = db->wtime = 0;
+        /* counts added at the same time may be lost */
+        memset(db->stats, 0, sizeof(CDBSTATSHARD) * STATSHARDNUM);
     } else {
-        stat->rnum = db->rnum;
-        stat->rcnum = db->rcache? db->rcache->num : 0;
+        CDBSTATSHARD sum;
+        memset(&sum, 0, sizeof(sum));
+        for(int i = 0; i < STATSHARDNUM; i++) {
+            CDBSTATSHARD *st = &db->stats[i];
+            sum.rchit += __atomic_load_n(&st->rchit, __ATOMIC_RELAXED);
+            sum.rcmiss += __atomic_load_n(&st->rcmiss, __ATOMIC_RELAXED);
+            sum.pchit += __atomic_load_n(&st->pchit, __ATOMIC_RELAXED);
+            sum.pcmiss += __atomic_load_n(&st->pcmiss, __ATOMIC_RELAXED);
+            sum.rcreject += __atomic_load_n(&st->rcreject, __ATOMIC_RELAXED);
+            sum.pcreject += __atomic_load_n(&st->pcreject, __ATOMIC_RELAXED);
+            sum.rcghosthit += __atomic_load_n(&st->rcghosthit, __ATOMIC_RELAXED);
+            sum.pcghosthit += __atomic_load_n(&st->pcghosthit, __ATOMIC_RELAXED);
+            sum.rtime += __atomic_load_n(&st->rtime, __ATOMIC_RELAXED);
+            sum.rcount += __atomic_load_n(&st->rcount, __ATOMIC_RELAXED);
+            sum.wtime += __atomic_load_n(&st->wtime, __ATOMIC_RELAXED);
+            sum.wcount += __atomic_load_n(&st->wcount, __ATOMIC_RELAXED);
+            sum.evstall += __atomic_load_n(&st->evstall, __ATOMIC_RELAXED);
+            sum.evstalltime += __atomic_load_n(&st->evstalltime, __ATOMIC_RELAXED);
+        }
+        stat->rnum = __atomic_load_n(&db->rnum, __ATOMIC_RELAXED);
+        stat->rcnum = stat->pcnum = 0;
+        for(int i = 0; i < CACHESHARDNUM; i++) {
+            stat->rcnum += db->rcache[i]? cdb_ht_num(db->rcache[i]) : 0;
+            stat->pcnum += (db->pcache[i]? cdb_ht_num(db->pcache[i]) : 0) 
+                + (db->dpcache[i]? cdb_ht_num(db->dpcache[i]) : 0);
+        }
         stat->pnum = db->hsize;
-        stat->pcnum = (db->pcache? db->pcache->num : 0) 
-            + (db->dpcache? db->dpcache->num : 0);
-        stat->rchit = db->rchit;
-        stat->rcmiss = db->rcmiss;
-        stat->pchit = db->pchit;
-        stat->pcmiss = db->pcmiss;
-        stat->rlatcy = db->rcount ? db->rtime / db->rcount : 0;
-        stat->wlatcy = db->wcount ? db->wtime / db->wcount : 0;
+        stat->rchit = sum.rchit;
+        stat->rcmiss = sum.rcmiss;
+        stat->pchit = sum.pchit;
+        stat->pcmiss = sum.pcmiss;
+        stat->rlatcy = sum.rcount ? sum.rtime / sum.rcount : 0;
+        stat->wlatcy = sum.wcount ? sum.wtime / sum.wcount : 0;
+        stat->rcreject = sum.rcreject;
+        stat->pcreject = sum.pcreject;
+        stat->rclimit = RCLIMIT(db);
+        stat->pclimit = PCLIMIT(db);
+        stat->cachescale = db->cachescale;
+        stat->pressurenum = db->pressurenum;
+        stat->rcwarmnum = db->rcwarmnum;
+        stat->evstall = sum.evstall;
+        stat->evstalltime = sum.evstalltime;
+        stat->rcghosthit = sum.rcghosthit;
+        stat->pcghosthit = sum.pcghosthit;
+        stat->splitnum = db->splitnum;
+        memcpy(stat->splithist, db->splithist, sizeof(stat->splithist));
+        stat->hugesize = db->mthuge? sizeof(FOFF) * db->mtnum : 0;
+        if (db->bf)
+            stat->hugesize += cdb_bf_hugesize(db->bf);
+        stat->slabidle = 0;
+        for(int i = 0; i < CACHESHARDNUM; i++) {
+            /* clean and dirty page cache of a shard share a slab */
+            if (db->rcache[i] && db->rcache[i]->slab) {
+                stat->hugesize += db->rcache[i]->slab->hugesize;
+                stat->slabidle += cdb_slab_idle(db->rcache[i]->slab);
+            }
+            if (db->pcache[i] && db->pcache[i]->slab) {
+                stat->hugesize += db->pcache[i]->slab->hugesize;
+                stat->slabidle += cdb_slab_idle(db->pcache[i]->slab);
+            }
+        }
+    }
+}
+
+
+static void _cdb_addlockstat(CDBLOCKSTAT *stat, CDBLOCK *lock)
+{
+    if (stat == NULL) {
+        cdb_lock_resetstat(lock);
+        return;
+    }
+    stat->acquire += lock->acquire;
+    stat->contended += lock->contended;
+    stat->waittime += lock->waitns / 1000;
+}
+
+
+void cdb_lockstat(CDB *db, CDBLOCKSTAT *stat)
+{
+    if (stat)
+        memset(stat, 0, sizeof(CDBLOCKSTAT) * CDB_LOCKSTATNUM);
+
+    for(int i = 0; i < db->mlocknum; i++)
+        _cdb_addlockstat(stat? &stat[CDB_LOCKSTATMLOCK]: NULL, db->mlock[i]);
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        _cdb_addlockstat(stat? &stat[CDB_LOCKSTATRCACHE]: NULL, db->rclock[i]);
+        _cdb_addlockstat(stat? &stat[CDB_LOCKSTATPCACHE]: NULL, db->pclock[i]);
+        _cdb_addlockstat(stat? &stat[CDB_LOCKSTATDPCACHE]: NULL, db->dpclock[i]);
     }
+    _cdb_addlockstat(stat? &stat[CDB_LOCKSTATMISC]: NULL, db->bflock);
 }
 
 
@@ -1345,22 +2982,41 @@ int cdb_close(CDB *db)
 
     if (db->bgtask)
         cdb_bgtask_stop(db->bgtask);
-    if (db->rcache)
-        cdb_ht_destroy(db->rcache);
-    if (db->pcache)
-        cdb_ht_destroy(db->pcache);
-    if (db->dpcache) {
+    _cdb_stopevictor(db);
+    _cdb_stopflushers(db);
+    if (db->dpcache[0])
         cdb_flushalldpage(db);
-        cdb_ht_destroy(db->dpcache);
+    if (db->vio)
+        _cdb_hotsavetask(db);
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        if (db->rcache[i])
+            cdb_ht_destroy(db->rcache[i]);
+        if (db->pcache[i])
+            cdb_ht_destroy(db->pcache[i]);
+        if (db->dpcache[i])
+            cdb_ht_destroy(db->dpcache[i]);
     }
+    if (db->epoch)
+        cdb_epoch_destroy(db->epoch);
+    if (db->rcsketch)
+        cdb_sketch_destroy(db->rcsketch);
+    if (db->pcsketch)
+        cdb_sketch_destroy(db->pcsketch);
+    if (db->negcache)
+        cdb_fpc_destroy(db->negcache);
+    if (db->offcache)
+        cdb_fpc_destroy(db->offcache);
+    if (db->rcghost)
+        cdb_fpc_destroy(db->rcghost);
+    if (db->pcghost)
+        cdb_fpc_destroy(db->pcghost);
 
     if (db->vio) {
         db->vio->whead(db->vio);
         db->vio->close(db->vio);
         cdb_vio_destroy(db->vio);
     }
-    if (db->mtable)
-        free(db->mtable);
+    cdb_freemtable(db);
     db->opened = false;
     _cdb_defparam(db);
     return 0;
@@ -1377,14 +3033,18 @@ int cdb_destroy(CDB *db)
 {
     if (db->opened)
         cdb_close(db);
-    for(int i = 0; i < MLOCKNUM; i++)
+    for(int i = 0; i < db->mlocknum; i++)
         cdb_lock_destory(db->mlock[i]);
-    cdb_lock_destory(db->dpclock);
-    cdb_lock_destory(db->pclock);
-    cdb_lock_destory(db->rclock);
-    cdb_lock_destory(db->stlock);
-    cdb_lock_destory(db->oidlock);
+    free(db->mlock);
+    for(int i = 0; i < CACHESHARDNUM; i++) {
+        cdb_lock_destory(db->dpclock[i]);
+        cdb_lock_destory(db->pclock[i]);
+        cdb_lock_destory(db->rclock[i]);
+    }
+    free(db->stats);
+    free(db->psifile);
     cdb_lock_destory(db->bflock);
+    cdb_lock_destory(db->limitlock);
     cdb_bgtask_destroy(db->bgtask);
     pthread_key_delete(*(pthread_key_t*)db->errkey);
     free(db->errkey);
@@ -19,7 +19,10 @@
 #include "cdb_types.h"
 #include "cdb_hashtable.h"
 #include "cdb_bloomfilter.h"
+#include "cdb_sketch.h"
+#include "cdb_fpcache.h"
 #include "cdb_lock.h"
+#include "cdb_epoch.h"
 #include "cdb_vio.h"
 #include "cdb_bgtask.h"
 #include <stdint.h>
@@ -31,6 +34,46 @@ enum {
     CDB_PAGEINSERTOFF = 1,
 };
 
+/* statistics counters updated by a group of threads, one cache line at least */
+typedef struct {
+    /* record cache hit/miss */
+    uint64_t rchit;
+    uint64_t rcmiss;
+    /* page cache hit/miss */
+    uint64_t pchit;
+    uint64_t pcmiss;
+    /* not admitted into record/page cache */
+    uint64_t rcreject;
+    uint64_t pcreject;
+    /* misses of items evicted lately from record/page cache */
+    uint64_t rcghosthit;
+    uint64_t pcghosthit;
+    /* cumulative disk read time */
+    uint64_t rtime;
+    /* number of disk read operation */
+    uint64_t rcount;
+    /* cumulative disk write time */
+    uint64_t wtime;
+    /* number of disk write operation */
+    uint64_t wcount;
+    /* times callers evicted from a cache shard past its limit, and the time taken */
+    uint64_t evstall;
+    uint64_t evstalltime;
+} __attribute__((aligned(CDBLOCKALIGN))) CDBSTATSHARD;
+
+
+/* a background thread writing out dirty pages of shards 'sid % flushernum == id' */
+typedef struct {
+    CDB *db;
+    pthread_t tid;
+    uint32_t id;
+    /* it sleeps on the condition until woken or a second passes */
+    pthread_cond_t cond;
+    /* set by writers to wake it up */
+    bool wake;
+} CDBFLUSHER;
+
+
 /* the DB object */
 struct CDB
 {
@@ -40,6 +83,34 @@ struct CDB
     uint64_t pclimit;
     /* size of bloom filter */
     uint64_t bfsize;
+    /* max number of keys in negative cache */
+    uint32_t ncnum;
+    /* max number of keys in offset cache */
+    uint32_t ocnum;
+    /* values larger than it are not kept in record cache */
+    uint32_t rcvalmax;
+    /* total memory budget, 0 if the cache limits are fixed */
+    uint64_t membudget;
+    /* the part of budget moved between the caches */
+    uint64_t budgetavail;
+    /* ghost hits seen by last rebalance */
+    uint64_t lastrcghosthit;
+    uint64_t lastpcghosthit;
+    /* number of rebalances moved memory, and the share of record cache after them */
+    uint32_t splitnum;
+    uint8_t splithist[CDB_SPLITHISTNUM];
+    /* cache limits set by user or the budget, 'rclimit'/'pclimit' move toward them */
+    uint64_t rctarget;
+    uint64_t pctarget;
+    /* percent of the targets allowed under memory pressure */
+    uint32_t cachescale;
+    /* number of times memory pressure seen */
+    uint32_t pressurenum;
+    /* records loaded by record cache warmup */
+    uint64_t rcwarmnum;
+    /* PSI file to watch, and the 'avg10' stall percent to shrink caches at */
+    char *psifile;
+    double psilimit;
     /* record number in db */
     uint64_t rnum;
     /* always increment operation id */
@@ -50,39 +121,86 @@ struct CDB
     uint32_t hsize;
     /* last timestamp of no dirty page state */
     uint32_t ndpltime;
+    /* recovery point of every bucket range, roid is the oldest of them */
+    uint64_t ckoids[CKPRANGENUM];
+    /* next range to checkpoint */
+    uint32_t ckpos;
+    /* last timestamp of range checkpoints */
+    uint32_t cktime;
+    /* seconds for a round of range checkpoints, 0 if disabled */
+    uint32_t ckroundtime;
     /* currently the database opened or not */
     bool opened;
     /* the size for a disk seek&read, should not greater than SBUFSIZE */
     uint32_t areadsize;
+    /* huge page mode of main table, bloom filter and cache slabs */
+    int hugepage;
 
-    /* record cache */
-    CDBHASHTABLE *rcache;
-    /* (clean) index page cache */
-    CDBHASHTABLE *pcache;
-    /* dirty index page cache */
-    CDBHASHTABLE *dpcache;
+    /* record cache shards */
+    CDBHASHTABLE *rcache[CACHESHARDNUM];
+    /* (clean) index page cache shards */
+    CDBHASHTABLE *pcache[CACHESHARDNUM];
+    /* dirty index page cache shards */
+    CDBHASHTABLE *dpcache[CACHESHARDNUM];
     /* Bloom Filter */
     CDBBLOOMFILTER *bf;
+    /* access frequency of records/pages, decides who can get into a full cache */
+    CDBSKETCH *rcsketch;
+    CDBSKETCH *pcsketch;
+    /* fingerprints of keys recently confirmed missing */
+    CDBFPCACHE *negcache;
+    /* where the records of keys recently accessed are, and their sizes */
+    CDBFPCACHE *offcache;
+    /* keys/buckets recently evicted from record/page cache, under a memory budget */
+    CDBFPCACHE *rcghost;
+    CDBFPCACHE *pcghost;
+    /* memory reclamation for lock-free record/page cache readers */
+    CDBEPOCH *epoch;
 
-    /* lock for rcache */
-    CDBLOCK *rclock;
-    /* lock for pcache */
-    CDBLOCK *pclock;
-    /* lock for dpcache */
-    CDBLOCK *dpclock;
-    /* lock for hash table operation, split to MLOCKNUM groups */
-    CDBLOCK *mlock[MLOCKNUM];
-    /* lock for statistic */
-    CDBLOCK *stlock;
-    /* lock for operation id */
-    CDBLOCK *oidlock;
+    /* locks for rcache shard writers, readers go without it */
+    CDBLOCK *rclock[CACHESHARDNUM];
+    /* locks for pcache shard writers, readers go without it */
+    CDBLOCK *pclock[CACHESHARDNUM];
+    /* locks for dpcache shard writers */
+    CDBLOCK *dpclock[CACHESHARDNUM];
+    /* reader/writer locks for hash table operation, split to 'mlocknum' stripes,
+     lookups share a stripe, modifications take it exclusively */
+    CDBLOCK **mlock;
+    uint32_t mlocknum;
     /* lock for bloom filter */
     CDBLOCK *bflock;
+    /* lock for moving the cache limits and changing their targets */
+    CDBLOCK *limitlock;
     /* background tasks in another thread */
     CDBBGTASK *bgtask;
+    /* dirty page flusher threads, the mutex protects their wake flags */
+    CDBFLUSHER *flushers;
+    uint32_t flushernum;
+    pthread_mutex_t flmutex;
+    bool flstop;
+    /* watermarks of dirty pages, in percent of the page cache limit */
+    uint32_t dphigh;
+    uint32_t dplow;
+    /* cache evictor thread, it sleeps on the condition until woken or a second passes */
+    pthread_t evtid;
+    pthread_mutex_t evmutex;
+    pthread_cond_t evcond;
+    bool evrunning;
+    /* set by callers to wake the evictor up, or to stop it */
+    bool evwake;
+    bool evstop;
 
     /* main hash table, contains 'hsize' elements */
     FOFF *mtable;
+    /* number of elements the main table is allocated for */
+    uint32_t mtnum;
+    /* the main table is mapped with huge pages */
+    bool mthuge;
+    /* map the main table from the index file, instead of reading it at open */
+    bool mtmmap;
+    /* the file mapping the main table lives in, NULL if it is in anonymous memory */
+    void *mtmap;
+    uint64_t mtmapsize;
     /* disk i/o layer object */
     CDBVIO *vio;
 
@@ -90,24 +208,14 @@ struct CDB
     CDB_ERRCALLBACK errcb;
     /* argument for callback function */
     void *errcbarg;
+    /* callback function for progress of flushing all dirty pages */
+    CDB_FLUSHCALLBACK flushcb;
+    void *flushcbarg;
     /* key to get error code in current thread */
     void *errkey;
 
-    /* statistics below, this fields have no lock protection */
-    /* record cache hit/miss */
-    uint64_t rchit;
-    uint64_t rcmiss;
-    /* page cache hit/miss */
-    uint64_t pchit;
-    uint64_t pcmiss;
-    /* cumulative disk read time */
-    uint64_t rtime;
-    /* number of disk read operation */
-    uint64_t rcount;
-    /* cumulative disk write time */
-    uint64_t wtime;
-    /* number of disk write operation */
-    uint64_t wcount;
+    /* statistics, every thread adds to one of the shards, cdb_stat sums them up */
+    CDBSTATSHARD *stats;
 };
 
 
@@ -117,6 +225,9 @@ int cdb_replaceoff(CDB *db, uint64_t hash, FOFF off, FOFF noff, int locked);
 int cdb_updatepage(CDB *db, uint64_t hash, FOFF off, int opt, int locked);
 void cdb_flushalldpage(CDB *db);
 uint64_t cdb_genoid(CDB *db);
+int cdb_newmtable(CDB *db);
+void cdb_freemtable(CDB *db);
+int cdb_mapmtable(CDB *db, int fd, uint64_t off);
 
 #endif
 
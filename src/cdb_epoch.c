@@ -0,0 +1,243 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+#include "cdb_epoch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+static void _cdb_epoch_recfree(void *arg);
+static CDBEPOCHREC *_cdb_epoch_getrec(CDBEPOCH *ep);
+static void _cdb_epoch_freebag(CDBEPOCHBAG *bag);
+static void _cdb_epoch_collect(CDBEPOCHREC *rec, uint64_t e);
+static void _cdb_epoch_advance(CDBEPOCH *ep);
+static void _cdb_epoch_wait(CDBEPOCH *ep, uint64_t e);
+
+
+/* called when a thread exits, the record can be reused by other threads */
+static void _cdb_epoch_recfree(void *arg)
+{
+    CDBEPOCHREC *rec = (CDBEPOCHREC *)arg;
+    rec->nest = 0;
+    __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->inuse, 0, __ATOMIC_RELEASE);
+}
+
+
+/* get the record of current thread, register one if it is the first time */
+static CDBEPOCHREC *_cdb_epoch_getrec(CDBEPOCH *ep)
+{
+    CDBEPOCHREC *rec = (CDBEPOCHREC *)pthread_getspecific(ep->key);
+
+    if (rec)
+        return rec;
+
+    pthread_mutex_lock(&ep->lock);
+    for(rec = ep->recs; rec; rec = rec->next) {
+        if (!__atomic_load_n(&rec->inuse, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    if (rec == NULL) {
+        if (posix_memalign((void **)&rec, 64, sizeof(CDBEPOCHREC)))
+            rec = (CDBEPOCHREC *)malloc(sizeof(CDBEPOCHREC));
+        memset(rec, 0, sizeof(CDBEPOCHREC));
+        rec->next = ep->recs;
+        ep->recs = rec;
+    }
+    /* objects left by an exited owner are taken over */
+    rec->nest = 0;
+    rec->epoch = 0;
+    rec->inuse = 1;
+    pthread_mutex_unlock(&ep->lock);
+    pthread_setspecific(ep->key, rec);
+    return rec;
+}
+
+
+static void _cdb_epoch_freebag(CDBEPOCHBAG *bag)
+{
+    for(uint32_t i = 0; i < bag->num; i++) {
+        CDBEPOCHNODE *node = &bag->nodes[i];
+        if (node->func)
+            node->func(node->ptr, node->arg);
+        else
+            free(node->ptr);
+    }
+    bag->num = 0;
+}
+
+
+/* free the bags of a record retired two epochs before 'e' or earlier */
+static void _cdb_epoch_collect(CDBEPOCHREC *rec, uint64_t e)
+{
+    for(int i = 0; i < 3; i++) {
+        if (rec->bags[i].num && rec->bags[i].epoch + 2 <= e)
+            _cdb_epoch_freebag(&rec->bags[i]);
+    }
+}
+
+
+/* the epoch can move forward only if every active reader has seen the current one.
+ After moving to e+1, no reader may still hold objects retired in e-1.
+ Must be called under lock protection */
+static void _cdb_epoch_advance(CDBEPOCH *ep)
+{
+    uint64_t cur = ep->epoch;
+
+    for(CDBEPOCHREC *rec = ep->recs; rec; rec = rec->next) {
+        uint64_t e = __atomic_load_n(&rec->epoch, __ATOMIC_ACQUIRE);
+        if (e && e != cur)
+            return;
+    }
+    __atomic_store_n(&ep->epoch, cur + 1, __ATOMIC_SEQ_CST);
+}
+
+
+/* wait until objects retired in epoch 'e' are safe, when they can't be kept in a bag */
+static void _cdb_epoch_wait(CDBEPOCH *ep, uint64_t e)
+{
+    while(__atomic_load_n(&ep->epoch, __ATOMIC_ACQUIRE) < e + 2) {
+        pthread_mutex_lock(&ep->lock);
+        _cdb_epoch_advance(ep);
+        pthread_mutex_unlock(&ep->lock);
+        sched_yield();
+    }
+}
+
+
+CDBEPOCH *cdb_epoch_new()
+{
+    CDBEPOCH *ep = (CDBEPOCH *)malloc(sizeof(CDBEPOCH));
+
+    ep->epoch = 1;
+    ep->recs = NULL;
+    pthread_mutex_init(&ep->lock, NULL);
+    pthread_key_create(&ep->key, _cdb_epoch_recfree);
+    return ep;
+}
+
+
+/* begin a read-side critical section, it can be nested */
+void cdb_epoch_enter(CDBEPOCH *ep)
+{
+    CDBEPOCHREC *rec = _cdb_epoch_getrec(ep);
+
+    if (rec->nest++ == 0) {
+        uint64_t e = __atomic_load_n(&ep->epoch, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&rec->epoch, e, __ATOMIC_SEQ_CST);
+        /* the announcement must be visible before any shared pointer is read */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+
+void cdb_epoch_exit(CDBEPOCH *ep)
+{
+    CDBEPOCHREC *rec = (CDBEPOCHREC *)pthread_getspecific(ep->key);
+
+    if (rec && --rec->nest == 0)
+        __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+void cdb_epoch_retire(CDBEPOCH *ep, void *ptr, CDBEPOCHFREE func, void *arg)
+{
+    CDBEPOCHREC *rec = _cdb_epoch_getrec(ep);
+    uint64_t e = __atomic_load_n(&ep->epoch, __ATOMIC_ACQUIRE);
+    CDBEPOCHBAG *bag = &rec->bags[e % 3];
+
+    /* the bag was filled three epochs ago at least, nobody can see them now */
+    if (bag->epoch != e) {
+        _cdb_epoch_freebag(bag);
+        bag->epoch = e;
+    }
+    if (bag->num == bag->cap) {
+        uint32_t cap = bag->cap? bag->cap * 2: CDBEPOCHRETIRENUM;
+        CDBEPOCHNODE *nodes = (CDBEPOCHNODE *)realloc(bag->nodes, cap * sizeof(CDBEPOCHNODE));
+        if (nodes == NULL) {
+            _cdb_epoch_wait(ep, e);
+            if (func)
+                func(ptr, arg);
+            else
+                free(ptr);
+            return;
+        }
+        bag->nodes = nodes;
+        bag->cap = cap;
+    }
+    bag->nodes[bag->num].ptr = ptr;
+    bag->nodes[bag->num].func = func;
+    bag->nodes[bag->num].arg = arg;
+
+    /* others advancing the epoch is as good */
+    if (++bag->num % CDBEPOCHRETIRENUM == 0 && pthread_mutex_trylock(&ep->lock) == 0) {
+        _cdb_epoch_advance(ep);
+        pthread_mutex_unlock(&ep->lock);
+        _cdb_epoch_collect(rec, __atomic_load_n(&ep->epoch, __ATOMIC_ACQUIRE));
+    }
+}
+
+
+void cdb_epoch_reclaim(CDBEPOCH *ep)
+{
+    CDBEPOCHREC *rec = (CDBEPOCHREC *)pthread_getspecific(ep->key);
+    uint64_t e;
+
+    pthread_mutex_lock(&ep->lock);
+    /* two steps are needed to free everything retired before */
+    _cdb_epoch_advance(ep);
+    _cdb_epoch_advance(ep);
+    e = ep->epoch;
+    /* the owner has exited, a new thread takes a record only under lock */
+    for(CDBEPOCHREC *orec = ep->recs; orec; orec = orec->next) {
+        if (!__atomic_load_n(&orec->inuse, __ATOMIC_ACQUIRE))
+            _cdb_epoch_collect(orec, e);
+    }
+    pthread_mutex_unlock(&ep->lock);
+    if (rec)
+        _cdb_epoch_collect(rec, e);
+}
+
+
+void cdb_epoch_drain(CDBEPOCH *ep)
+{
+    pthread_mutex_lock(&ep->lock);
+    for(CDBEPOCHREC *rec = ep->recs; rec; rec = rec->next) {
+        for(int i = 0; i < 3; i++)
+            _cdb_epoch_freebag(&rec->bags[i]);
+    }
+    pthread_mutex_unlock(&ep->lock);
+}
+
+
+void cdb_epoch_destroy(CDBEPOCH *ep)
+{
+    CDBEPOCHREC *rec = ep->recs;
+
+    cdb_epoch_drain(ep);
+
+    pthread_setspecific(ep->key, NULL);
+    pthread_key_delete(ep->key);
+    while(rec) {
+        CDBEPOCHREC *next = rec->next;
+        for(int i = 0; i < 3; i++)
+            free(rec->bags[i].nodes);
+        free(rec);
+        rec = next;
+    }
+    pthread_mutex_destroy(&ep->lock);
+    free(ep);
+}
@@ -0,0 +1,93 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+#ifndef _CDB_EPOCH_H_
+#define _CDB_EPOCH_H_
+#include <stdint.h>
+#include <pthread.h>
+
+
+/* try to advance the global epoch when a thread has retired so many objects in one epoch */
+#define CDBEPOCHRETIRENUM 256
+
+typedef void (*CDBEPOCHFREE)(void *ptr, void *arg);
+
+/* an object waiting to be freed */
+typedef struct CDBEPOCHNODE
+{
+    void *ptr;
+    CDBEPOCHFREE func;
+    void *arg;
+} CDBEPOCHNODE;
+
+
+/* objects retired by a thread in the same epoch */
+typedef struct CDBEPOCHBAG
+{
+    CDBEPOCHNODE *nodes;
+    uint32_t num;
+    uint32_t cap;
+    /* the epoch they were retired in */
+    uint64_t epoch;
+} CDBEPOCHBAG;
+
+
+/* per thread state, one record for each thread which ever entered the epoch */
+typedef struct CDBEPOCHREC
+{
+    /* epoch seen by the thread when it entered, 0 if not in critical section */
+    uint64_t epoch;
+    /* nested enter count */
+    uint32_t nest;
+    /* is the record owned by a live thread? */
+    uint32_t inuse;
+    struct CDBEPOCHREC *next;
+    /* objects retired by the owner thread, in bag e % 3 for epoch e. Only the owner 
+     touches them, or anyone holding the lock after the owner exited */
+    CDBEPOCHBAG bags[3];
+} __attribute__((aligned(64))) CDBEPOCHREC;
+
+
+/* epoch based memory reclamation. Readers enter a critical section without
+ any lock, writers retire the objects they unlinked to their own records, which 
+ are freed only after every reader seen them has left */
+typedef struct CDBEPOCH
+{
+    /* global epoch, starts from 1 */
+    uint64_t epoch;
+    /* all thread records */
+    CDBEPOCHREC *recs;
+    /* protect recs list and epoch advancing */
+    pthread_mutex_t lock;
+    /* key to get the record of current thread */
+    pthread_key_t key;
+} CDBEPOCH;
+
+
+CDBEPOCH *cdb_epoch_new();
+void cdb_epoch_enter(CDBEPOCH *ep);
+void cdb_epoch_exit(CDBEPOCH *ep);
+/* free 'ptr' by func(ptr, arg)(default free()) when no reader could see it anymore */
+void cdb_epoch_retire(CDBEPOCH *ep, void *ptr, CDBEPOCHFREE func, void *arg);
+/* try to advance the global epoch, free the safe objects of exited threads and the caller.
+ A live thread frees its own objects when it retires more */
+void cdb_epoch_reclaim(CDBEPOCH *ep);
+/* free all retired objects now, no thread should be in critical section */
+void cdb_epoch_drain(CDBEPOCH *ep);
+/* free all retired objects, no thread should be in critical section */
+void cdb_epoch_destroy(CDBEPOCH *ep);
+
+
+#endif
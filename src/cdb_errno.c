@@ -56,6 +56,8 @@ const char *cdb_errmsg(int ecode)
             return "File Header Error";
         case CDB_MEMDBNOCACHE:
             return "MemDB Mode With Zero Record Cache Size";
+        case CDB_CACHEDISABLED:
+            return "Cache Disabled When Opened";
         default:
             return "Error For Errno";
     }
@@ -0,0 +1,181 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *   
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license. 
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+#include "cdb_fpcache.h"
+#include "cdb_lock.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* an entry in set, followed by the payload */
+typedef struct {
+    uint64_t hash;
+    uint32_t tag;
+    uint8_t used;
+    /* hit since the replacement scan passed it */
+    uint8_t ref;
+    uint16_t pad;
+    char payload[0];
+} FPENTRY;
+
+typedef struct {
+    CDBLOCK *lock;
+    /* sets of CDBFPWAYS entries */
+    char *entries;
+    /* next way to check for replacement in each set */
+    uint8_t *hands;
+} FPSTRIPE;
+
+struct CDBFPCACHE
+{
+    FPSTRIPE stripes[CDBFPSTRIPENUM];
+    /* number of sets in a stripe */
+    uint64_t setnum;
+    /* size of an entry including payload, 8 bytes aligned */
+    uint32_t esize;
+    uint32_t psize;
+};
+
+
+/* stripe and set are picked by different bits of the hash */
+#define FPSTRIPE(fpc, hash) (&(fpc)->stripes[(hash) % CDBFPSTRIPENUM])
+#define FPSETID(fpc, hash) (((hash) >> 8) % (fpc)->setnum)
+#define FPSET(fpc, st, hash) ((st)->entries + FPSETID(fpc, hash) * (fpc)->esize * CDBFPWAYS)
+#define FPWAY(fpc, set, i) ((FPENTRY *)((set) + (i) * (fpc)->esize))
+
+
+CDBFPCACHE *cdb_fpc_new(uint64_t num, uint32_t psize)
+{
+    CDBFPCACHE *fpc = (CDBFPCACHE *)malloc(sizeof(CDBFPCACHE));
+
+    fpc->psize = psize;
+    fpc->esize = (sizeof(FPENTRY) + psize + 7) & ~7;
+    fpc->setnum = num / CDBFPSTRIPENUM / CDBFPWAYS;
+    if (fpc->setnum == 0)
+        fpc->setnum = 1;
+
+    for(int i = 0; i < CDBFPSTRIPENUM; i++) {
+        FPSTRIPE *st = &fpc->stripes[i];
+        uint64_t size = fpc->setnum * CDBFPWAYS * fpc->esize;
+        st->lock = cdb_lock_new(CDB_LOCKADAPT);
+        st->entries = (char *)malloc(size);
+        memset(st->entries, 0, size);
+        st->hands = (uint8_t *)malloc(fpc->setnum);
+        memset(st->hands, 0, fpc->setnum);
+    }
+    return fpc;
+}
+
+
+/* FNV-1a, independent from the crc64 used as 'hash' */
+uint32_t cdb_fpc_tag(const void *key, int ksize)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t h = 2166136261u;
+
+    for(int i = 0; i < ksize; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+bool cdb_fpc_get(CDBFPCACHE *fpc, uint64_t hash, uint32_t tag, void *payload)
+{
+    FPSTRIPE *st = FPSTRIPE(fpc, hash);
+    bool found = false;
+    char *set;
+
+    cdb_lock_lock(st->lock);
+    set = FPSET(fpc, st, hash);
+    for(int i = 0; i < CDBFPWAYS; i++) {
+        FPENTRY *e = FPWAY(fpc, set, i);
+        if (e->used && e->hash == hash && e->tag == tag) {
+            e->ref = 1;
+            if (payload)
+                memcpy(payload, e->payload, fpc->psize);
+            found = true;
+            break;
+        }
+    }
+    cdb_lock_unlock(st->lock);
+    return found;
+}
+
+
+void cdb_fpc_set(CDBFPCACHE *fpc, uint64_t hash, uint32_t tag, const void *payload)
+{
+    FPSTRIPE *st = FPSTRIPE(fpc, hash);
+    FPENTRY *victim = NULL;
+    uint64_t sid = FPSETID(fpc, hash);
+    char *set;
+
+    cdb_lock_lock(st->lock);
+    set = FPSET(fpc, st, hash);
+    for(int i = 0; i < CDBFPWAYS; i++) {
+        FPENTRY *e = FPWAY(fpc, set, i);
+        if (e->used && e->hash == hash && e->tag == tag) {
+            victim = e;
+            break;
+        }
+        if (!e->used && victim == NULL)
+            victim = e;
+    }
+
+    /* set is full, second chance from the hand */
+    while(victim == NULL) {
+        FPENTRY *e = FPWAY(fpc, set, st->hands[sid]);
+        st->hands[sid] = (st->hands[sid] + 1) % CDBFPWAYS;
+        if (e->ref)
+            e->ref = 0;
+        else
+            victim = e;
+    }
+
+    victim->hash = hash;
+    victim->tag = tag;
+    victim->used = 1;
+    victim->ref = 0;
+    if (fpc->psize)
+        memcpy(victim->payload, payload, fpc->psize);
+    cdb_lock_unlock(st->lock);
+}
+
+
+void cdb_fpc_del(CDBFPCACHE *fpc, uint64_t hash)
+{
+    FPSTRIPE *st = FPSTRIPE(fpc, hash);
+    char *set;
+
+    cdb_lock_lock(st->lock);
+    set = FPSET(fpc, st, hash);
+    for(int i = 0; i < CDBFPWAYS; i++) {
+        FPENTRY *e = FPWAY(fpc, set, i);
+        if (e->used && e->hash == hash)
+            e->used = 0;
+    }
+    cdb_lock_unlock(st->lock);
+}
+
+
+void cdb_fpc_destroy(CDBFPCACHE *fpc)
+{
+    for(int i = 0; i < CDBFPSTRIPENUM; i++) {
+        cdb_lock_destory(fpc->stripes[i].lock);
+        free(fpc->stripes[i].entries);
+        free(fpc->stripes[i].hands);
+    }
+    free(fpc);
+}
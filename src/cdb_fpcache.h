@@ -0,0 +1,46 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *   
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license. 
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+/*
+A bounded cache of key fingerprints (64-bit hash + 32-bit tag) with an optional small 
+fixed-size payload. Keys themselves are not stored, so the memory cost per entry is tiny.
+It is split into stripes with their own lock, every stripe is a set-associative table
+with second-chance replacement in each set
+*/
+#ifndef _CDB_FPCACHE_H_
+#define _CDB_FPCACHE_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct CDBFPCACHE CDBFPCACHE;
+
+/* number of independently locked stripes */
+#define CDBFPSTRIPENUM 64
+/* number of entries in a set */
+#define CDBFPWAYS 4
+
+/* 'num' is the max number of entries, 'psize' is the payload size, may be 0 */
+CDBFPCACHE *cdb_fpc_new(uint64_t num, uint32_t psize);
+/* a second hash of key, to tell apart keys with the same 64-bit hash */
+uint32_t cdb_fpc_tag(const void *key, int ksize);
+/* look up an entry, copy its payload out if 'payload' is not NULL */
+bool cdb_fpc_get(CDBFPCACHE *fpc, uint64_t hash, uint32_t tag, void *payload);
+/* insert or update an entry, may replace another one in the same set */
+void cdb_fpc_set(CDBFPCACHE *fpc, uint64_t hash, uint32_t tag, const void *payload);
+/* drop all entries with the 64-bit hash, whatever the tag is */
+void cdb_fpc_del(CDBFPCACHE *fpc, uint64_t hash);
+void cdb_fpc_destroy(CDBFPCACHE *fpc);
+
+#endif
@@ -16,6 +16,9 @@
 #include "cdb_hashtable.h"
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
 #define LRUPREV(i) (*(CDBHTITEM**)&((i)->buf[0]))
@@ -25,6 +28,51 @@
 #define LRUPREV(i) ((i)->lruptr[0])
 #define LRUNEXT(i) ((i)->lruptr[1])
 
+/* chain pointers may be read by lock-free readers at the same time */
+#define HTLOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define HTSTORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+/* size and number are changed under the writers' lock, but read by others without it */
+#define HTSIZESET(ht, v) __atomic_store_n(&(ht)->size, (v), __ATOMIC_RELAXED)
+#define HTNUMSET(ht, v) __atomic_store_n(&(ht)->num, (v), __ATOMIC_RELAXED)
+
+/* in open addressing mode, the hash is mixed again since the low bits select the bucket.
+ The low bits of the result pick the slot, the 7 high bits are kept in control byte */
+#define OAHASH(hash) (((hash) >> CDBHTBNUMPOW) * 0x9E3779B1U)
+#define OAH2(h) ((h) >> 25)
+/* slots of the old table moved in an insertion or deletion while growing */
+#define OAREHASHSTEP 64
+#define OATABLESIZE(cap) (((sizeof(CDBHTOATABLE) + (cap) + CDBHTOAGROUP + 7) & ~7UL) \
+    + (cap) * sizeof(CDBHTITEM *))
+
+/* memory really taken by a malloc()ed block of 'size' bytes: a word of chunk 
+ header, rounded up to 16 bytes, no less than 32 bytes (as in glibc) */
+#define HTMEMSIZE(size) ((((size) + sizeof(size_t) + 15) & ~15UL) < 32? \
+    32: (((size) + sizeof(size_t) + 15) & ~15UL))
+
+static void _cdb_ht_wbegin(CDBHASHTABLE *ht, CDBHTBUCKET *bucket);
+static void _cdb_ht_wend(CDBHASHTABLE *ht, CDBHTBUCKET *bucket);
+static void _cdb_ht_secondchance(CDBHASHTABLE *ht);
+static CDBHTITEM *_cdb_ht_clockhand(CDBHASHTABLE *ht);
+static uint32_t _cdb_ht_rawsize(CDBHASHTABLE *ht, CDBHTITEM *item);
+static void _cdb_ht_release(void *ptr, void *arg);
+static void _cdb_ht_lruunlink(CDBHASHTABLE *ht, CDBHTITEM *item);
+static CDBHTITEM *_cdb_ht_slot(CDBHASHTABLE *ht, CDBHTBUCKET *bucket, uint32_t hid);
+static uint32_t _cdb_ht_oamatch(const uint8_t *ctrl, uint8_t c);
+static void _cdb_ht_oasetctrl(CDBHTOATABLE *t, uint32_t i, uint8_t c);
+static CDBHTOATABLE *_cdb_ht_oanew(uint32_t cap);
+static CDBHTITEM *_cdb_ht_oafind(CDBHASHTABLE *ht, CDBHTOATABLE *t, uint32_t hash,
+        const void *key, int ksize, CDBHTITEM *target, uint32_t *slot);
+static uint32_t _cdb_ht_oafree(CDBHTOATABLE *t, uint32_t h);
+static void _cdb_ht_oaplace(CDBHTOATABLE *t, CDBHTITEM *item);
+static void _cdb_ht_oastep(CDBHASHTABLE *ht, CDBHTBUCKET *bucket);
+static void _cdb_ht_oagrow(CDBHASHTABLE *ht, CDBHTBUCKET *bucket);
+static void _cdb_ht_oaclear(CDBHTOATABLE *t, uint32_t i);
+static CDBHTOATABLE *_cdb_ht_oaat(CDBHTBUCKET *bucket, uint32_t *hid);
+static CDBHTITEM *_cdb_ht_oalookup(CDBHASHTABLE *ht, CDBHTBUCKET *bucket, uint32_t hash,
+        const void *key, int ksize, CDBHTITEM *target, uint32_t *hid);
+static void _cdb_ht_oaremove(CDBHTBUCKET *bucket, uint32_t hid);
+static void _cdb_ht_oashrink(CDBHASHTABLE *ht, CDBHTBUCKET *bucket);
+
 static uint32_t MurmurHash1( const void * key, int len)
 {
     const unsigned int m = 0xc6a4a793;
@@ -56,6 +104,389 @@ static uint32_t MurmurHash1( const void * key, int len)
     return h;
 } 
 
+/* chains in the bucket are going to be relinked, readers should retry */
+static void _cdb_ht_wbegin(CDBHASHTABLE *ht, CDBHTBUCKET *bucket)
+{
+    if (ht->epoch) {
+        __atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+
+static void _cdb_ht_wend(CDBHASHTABLE *ht, CDBHTBUCKET *bucket)
+{
+    if (ht->epoch)
+        __atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/* move referenced items at the tail to the front, clear their marks */
+static void _cdb_ht_secondchance(CDBHASHTABLE *ht)
+{
+    uint64_t cnt = ht->num;
+
+    while(ht->tail && ht->tail != ht->head && ht->tail->ref && cnt--) {
+        CDBHTITEM *item = ht->tail;
+        item->ref = 0;
+        ht->tail = LRUPREV(item);
+        LRUNEXT(ht->tail) = NULL;
+        LRUPREV(item) = NULL;
+        LRUNEXT(item) = ht->head;
+        LRUPREV(ht->head) = item;
+        ht->head = item;
+    }
+}
+
+
+static void _cdb_ht_lruunlink(CDBHASHTABLE *ht, CDBHTITEM *item)
+{
+    if (LRUPREV(item))
+        LRUNEXT(LRUPREV(item)) = LRUNEXT(item);
+    if (LRUNEXT(item))
+        LRUPREV(LRUNEXT(item)) = LRUPREV(item);
+    if (ht->head == item)
+        ht->head = LRUNEXT(item);
+    if (ht->tail == item) 
+        ht->tail = LRUPREV(item);
+}
+
+
+/* the first item at a slot of level-2 bucket, for scanning */
+static CDBHTITEM *_cdb_ht_slot(CDBHASHTABLE *ht, CDBHTBUCKET *bucket, uint32_t hid)
+{
+    if (ht->oa) {
+        CDBHTOATABLE *t = _cdb_ht_oaat(bucket, &hid);
+        return t->slots[hid];
+    }
+    return bucket->items[hid];
+}
+
+
+/* bits set for the control bytes equal to 'c' in the group */
+static uint32_t _cdb_ht_oamatch(const uint8_t *ctrl, uint8_t c)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)c)));
+#else
+    uint32_t bits = 0;
+    for(int i = 0; i < CDBHTOAGROUP; i++)
+        if (__atomic_load_n(&ctrl[i], __ATOMIC_RELAXED) == c)
+            bits |= 1U << i;
+    return bits;
+#endif
+}
+
+
+/* the first group is mirrored after the end, so a group can be loaded at any slot */
+static void _cdb_ht_oasetctrl(CDBHTOATABLE *t, uint32_t i, uint8_t c)
+{
+    __atomic_store_n(&t->ctrl[i], c, __ATOMIC_RELEASE);
+    if (i < CDBHTOAGROUP)
+        __atomic_store_n(&t->ctrl[t->mask + 1 + i], c, __ATOMIC_RELEASE);
+}
+
+
+static CDBHTOATABLE *_cdb_ht_oanew(uint32_t cap)
+{
+    CDBHTOATABLE *t = (CDBHTOATABLE *)malloc(OATABLESIZE(cap));
+
+    t->mask = cap - 1;
+    t->tomb = 0;
+    memset(t->ctrl, CDBHTOAEMPTY, cap + CDBHTOAGROUP);
+    t->slots = (CDBHTITEM **)((char *)t + OATABLESIZE(cap) - cap * sizeof(CDBHTITEM *));
+    memset(t->slots, 0, cap * sizeof(CDBHTITEM *));
+    return t;
+}
+
+
+/* look up by key, or by item pointer if 'target' isn't NULL. Groups are probed 
+ triangularly until one has an empty slot. Safe for lock-free readers */
+static CDBHTITEM *_cdb_ht_oafind(CDBHASHTABLE *ht, CDBHTOATABLE *t, uint32_t hash,
+        const void *key, int ksize, CDBHTITEM *target, uint32_t *slot)
+{
+    uint32_t h = OAHASH(hash), pos, step = 0;
+
+    if (t == NULL)
+        return NULL;
+
+    pos = h & t->mask;
+    for(;;) {
+        uint32_t bits = _cdb_ht_oamatch(t->ctrl + pos, OAH2(h));
+        while(bits) {
+            uint32_t i = (pos + __builtin_ctz(bits)) & t->mask;
+            CDBHTITEM *curitem = HTLOAD(t->slots[i]);
+            bits &= bits - 1;
+            if (curitem == NULL)
+                continue;
+            if (target? curitem == target: (curitem->hash == hash
+                && curitem->ksize == ksize
+                && memcmp(cdb_ht_itemkey(ht, curitem), key, ksize) == 0)) {
+                if (slot)
+                    *slot = i;
+                return curitem;
+            }
+        }
+        if (_cdb_ht_oamatch(t->ctrl + pos, CDBHTOAEMPTY))
+            return NULL;
+        step += CDBHTOAGROUP;
+        /* every group has been visited */
+        if (step > t->mask + 1)
+            return NULL;
+        pos = (pos + step) & t->mask;
+    }
+}
+
+
+/* find a slot for insertion, there is always one since the load is limited */
+static uint32_t _cdb_ht_oafree(CDBHTOATABLE *t, uint32_t h)
+{
+    uint32_t pos = h & t->mask, step = 0;
+
+    for(;;) {
+        uint32_t bits = _cdb_ht_oamatch(t->ctrl + pos, CDBHTOAEMPTY)
+            | _cdb_ht_oamatch(t->ctrl + pos, CDBHTOADELETED);
+        if (bits)
+            return (pos + __builtin_ctz(bits)) & t->mask;
+        step += CDBHTOAGROUP;
+        pos = (pos + step) & t->mask;
+    }
+}
+
+
+/* put an item into a table which has room for it */
+static void _cdb_ht_oaplace(CDBHTOATABLE *t, CDBHTITEM *item)
+{
+    uint32_t h = OAHASH(item->hash);
+    uint32_t i = _cdb_ht_oafree(t, h);
+
+    if (t->ctrl[i] == CDBHTOADELETED)
+        t->tomb--;
+    /* publish the item before the control byte */
+    HTSTORE(t->slots[i], item);
+    _cdb_ht_oasetctrl(t, i, OAH2(h));
+}
+
+
+/* move a few slots of the old table to the new one, drop the old table when done */
+static void _cdb_ht_oastep(CDBHASHTABLE *ht, CDBHTBUCKET *bucket)
+{
+    CDBHTOATABLE *ot = bucket->oldoat;
+
+    if (ot == NULL)
+        return;
+
+    _cdb_ht_wbegin(ht, bucket);
+    for(uint32_t n = 0; n < OAREHASHSTEP && bucket->oldpos <= ot->mask; n++) {
+        CDBHTITEM *curitem = ot->slots[bucket->oldpos];
+        if (curitem) {
+            _cdb_ht_oaplace(bucket->oat, curitem);
+            _cdb_ht_oaclear(ot, bucket->oldpos);
+        }
+        bucket->oldpos++;
+    }
+
+    if (bucket->oldpos > ot->mask) {
+        HTSTORE(bucket->oldoat, NULL);
+        bucket->bnum = bucket->oat->mask + 1;
+        HTSIZESET(ht, ht->size - OATABLESIZE(ot->mask + 1));
+        if (ht->epoch)
+            cdb_epoch_retire(ht->epoch, ot, NULL, NULL);
+        else
+            free(ot);
+    }
+    _cdb_ht_wend(ht, bucket);
+}
+
+
+/* slots of a new table for the bucket, less than half full, and large enough to take
+ the items put before all the old slots are moved by _cdb_ht_oastep */
+static uint32_t _cdb_ht_oacap(CDBHTBUCKET *bucket)
+{
+    uint32_t cap = CDBHTOAGROUP;
+    uint32_t need = bucket->rnum + 1;
+
+    if (bucket->oat)
+        need += (bucket->oat->mask + 1) / OAREHASHSTEP + 1;
+    while(need * 16 > cap * 7)
+        cap <<= 1;
+    return cap;
+}
+
+
+/* replace the table of a bucket by a new one of 'cap' slots, items are moved later */
+static void _cdb_ht_oareplace(CDBHASHTABLE *ht, CDBHTBUCKET *bucket, uint32_t cap)
+{
+    CDBHTOATABLE *t = bucket->oat;
+
+    /* readers get either the old table or both of them */
+    _cdb_ht_wbegin(ht, bucket);
+    HTSTORE(bucket->oldoat, t);
+    HTSTORE(bucket->oat, _cdb_ht_oanew(cap));
+    bucket->oldpos = 0;
+    bucket->bnum = cap + (t? t->mask + 1: 0);
+    _cdb_ht_wend(ht, bucket);
+    HTSIZESET(ht, ht->size + OATABLESIZE(cap));
+}
+
+
+/* make room for one more item. If slots in use (deleted ones included) would 
+ exceed 7/8, the table is replaced by a larger one */
+static void _cdb_ht_oagrow(CDBHASHTABLE *ht, CDBHTBUCKET *bucket)
+{
+    CDBHTOATABLE *t = bucket->oat;
+
+    /* should hardly happen, the new table is sized for the whole rehashing */
+    if (bucket->oldoat && (bucket->rnum + t->tomb + 1) * 8 > (t->mask + 1) * 7) {
+        while(bucket->oldoat)
+            _cdb_ht_oastep(ht, bucket);
+    }
+
+    if (t == NULL || (bucket->rnum + t->tomb + 1) * 8 > (t->mask + 1) * 7)
+        _cdb_ht_oareplace(ht, bucket, _cdb_ht_oacap(bucket));
+}
+
+
+/* give memory back after removals. An emptied bucket drops its table, a table less
+ than 1/8 used is replaced by a smaller one the same way as it grows */
+static void _cdb_ht_oashrink(CDBHASHTABLE *ht, CDBHTBUCKET *bucket)
+{
+    CDBHTOATABLE *t = bucket->oat;
+
+    if (t == NULL)
+        return;
+
+    if (bucket->rnum == 0) {
+        /* nothing left to move */
+        while(bucket->oldoat)
+            _cdb_ht_oastep(ht, bucket);
+        t = bucket->oat;
+        _cdb_ht_wbegin(ht, bucket);
+        HTSTORE(bucket->oat, NULL);
+        bucket->bnum = 0;
+        _cdb_ht_wend(ht, bucket);
+        HTSIZESET(ht, ht->size - OATABLESIZE(t->mask + 1));
+        if (ht->epoch)
+            cdb_epoch_retire(ht->epoch, t, NULL, NULL);
+        else
+            free(t);
+    } else if (bucket->oldoat == NULL && bucket->rnum * 8 < t->mask + 1) {
+        uint32_t cap = _cdb_ht_oacap(bucket);
+        if (cap < t->mask + 1)
+            _cdb_ht_oareplace(ht, bucket, cap);
+    }
+}
+
+
+static void _cdb_ht_oaclear(CDBHTOATABLE *t, uint32_t i)
+{
+    _cdb_ht_oasetctrl(t, i, CDBHTOADELETED);
+    HTSTORE(t->slots[i], NULL);
+    t->tomb++;
+}
+
+
+/* the table holding slot 'hid' of a bucket, 'hid' is turned into the slot in it */
+static CDBHTOATABLE *_cdb_ht_oaat(CDBHTBUCKET *bucket, uint32_t *hid)
+{
+    CDBHTOATABLE *ot = bucket->oldoat;
+
+    if (ot == NULL)
+        return bucket->oat;
+    if (*hid <= ot->mask)
+        return ot;
+    *hid -= ot->mask + 1;
+    return bucket->oat;
+}
+
+
+/* look up in both tables while growing, by writers only */
+static CDBHTITEM *_cdb_ht_oalookup(CDBHASHTABLE *ht, CDBHTBUCKET *bucket, uint32_t hash,
+        const void *key, int ksize, CDBHTITEM *target, uint32_t *hid)
+{
+    CDBHTITEM *res;
+    uint32_t base = 0;
+
+    if (bucket->oldoat) {
+        res = _cdb_ht_oafind(ht, bucket->oldoat, hash, key, ksize, target, hid);
+        if (res)
+            return res;
+        base = bucket->oldoat->mask + 1;
+    }
+
+    res = _cdb_ht_oafind(ht, bucket->oat, hash, key, ksize, target, hid);
+    if (res && hid)
+        *hid += base;
+    return res;
+}
+
+
+static void _cdb_ht_oaremove(CDBHTBUCKET *bucket, uint32_t hid)
+{
+    CDBHTOATABLE *t = _cdb_ht_oaat(bucket, &hid);
+    _cdb_ht_oaclear(t, hid);
+}
+
+
+/* sweep the clock hand until an unreferenced item, clear the marks it passes.
+ Lock-free readers may set marks again meanwhile, so give up after two rounds */
+static CDBHTITEM *_cdb_ht_clockhand(CDBHASHTABLE *ht)
+{
+    uint64_t passed = 0;
+
+    if (ht->num == 0)
+        return NULL;
+
+    for(;;) {
+        CDBHTBUCKET *bucket = &(ht->buckets[ht->handbid]);
+        if (ht->handhid < bucket->bnum) {
+            CDBHTITEM *curitem = _cdb_ht_slot(ht, bucket, ht->handhid);
+            while(curitem != NULL) {
+                if (!curitem->ref || passed++ > ht->num * 2)
+                    return curitem;
+                __atomic_store_n(&curitem->ref, 0, __ATOMIC_RELAXED);
+                curitem = curitem->hnext;
+            }
+            ht->handhid++;
+        } else {
+            ht->handhid = 0;
+            ht->handbid = (ht->handbid + 1) & ((1<<CDBHTBNUMPOW)-1);
+        }
+    }
+}
+
+
+/* size requested for an item */
+static uint32_t _cdb_ht_rawsize(CDBHASHTABLE *ht, CDBHTITEM *item)
+{
+    return sizeof(CDBHTITEM) + item->ksize + item->vsize
+        + ht->lru * sizeof(CDBHTITEM*) * 2;
+}
+
+
+/* give the memory of an item back to slab or system, 'arg' is the table */
+static void _cdb_ht_release(void *ptr, void *arg)
+{
+    CDBHASHTABLE *ht = (CDBHASHTABLE *)arg;
+
+    if (ht->slab && _cdb_ht_rawsize(ht, (CDBHTITEM *)ptr) <= CDBSLABMAXOBJ)
+        cdb_slab_free(ht->slab, ptr);
+    else
+        free(ptr);
+}
+
+
+uint32_t cdb_ht_itemsize(CDBHASHTABLE *ht, CDBHTITEM *item)
+{
+    uint32_t size = _cdb_ht_rawsize(ht, item);
+
+    if (ht->slab && size <= CDBSLABMAXOBJ)
+        return cdb_slab_objsize(size);
+    return HTMEMSIZE(size);
+}
+
+
 void *cdb_ht_itemkey(CDBHASHTABLE *ht, CDBHTITEM *item)
 {
     return (void *)(item->buf + ht->lru * 2 * sizeof(void*));
@@ -66,33 +497,77 @@ void *cdb_ht_itemval(CDBHASHTABLE *ht, CDBHTITEM *item)
     return (void *)(item->buf + ht->lru * 2 * sizeof(void*) + item->ksize);
 }
 
-CDBHASHTABLE *cdb_ht_new(bool lru, CDBHASHFUNC hashfunc)
+CDBHASHTABLE *cdb_ht_new(int mode, CDBHASHFUNC hashfunc)
 {
     CDBHASHTABLE *ht;
 
     ht = (CDBHASHTABLE*)malloc(sizeof(CDBHASHTABLE));
     ht->hash = NULL;
-    ht->lru = lru;
+    ht->oa = (mode & CDB_HTOPENADDR) != 0;
+    mode &= ~CDB_HTOPENADDR;
+    ht->lru = (mode == CDB_HTLRU);
+    ht->clock = (mode == CDB_HTCLOCK);
+    ht->handbid = ht->handhid = 0;
     ht->num = ht->size = 0;
     ht->tail = ht->head = NULL;
+    ht->epoch = NULL;
+    ht->slab = NULL;
     for(uint32_t i = 0; i < (1<<CDBHTBNUMPOW); i++) {
         CDBHTBUCKET *bucket = &(ht->buckets[i]);
+        bucket->rnum = 0;
+        bucket->seq = 0;
+        bucket->oat = bucket->oldoat = NULL;
+        bucket->oldpos = 0;
+        if (ht->oa) {
+            bucket->bnum = 0;
+            bucket->items = NULL;
+            continue;
+        }
         bucket->bnum = 2;
         uint32_t lsize = sizeof(CDBHTITEM *) * bucket->bnum;
-        bucket->rnum = 0;
         bucket->items = (CDBHTITEM **)malloc(lsize);
-        ht->size += lsize;
+        HTSIZESET(ht, ht->size + lsize);
         memset(bucket->items, 0, lsize);
     }
     ht->hash = hashfunc;
     if (ht->hash == NULL)
         ht->hash = MurmurHash1;
 
-    ht->size += sizeof(CDBHASHTABLE);
+    HTSIZESET(ht, ht->size + sizeof(CDBHASHTABLE));
 
     return ht;
 }
 
+
+void cdb_ht_setepoch(CDBHASHTABLE *ht, CDBEPOCH *ep)
+{
+    ht->epoch = ep;
+}
+
+
+void cdb_ht_setslab(CDBHASHTABLE *ht, CDBSLAB *slab)
+{
+    if (ht->slab)
+        cdb_slab_release(ht->slab);
+    ht->slab = cdb_slab_ref(slab);
+}
+
+
+void cdb_ht_freeitem(CDBHASHTABLE *ht, CDBHTITEM *item)
+{
+    if (ht->epoch)
+        cdb_epoch_retire(ht->epoch, item, _cdb_ht_release, ht);
+    else
+        _cdb_ht_release(item, ht);
+}
+
+
+void cdb_ht_dropitem(CDBHASHTABLE *ht, CDBHTITEM *item)
+{
+    _cdb_ht_release(item, ht);
+}
+
+
 CDBHTITEM *cdb_ht_newitem(CDBHASHTABLE *ht, int ksize, int vsize)
 {
     CDBHTITEM *item;
@@ -103,9 +578,13 @@ CDBHTITEM *cdb_ht_newitem(CDBHASHTABLE *ht, int ksize, int vsize)
     else
         hsize = sizeof(CDBHTITEM);
 
-    item = (CDBHTITEM*)malloc(hsize + ksize + vsize);
+    if (ht->slab && hsize + ksize + vsize <= CDBSLABMAXOBJ)
+        item = (CDBHTITEM*)cdb_slab_alloc(ht->slab, hsize + ksize + vsize);
+    else
+        item = (CDBHTITEM*)malloc(hsize + ksize + vsize);
     item->ksize = ksize;
     item->vsize = vsize;
+    item->ref = 0;
     if (ht->lru) {
         LRUPREV(item) = NULL;
         LRUNEXT(item) = NULL;
@@ -124,8 +603,36 @@ void cdb_ht_insert(CDBHASHTABLE *ht, CDBHTITEM *item)
     item->hash = ht->hash(cdb_ht_itemkey(ht, item), item->ksize);
     bid = item->hash & ((1<<CDBHTBNUMPOW)-1);
     bucket = &(ht->buckets[bid]);
-    hid = (item->hash >> CDBHTBNUMPOW) & (bucket->bnum-1);
 
+    if (ht->oa) {
+        uint32_t slot;
+        CDBHTITEM *curitem;
+
+        _cdb_ht_oastep(ht, bucket);
+        _cdb_ht_oagrow(ht, bucket);
+        curitem = _cdb_ht_oalookup(ht, bucket, item->hash,
+                cdb_ht_itemkey(ht, item), item->ksize, NULL, &slot);
+        item->hnext = NULL;
+        item->ref = 0;
+        if (curitem) {
+            /* the new one may be put in a group a reader has passed, 
+             make the reader retry rather than miss both */
+            if (ht->lru)
+                _cdb_ht_lruunlink(ht, curitem);
+            _cdb_ht_wbegin(ht, bucket);
+            _cdb_ht_oaplace(bucket->oat, item);
+            _cdb_ht_oaremove(bucket, slot);
+            _cdb_ht_wend(ht, bucket);
+            HTSIZESET(ht, ht->size - cdb_ht_itemsize(ht, curitem));
+            HTNUMSET(ht, ht->num - 1);
+            bucket->rnum--;
+            cdb_ht_freeitem(ht, curitem);
+        } else
+            _cdb_ht_oaplace(bucket->oat, item);
+        goto LINKED;
+    }
+
+    hid = (item->hash >> CDBHTBNUMPOW) & (bucket->bnum-1);
     if (bucket->rnum > bucket->bnum * 2) {
         CDBHTITEM **ilist;
         uint32_t exp = 2;
@@ -134,6 +641,7 @@ void cdb_ht_insert(CDBHASHTABLE *ht, CDBHTITEM *item)
         int listsize = (bucket->bnum * exp) * sizeof(CDBHTITEM*);
         ilist = (CDBHTITEM**)malloc(listsize);
         memset(ilist, 0, listsize);
+        _cdb_ht_wbegin(ht, bucket);
         for(uint32_t i = 0; i < bucket->bnum; i++) {
             CDBHTITEM *curitem = bucket->items[i];
             while(curitem != NULL) {
@@ -145,10 +653,15 @@ void cdb_ht_insert(CDBHASHTABLE *ht, CDBHTITEM *item)
                 curitem = nextitem;
             }
         }
-        free(bucket->items);
-        bucket->items = ilist;
-        ht->size += listsize - bucket->bnum * sizeof(CDBHTITEM *);
-        bucket->bnum *= exp;
+        if (ht->epoch)
+            cdb_epoch_retire(ht->epoch, bucket->items, NULL, NULL);
+        else
+            free(bucket->items);
+        /* a reader sees the new bnum only if it can see the new list */
+        HTSTORE(bucket->items, ilist);
+        HTSIZESET(ht, ht->size + (listsize - bucket->bnum * sizeof(CDBHTITEM *)));
+        HTSTORE(bucket->bnum, bucket->bnum * exp);
+        _cdb_ht_wend(ht, bucket);
         hid = (item->hash >> CDBHTBNUMPOW) & (bucket->bnum - 1);
     }
 
@@ -161,26 +674,19 @@ void cdb_ht_insert(CDBHASHTABLE *ht, CDBHTITEM *item)
                 && memcmp(cdb_ht_itemkey(ht, curitem),
                 cdb_ht_itemkey(ht, item) ,curitem->ksize) == 0) {
                     CDBHTITEM *tmp;
-                    if (ht->lru) {
-                        if (LRUPREV(curitem))
-                            LRUNEXT(LRUPREV(curitem)) = LRUNEXT(curitem);
-                        if (LRUNEXT(curitem))
-                            LRUPREV(LRUNEXT(curitem)) = LRUPREV(curitem);
-                        if (ht->head == curitem)
-                            ht->head = LRUNEXT(curitem);
-                        if (ht->tail == curitem) 
-                            ht->tail = LRUPREV(curitem);
-                    }
+                    if (ht->lru)
+                        _cdb_ht_lruunlink(ht, curitem);
+                    _cdb_ht_wbegin(ht, bucket);
                     if (preitem)
-                        preitem->hnext = curitem->hnext;
+                        HTSTORE(preitem->hnext, curitem->hnext);
                     else
-                        bucket->items[hid] = curitem->hnext;
+                        HTSTORE(bucket->items[hid], curitem->hnext);
+                    _cdb_ht_wend(ht, bucket);
                     tmp = curitem->hnext;
-                    ht->size -= sizeof(CDBHTITEM) + curitem->ksize + curitem->vsize
-                        + (ht->lru > 0) * sizeof(CDBHTITEM*) * 2;
-                    ht->num--;
+                    HTSIZESET(ht, ht->size - cdb_ht_itemsize(ht, curitem));
+                    HTNUMSET(ht, ht->num - 1);
                     bucket->rnum--;
-                    free(curitem);
+                    cdb_ht_freeitem(ht, curitem);
                     curitem = tmp;
                     break;
             }
@@ -189,9 +695,12 @@ void cdb_ht_insert(CDBHASHTABLE *ht, CDBHTITEM *item)
         }
     }
 
+    item->ref = 0;
     item->hnext = bucket->items[hid];
-    bucket->items[hid] = item;
+    /* publish the item after it is fully initialized */
+    HTSTORE(bucket->items[hid], item);
 
+LINKED:
     if (ht->lru) {
         if (ht->head) LRUPREV(ht->head) = item;
         LRUPREV(item) = NULL;
@@ -202,9 +711,8 @@ void cdb_ht_insert(CDBHASHTABLE *ht, CDBHTITEM *item)
     }
 
     bucket->rnum++;
-    ht->num++;
-    ht->size += sizeof(CDBHTITEM) + item->ksize + item->vsize
-        + ht->lru * sizeof(CDBHTITEM*) * 2;
+    HTNUMSET(ht, ht->num + 1);
+    HTSIZESET(ht, ht->size + cdb_ht_itemsize(ht, item));
 }
 
 
@@ -255,31 +763,92 @@ CDBHTITEM *cdb_ht_get3(CDBHASHTABLE *ht, const void *key, int ksize, bool mtf)
     hash = ht->hash(key, ksize);
     bid = hash & ((1<<CDBHTBNUMPOW)-1);
     bucket = &(ht->buckets[bid]);
-    hid = (hash >> CDBHTBNUMPOW) & (bucket->bnum - 1);
 
-    curitem = bucket->items[hid];
-    while (curitem != NULL) {
-        if (curitem->hash == hash
-            && curitem->ksize == ksize
-            && memcmp(cdb_ht_itemkey(ht, curitem), key , ksize) == 0) {
-                if (ht->lru && mtf && ht->head != curitem) {
-                    if (LRUPREV(curitem))
-                        LRUNEXT(LRUPREV(curitem)) = LRUNEXT(curitem);
-                    if (LRUNEXT(curitem))
-                        LRUPREV(LRUNEXT(curitem)) = LRUPREV(curitem);             
-                    if (ht->tail == curitem) 
-                        ht->tail = LRUPREV(curitem);
-
-                    LRUNEXT(curitem) = ht->head;
-                    LRUPREV(ht->head) = curitem;
-                    ht->head = curitem;
-                    LRUPREV(curitem) = NULL;
-                }
-                return curitem;
+    if (ht->oa)
+        curitem = _cdb_ht_oalookup(ht, bucket, hash, key, ksize, NULL, NULL);
+    else {
+        hid = (hash >> CDBHTBNUMPOW) & (bucket->bnum - 1);
+        curitem = bucket->items[hid];
+        while (curitem != NULL) {
+            if (curitem->hash == hash
+                && curitem->ksize == ksize
+                && memcmp(cdb_ht_itemkey(ht, curitem), key , ksize) == 0)
+                break;
+            curitem = curitem->hnext;
+        }
+    }
+
+    if (curitem && mtf) {
+        if (ht->clock && !curitem->ref)
+            __atomic_store_n(&curitem->ref, 1, __ATOMIC_RELAXED);
+        if (ht->lru && ht->head != curitem) {
+            _cdb_ht_lruunlink(ht, curitem);
+            LRUNEXT(curitem) = ht->head;
+            LRUPREV(ht->head) = curitem;
+            ht->head = curitem;
+            LRUPREV(curitem) = NULL;
+        }
+    }
+    return curitem;
+}
+
+
+void *cdb_ht_rdget(CDBHASHTABLE *ht, const void *key, int ksize, int *vsize, bool mark)
+{
+    uint32_t hash, bid, hid, seq, bnum;
+    CDBHTBUCKET *bucket;
+    CDBHTITEM **items, *curitem;
+
+    hash = ht->hash(key, ksize);
+    bid = hash & ((1<<CDBHTBNUMPOW)-1);
+    bucket = &(ht->buckets[bid]);
+
+    for(;;) {
+        seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        if (ht->oa) {
+            /* an item may be moving from the old table to the new one */
+            curitem = _cdb_ht_oafind(ht, HTLOAD(bucket->oldoat), hash, key, ksize, NULL, NULL);
+            if (curitem == NULL)
+                curitem = _cdb_ht_oafind(ht, HTLOAD(bucket->oat), hash, key, ksize, NULL, NULL);
+            if (curitem) {
+                if (mark && !curitem->ref)
+                    __atomic_store_n(&curitem->ref, 1, __ATOMIC_RELAXED);
+                if (vsize)
+                    *vsize = curitem->vsize;
+                return cdb_ht_itemval(ht, curitem);
+            }
+            goto MISSED;
+        }
+
+        bnum = HTLOAD(bucket->bnum);
+        items = HTLOAD(bucket->items);
+        hid = (hash >> CDBHTBNUMPOW) & (bnum - 1);
+        curitem = HTLOAD(items[hid]);
+        while (curitem != NULL) {
+            if (curitem->hash == hash
+                && curitem->ksize == ksize
+                && memcmp(cdb_ht_itemkey(ht, curitem), key , ksize) == 0) {
+                    if (mark && !curitem->ref)
+                        __atomic_store_n(&curitem->ref, 1, __ATOMIC_RELAXED);
+                    if (vsize)
+                        *vsize = curitem->vsize;
+                    return cdb_ht_itemval(ht, curitem);
+            }
+            curitem = HTLOAD(curitem->hnext);
+        }
+
+MISSED:
+        /* a miss is trusted only if no chain was relinked meanwhile */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) == seq) {
+            if (vsize)
+                *vsize = 0;
+            return NULL;
         }
-        curitem = curitem->hnext;
     }
-    return NULL;
 }
 
 
@@ -295,7 +864,7 @@ int cdb_ht_del2(CDBHASHTABLE *ht, const void *key, int ksize)
     CDBHTITEM *res = NULL;
     res = cdb_ht_del(ht, key, ksize);
     if (res) {
-        free(res);
+        cdb_ht_freeitem(ht, res);
         return 0;
     }
     return -1;
@@ -312,8 +881,24 @@ CDBHTITEM *cdb_ht_del(CDBHASHTABLE *ht, const void *key, int ksize)
     hash = ht->hash(key, ksize);
     bid = hash & ((1<<CDBHTBNUMPOW)-1);
     bucket = &(ht->buckets[bid]);
-    hid = (hash >> CDBHTBNUMPOW) & (bucket->bnum - 1);
 
+    if (ht->oa) {
+        uint32_t slot;
+        _cdb_ht_oastep(ht, bucket);
+        res = _cdb_ht_oalookup(ht, bucket, hash, key, ksize, NULL, &slot);
+        if (res) {
+            if (ht->lru)
+                _cdb_ht_lruunlink(ht, res);
+            _cdb_ht_oaremove(bucket, slot);
+            HTSIZESET(ht, ht->size - cdb_ht_itemsize(ht, res));
+            HTNUMSET(ht, ht->num - 1);
+            bucket->rnum--;
+            _cdb_ht_oashrink(ht, bucket);
+        }
+        return res;
+    }
+
+    hid = (hash >> CDBHTBNUMPOW) & (bucket->bnum - 1);
     curitem = bucket->items[hid];
     preitem = NULL;
     while(curitem != NULL) {
@@ -321,23 +906,16 @@ CDBHTITEM *cdb_ht_del(CDBHASHTABLE *ht, const void *key, int ksize)
             && curitem->ksize == ksize
             && memcmp(cdb_ht_itemkey(ht, curitem),
             key, ksize) == 0) {
-            if (ht->lru) {
-                if (LRUPREV(curitem))
-                    LRUNEXT(LRUPREV(curitem)) = LRUNEXT(curitem);
-                if (LRUNEXT(curitem))
-                    LRUPREV(LRUNEXT(curitem)) = LRUPREV(curitem);
-                if (ht->head == curitem)
-                    ht->head = LRUNEXT(curitem);
-                if (ht->tail == curitem) 
-                    ht->tail = LRUPREV(curitem);
-            }
+            if (ht->lru)
+                _cdb_ht_lruunlink(ht, curitem);
+            _cdb_ht_wbegin(ht, bucket);
             if (preitem)
-                preitem->hnext = curitem->hnext;
+                HTSTORE(preitem->hnext, curitem->hnext);
             else
-                bucket->items[hid] = curitem->hnext;
-            ht->size -= sizeof(CDBHTITEM) + curitem->ksize + curitem->vsize
-                + (ht->lru > 0) * sizeof(CDBHTITEM*) * 2;
-            ht->num--;
+                HTSTORE(bucket->items[hid], curitem->hnext);
+            _cdb_ht_wend(ht, bucket);
+            HTSIZESET(ht, ht->size - cdb_ht_itemsize(ht, curitem));
+            HTNUMSET(ht, ht->num - 1);
             bucket->rnum--;
             res = curitem;
             curitem = curitem->hnext;
@@ -357,28 +935,80 @@ void cdb_ht_removetail(CDBHASHTABLE *ht)
 
     item = cdb_ht_poptail(ht);
     if (item)
-        free(item);
+        cdb_ht_freeitem(ht, item);
     return;
 }
 
 
 CDBHTITEM *cdb_ht_gettail(CDBHASHTABLE *ht)
 {
+    if (ht->clock)
+        return _cdb_ht_clockhand(ht);
+    _cdb_ht_secondchance(ht);
     return ht->tail;
 }
 
 
+CDBHTITEM *cdb_ht_getprev(CDBHASHTABLE *ht, CDBHTITEM *cur)
+{
+    if (!ht->lru || cur == NULL)
+        return NULL;
+    return LRUPREV(cur);
+}
+
+
 CDBHTITEM *cdb_ht_poptail(CDBHASHTABLE *ht)
 {
-    CDBHTITEM *item = ht->tail, *curitem, *preitem;;
+    CDBHTITEM *item, *curitem, *preitem;
     CDBHTBUCKET *bucket;
     uint32_t bid, hid;
 
-    if (!(ht->lru) || item == NULL)
+    if (ht->clock) {
+        item = _cdb_ht_clockhand(ht);
+        if (item == NULL)
+            return NULL;
+        bucket = &(ht->buckets[ht->handbid]);
+        if (ht->oa) {
+            /* the hand stops at the slot */
+            _cdb_ht_oaremove(bucket, ht->handhid);
+            bucket->rnum--;
+            HTNUMSET(ht, ht->num - 1);
+            HTSIZESET(ht, ht->size - cdb_ht_itemsize(ht, item));
+            _cdb_ht_oashrink(ht, bucket);
+            return item;
+        }
+        /* the hand stops at the chain, unlink the item from it */
+        _cdb_ht_wbegin(ht, bucket);
+        if (bucket->items[ht->handhid] == item)
+            HTSTORE(bucket->items[ht->handhid], item->hnext);
+        else {
+            for(preitem = bucket->items[ht->handhid]; preitem->hnext != item; )
+                preitem = preitem->hnext;
+            HTSTORE(preitem->hnext, item->hnext);
+        }
+        _cdb_ht_wend(ht, bucket);
+        bucket->rnum--;
+        HTNUMSET(ht, ht->num - 1);
+        HTSIZESET(ht, ht->size - cdb_ht_itemsize(ht, item));
+        return item;
+    }
+
+    if (!(ht->lru))
+        return NULL;
+
+    _cdb_ht_secondchance(ht);
+    item = ht->tail;
+    if (item == NULL)
         return NULL;
 
     bid = item->hash & ((1<<CDBHTBNUMPOW)-1);
     bucket = &(ht->buckets[bid]);
+    if (ht->oa) {
+        uint32_t slot;
+        if (_cdb_ht_oalookup(ht, bucket, item->hash, NULL, 0, item, &slot))
+            _cdb_ht_oaremove(bucket, slot);
+        goto UNLINKED;
+    }
     hid = (item->hash >> CDBHTBNUMPOW) & (bucket->bnum - 1);
 
     curitem = bucket->items[hid];
@@ -388,55 +1018,95 @@ CDBHTITEM *cdb_ht_poptail(CDBHASHTABLE *ht)
             && curitem->ksize == item->ksize
             && memcmp(cdb_ht_itemkey(ht, curitem),
             cdb_ht_itemkey(ht, item), item->ksize) == 0) {
+                _cdb_ht_wbegin(ht, bucket);
                 if (preitem) {
-                    preitem->hnext = curitem->hnext;
+                    HTSTORE(preitem->hnext, curitem->hnext);
                 } else {
-                    bucket->items[hid] = curitem->hnext;
+                    HTSTORE(bucket->items[hid], curitem->hnext);
                 }
+                _cdb_ht_wend(ht, bucket);
                 break;   
         }
         preitem = curitem;
         curitem = curitem->hnext;
     }
 
+UNLINKED:
     if (LRUPREV(item))
         LRUNEXT(LRUPREV(item)) = NULL;
     if (ht->head == item)
         ht->head = NULL;
     ht->tail = LRUPREV(item);
     bucket->rnum--;
-    ht->num--;
-    ht->size -= sizeof(CDBHTITEM) + item->ksize + item->vsize
-        + sizeof(CDBHTITEM*) * 2;
+    HTNUMSET(ht, ht->num - 1);
+    HTSIZESET(ht, ht->size - cdb_ht_itemsize(ht, item));
+    if (ht->oa)
+        _cdb_ht_oashrink(ht, bucket);
     return item;
 }
 
 void cdb_ht_clean(CDBHASHTABLE *ht)
 {
+    /* nobody else may hold the items, release slab pages in bulk */
+    bool bulk = ht->slab && ht->slab->ref == 1 && ht->epoch == NULL;
+
     for(uint32_t i = 0; i < (1<<CDBHTBNUMPOW); i++) {
         CDBHTBUCKET *bucket = &(ht->buckets[i]);
+        _cdb_ht_wbegin(ht, bucket);
         for(uint32_t j = 0; j < bucket->bnum; j++) {
-            CDBHTITEM *curitem = bucket->items[j];
+            CDBHTITEM *curitem = _cdb_ht_slot(ht, bucket, j);
+            if (ht->oa) {
+                uint32_t slot = j;
+                CDBHTOATABLE *t = _cdb_ht_oaat(bucket, &slot);
+                _cdb_ht_oasetctrl(t, slot, CDBHTOAEMPTY);
+                HTSTORE(t->slots[slot], NULL);
+            } else
+                HTSTORE(bucket->items[j], NULL);
             while(curitem != NULL) {
                 CDBHTITEM *tmp = curitem->hnext;
-                free(curitem);
+                HTSIZESET(ht, ht->size - cdb_ht_itemsize(ht, curitem));
+                if (!bulk)
+                    cdb_ht_freeitem(ht, curitem);
+                else if (_cdb_ht_rawsize(ht, curitem) > CDBSLABMAXOBJ)
+                    free(curitem);
                 curitem = tmp;
             }
-            bucket->items[j] = NULL;
         }
+        if (bucket->oldoat) {
+            CDBHTOATABLE *ot = bucket->oldoat;
+            HTSTORE(bucket->oldoat, NULL);
+            bucket->bnum = bucket->oat->mask + 1;
+            HTSIZESET(ht, ht->size - OATABLESIZE(ot->mask + 1));
+            if (ht->epoch)
+                cdb_epoch_retire(ht->epoch, ot, NULL, NULL);
+            else
+                free(ot);
+        }
+        if (bucket->oat)
+            bucket->oat->tomb = 0;
+        _cdb_ht_wend(ht, bucket);
         bucket->rnum = 0;
     }
-    ht->num = 0;
+    if (bulk)
+        cdb_slab_reset(ht->slab);
+    HTNUMSET(ht, 0);
+    ht->head = ht->tail = NULL;
 }
 
 
 void cdb_ht_destroy(CDBHASHTABLE *ht)
 {
+    /* retired items may belong to the slab, free them while it is alive */
+    if (ht->epoch)
+        cdb_epoch_drain(ht->epoch);
+
+    /* items in slab are released in bulk with it, only large ones are freed one by one */
     if (ht->lru) {
         CDBHTITEM *curitem = ht->head;
         while(curitem) {
             CDBHTITEM *nextitem = LRUNEXT(curitem);
-            free(curitem);
+            if (!ht->slab || _cdb_ht_rawsize(ht, curitem) > CDBSLABMAXOBJ)
+                free(curitem);
             curitem = nextitem;
         }
     }
@@ -445,15 +1115,20 @@ void cdb_ht_destroy(CDBHASHTABLE *ht)
         CDBHTBUCKET *bucket = &(ht->buckets[i]);
 
         for(uint32_t j = 0; j < bucket->bnum && (!ht->lru); j++) {
-            CDBHTITEM *curitem = bucket->items[j];
+            CDBHTITEM *curitem = _cdb_ht_slot(ht, bucket, j);
             while(curitem != NULL) {
                 CDBHTITEM *tmp = curitem->hnext;
-                free(curitem);
+                if (!ht->slab || _cdb_ht_rawsize(ht, curitem) > CDBSLABMAXOBJ)
+                    free(curitem);
                 curitem = tmp;
             }
         }
         free(bucket->items);
+        free(bucket->oat);
+        free(bucket->oldoat);
     }
+    if (ht->slab)
+        cdb_slab_release(ht->slab);
     free(ht);
 }
 
@@ -465,8 +1140,8 @@ CDBHTITEM *cdb_ht_iterbegin(CDBHASHTABLE *ht)
         if (!bucket->rnum)
             continue;
         for(uint32_t j = 0; j < bucket->bnum; j++)
-            if (bucket->items[j])
-                return bucket->items[j];
+            if (_cdb_ht_slot(ht, bucket, j))
+                return _cdb_ht_slot(ht, bucket, j);
     }
 
     return NULL;
@@ -485,9 +1160,13 @@ CDBHTITEM *cdb_ht_iternext(CDBHASHTABLE *ht, CDBHTITEM *cur)
     CDBHTBUCKET *bucket = &(ht->buckets[bid]);
     uint32_t hid = (cur->hash >> CDBHTBNUMPOW) & (bucket->bnum - 1);
 
+    /* in open addressing mode, the slot of an item is found by probing */
+    if (ht->oa)
+        _cdb_ht_oalookup(ht, bucket, cur->hash, NULL, 0, cur, &hid);
+
     for(uint32_t i = hid + 1; i < bucket->bnum; i++) {
-        if (bucket->items[i])
-            return bucket->items[i];
+        if (_cdb_ht_slot(ht, bucket, i))
+            return _cdb_ht_slot(ht, bucket, i);
     }
 
     for(uint32_t i = bid + 1; i < (1<<CDBHTBNUMPOW); i++) {
@@ -495,8 +1174,8 @@ CDBHTITEM *cdb_ht_iternext(CDBHASHTABLE *ht, CDBHTITEM *cur)
         if (!bucket->rnum)
             continue;
         for(int j = 0; j < bucket->bnum; j++)
-            if (bucket->items[j])
-                return bucket->items[j];
+            if (_cdb_ht_slot(ht, bucket, j))
+                return _cdb_ht_slot(ht, bucket, j);
     }
 
     return NULL;
@@ -531,9 +1210,9 @@ int main(int argc, char *argv[])
     CDBHTITEM *item;
     item = cdb_ht_poptail(ht);
     printf("tail:  %ld - %ld\n", *(long*)cdb_ht_itemkey(ht, item), *(long*)cdb_ht_itemval(ht, item));
-    free(item);
+    cdb_ht_freeitem(ht, item);
     item = cdb_ht_poptail(ht);
     printf("tail:  %ld - %ld\n", *(long*)cdb_ht_itemkey(ht, item), *(long*)cdb_ht_itemval(ht, item));
-    free(item);
+    cdb_ht_freeitem(ht, item);
 }
 #endif
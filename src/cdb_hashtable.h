@@ -18,6 +18,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include "cdb_epoch.h"
+#include "cdb_slab.h"
 
 #if defined(__cplusplus)
 extern "C" {
@@ -28,33 +30,80 @@ typedef uint32_t (*CDBHASHFUNC)(const void *, int);
 /* default 1<<8 level-1 buckets, which makes the table expanding more smoothly */
 #define CDBHTBNUMPOW 8
 
+/* eviction mode of a table, plain/LRU are compatible with the old false/true */
+enum {
+    /* no eviction order */
+    CDB_HTPLAIN = 0,
+    /* doubly-linked LRU list, two extra pointers per item */
+    CDB_HTLRU = 1,
+    /* CLOCK(second chance): a reference bit per item and a hand sweeping the buckets */
+    CDB_HTCLOCK = 2,
+    /* flag combined with one of above, level-1 buckets are open addressing tables */
+    CDB_HTOPENADDR = 0x10,
+};
+
+/* slots are probed by groups of control bytes */
+#define CDBHTOAGROUP 16
+/* control byte of a slot, or the 7 high bits of hash if it's taken */
+#define CDBHTOAEMPTY 0x80
+#define CDBHTOADELETED 0xfe
+
 
 typedef struct CDBHTITEM
 {
+    /* next element with the same hash, placed first to keep it aligned for lock-free readers */
+    struct CDBHTITEM *hnext;
     int ksize;
     int vsize;
     uint32_t hash;
-    /* next element with the same hash */
-    struct CDBHTITEM *hnext;
+    /* referenced since the LRU tail or CLOCK hand passed it last time */
+    uint8_t ref;
     /* if LRU is true, the first several bytes are two pointers of prev/next element */
     struct CDBHTITEM *lruptr[0];
     char buf[0];
 } __attribute__((packed)) CDBHTITEM;
 
 
+/* an open addressing table in Swiss-table style, replaced as a whole when it grows */
+typedef struct {
+    /* number of slots - 1, the number is a power of 2 no less than CDBHTOAGROUP */
+    uint32_t mask;
+    /* number of deleted slots */
+    uint32_t tomb;
+    CDBHTITEM **slots;
+    /* a control byte per slot, followed by a copy of the first group */
+    uint8_t ctrl[0];
+} CDBHTOATABLE;
+
+
 typedef struct {
     /* array for items */
     CDBHTITEM **items;
+    /* table in open addressing mode, created on first insertion */
+    CDBHTOATABLE *oat;
+    /* while growing, the table being moved to 'oat' a few slots per write, 
+     and the next slot to move. Slot numbers of the old table go first */
+    CDBHTOATABLE *oldoat;
+    uint32_t oldpos;
     /* number of allocated slots in the bucket */
     uint32_t bnum;
     /* number of items exist in the bucket */
     uint32_t rnum;
+    /* sequence number, odd while chains are being relinked, for lock-free readers */
+    uint32_t seq;
 } CDBHTBUCKET;
 
 
 typedef struct CDBHASHTABLE {
     /* is in LRU mode? */
     bool lru;
+    /* is in CLOCK mode? */
+    bool clock;
+    /* are buckets open addressing tables? */
+    bool oa;
+    /* in CLOCK mode, the hand points to a level-1 bucket and a slot in it */
+    uint32_t handbid;
+    uint32_t handhid;
     /* user specified hash function */
     CDBHASHFUNC hash;
     /* fixed number for level-1 buckets */
@@ -67,9 +116,17 @@ typedef struct CDBHASHTABLE {
     CDBHTITEM *head;
     /* in LRU mode, the oldest item */
     CDBHTITEM *tail;
+    /* if not NULL, lock-free readers are allowed, removed memory is retired here */
+    CDBEPOCH *epoch;
+    /* if not NULL, small items are allocated from it instead of malloc() */
+    CDBSLAB *slab;
 } CDBHASHTABLE;
 
 
+/* memory usage and number of items of the table, they can be read without the writers' lock */
+#define cdb_ht_size(ht) __atomic_load_n(&(ht)->size, __ATOMIC_RELAXED)
+#define cdb_ht_num(ht) __atomic_load_n(&(ht)->num, __ATOMIC_RELAXED)
+
 /* get the pointer of key in current item */
 /* #define cdb_ht_itemkey(ht, item) (item->buf + ht->lru * 2 * sizeof(void*)) */
 void *cdb_ht_itemkey(CDBHASHTABLE *ht, CDBHTITEM *item);
@@ -78,10 +135,33 @@ void *cdb_ht_itemkey(CDBHASHTABLE *ht, CDBHTITEM *item);
 /* #define cdb_ht_itemval(ht, item) (item->buf + ht->lru * 2 * sizeof(void*) + item->ksize) */
 void *cdb_ht_itemval(CDBHASHTABLE *ht, CDBHTITEM *item);
 
-/* create an hashtable, it can be a simple hashtable or with LeastRecentUse
-   The LRU mode needs extra two pointer space for every element
+/* memory taken by an item, including its header and the allocator's overhead */
+uint32_t cdb_ht_itemsize(CDBHASHTABLE *ht, CDBHTITEM *item);
+
+/* create an hashtable, it can be a simple hashtable or with LeastRecentUse/CLOCK eviction
+   The LRU mode needs extra two pointer space for every element, 
+   the CLOCK mode only sets a flag on hit, the 'tail' is where the clock hand stops.
+   With CDB_HTOPENADDR, a lookup probes 16 control bytes at a time instead of chasing chains.
    hash function can by specified by user */
-CDBHASHTABLE *cdb_ht_new(bool lru, CDBHASHFUNC hashfunc);
+CDBHASHTABLE *cdb_ht_new(int mode, CDBHASHFUNC hashfunc);
+
+/* allow cdb_ht_rdget on the table, items and slots removed later are freed via 'ep' */
+void cdb_ht_setepoch(CDBHASHTABLE *ht, CDBEPOCH *ep);
+
+/* allocate items from 'slab', the table must be empty. Tables which move items between
+   each other must share the same slab. A reference is held until the table is destroyed */
+void cdb_ht_setslab(CDBHASHTABLE *ht, CDBSLAB *slab);
+
+/* get the value of an item and its size without lock, caller must be inside an epoch critical
+   section and writers still lock each other out. Instead of moving to front, the item is marked
+   referenced if mark == true, and it gets a second chance when it comes to the LRU tail */
+void *cdb_ht_rdget(CDBHASHTABLE *ht, const void *key, int ksize, int *vsize, bool mark);
+
+/* free an item returned by cdb_ht_del/cdb_ht_poptail, deferred if lock-free readers allowed */
+void cdb_ht_freeitem(CDBHASHTABLE *ht, CDBHTITEM *item);
+
+/* free an item from cdb_ht_newitem which has never been inserted, immediately */
+void cdb_ht_dropitem(CDBHASHTABLE *ht, CDBHTITEM *item);
 
 /* clean and free the hastable */
 void cdb_ht_destroy(CDBHASHTABLE *ht);
@@ -95,7 +175,8 @@ void cdb_ht_insert(CDBHASHTABLE *ht, CDBHTITEM *item);
 /* allocate and insert an item into table by key and value, return the pointer of value in table */
 void *cdb_ht_insert2(CDBHASHTABLE *ht, const void *key, int ksize, const void *val, int vsize);
 
-/* get the value of an item and its size in table, move the item to front if mtf == true */
+/* get the value of an item and its size in table, move the item to front(LRU)
+   or mark it referenced(CLOCK) if mtf == true */
 void *cdb_ht_get(CDBHASHTABLE *ht, const void *key, int ksize, int *vsize, bool mtf);
 
 /* get the value of an item, assume the size is known, move the item to front if mtf == true */
@@ -122,6 +203,10 @@ CDBHTITEM *cdb_ht_gettail(CDBHASHTABLE *ht);
 /* return last item in table, delete but should be freed by user */
 CDBHTITEM *cdb_ht_poptail(CDBHASHTABLE *ht);
 
+/* in LRU mode, return the item newer than 'cur' next to it, NULL if 'cur' is the head.
+   Walking from the tail with it visits items from the oldest, do not delete nor free */
+CDBHTITEM *cdb_ht_getprev(CDBHASHTABLE *ht, CDBHTITEM *cur);
+
 /* clean and free all elements in the table*/
 void cdb_ht_clean(CDBHASHTABLE *ht);
 
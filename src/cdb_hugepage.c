@@ -0,0 +1,86 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+
+#include "cdb_hugepage.h"
+#include "cuttdb.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define HPROUND(s) (((s) + CDBHUGEPAGESIZE - 1) & ~(uint64_t)(CDBHUGEPAGESIZE - 1))
+
+static void *_cdb_hp_aligned(uint64_t size);
+
+
+/* map 'size' bytes aligned at huge page boundary, by mapping more and trimming the edges */
+static void *_cdb_hp_aligned(uint64_t size)
+{
+    char *raw, *ptr;
+    uint64_t head;
+
+    raw = (char *)mmap(NULL, size + CDBHUGEPAGESIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+
+    ptr = (char *)HPROUND((uintptr_t)raw);
+    head = ptr - raw;
+    if (head)
+        munmap(raw, head);
+    if (CDBHUGEPAGESIZE - head)
+        munmap(ptr + size, CDBHUGEPAGESIZE - head);
+    return ptr;
+}
+
+
+void *cdb_hp_alloc(uint64_t size, int mode, bool *huge)
+{
+    void *ptr;
+
+    /* the mapped length is always rounded, cdb_hp_free() doesn't know the mode */
+    size = HPROUND(size);
+    *huge = false;
+
+#ifdef MAP_HUGETLB
+    if (mode == CDB_HUGEPAGETLB) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            *huge = true;
+            return ptr;
+        }
+    }
+#endif
+
+    if (mode == CDB_HUGEPAGEOFF) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return ptr == MAP_FAILED? NULL: ptr;
+    }
+
+    ptr = _cdb_hp_aligned(size);
+#ifdef MADV_HUGEPAGE
+    /* it's only an advice, fails if the kernel doesn't support THP */
+    if (ptr && madvise(ptr, size, MADV_HUGEPAGE) == 0)
+        *huge = true;
+#endif
+    return ptr;
+}
+
+
+void cdb_hp_free(void *ptr, uint64_t size)
+{
+    if (ptr)
+        munmap(ptr, HPROUND(size));
+}
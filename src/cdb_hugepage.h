@@ -0,0 +1,37 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+
+/*
+Large arrays which are accessed randomly (main table, bloom filter, cache slabs)
+are mapped in 2MB aligned regions, so that the kernel may back them by huge pages
+and a lookup takes fewer TLB misses.
+*/
+#ifndef _CDB_HUGEPAGE_H_
+#define _CDB_HUGEPAGE_H_
+#include <stdint.h>
+#include <stdbool.h>
+
+/* size and alignment of a huge page */
+#define CDBHUGEPAGESIZE (2 * 1024 * 1024)
+
+/* allocate a zeroed region of 'size' bytes, 'mode' is one of CDB_HUGEPAGE*.
+ 'huge' is set if the region is mapped/advised with huge pages, return NULL on failure.
+ CDB_HUGEPAGETLB falls back to transparent huge pages if no reserved page is left */
+void *cdb_hp_alloc(uint64_t size, int mode, bool *huge);
+/* release a region, 'size' should be the same as allocated */
+void cdb_hp_free(void *ptr, uint64_t size);
+
+#endif
@@ -13,34 +13,195 @@
  */
 
 
+/* for pthread_rwlockattr_setkind_np */
+#define _GNU_SOURCE
 #include "cdb_lock.h"
 #include <stdlib.h>
 #include <pthread.h>
 #include <sched.h>
+#include <time.h>
+#include <stdbool.h>
+#include <errno.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/* lock word of an adaptive lock: free, held, held and someone may sleep on it */
+enum {
+    ADAPTFREE = 0,
+    ADAPTLOCKED = 1,
+    ADAPTWAITED = 2,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPURELAX() __builtin_ia32_pause()
+#else
+#define CPURELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static CDBLOCK *_cdb_lock_alloc(size_t size);
+static uint64_t _cdb_lock_nsec();
+static void _cdb_lock_futexwait(int *word, int val);
+static void _cdb_lock_futexwake(int *word);
+static int _cdb_lock_adapttry(int *word);
+static void _cdb_lock_adaptlock(int *word);
+static void _cdb_lock_adaptunlock(int *word);
+
+
+/* every lock takes whole cache lines, striped locks won't share one */
+static CDBLOCK *_cdb_lock_alloc(size_t size)
+{
+    void *ptr = NULL;
+    size = (size + CDBLOCKALIGN - 1) / CDBLOCKALIGN * CDBLOCKALIGN;
+    if (posix_memalign(&ptr, CDBLOCKALIGN, size))
+        return NULL;
+    return (CDBLOCK *)ptr;
+}
+
+
+static uint64_t _cdb_lock_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* sleep while '*word' equals 'val', other systems just yield the cpu */
+static void _cdb_lock_futexwait(int *word, int val)
+{
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    (void)word;
+    (void)val;
+    sched_yield();
+#endif
+}
+
+
+static void _cdb_lock_futexwake(int *word)
+{
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    (void)word;
+#endif
+}
+
+
+static int _cdb_lock_adapttry(int *word)
+{
+    int c = ADAPTFREE;
+    if (__atomic_compare_exchange_n(word, &c, ADAPTLOCKED, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    return EBUSY;
+}
+
+
+/* spin while the holder is likely running, then mark the lock as waited and sleep */
+static void _cdb_lock_adaptlock(int *word)
+{
+    int c;
+
+    for(int i = 0; i < CDBLOCKSPINNUM; i++) {
+        c = __atomic_load_n(word, __ATOMIC_RELAXED);
+        if (c == ADAPTFREE && _cdb_lock_adapttry(word) == 0)
+            return;
+        /* others are sleeping already, no need to spin */
+        if (c == ADAPTWAITED)
+            break;
+        CPURELAX();
+    }
+
+    /* whoever gets the lock this way must wake others at unlock */
+    while((c = __atomic_exchange_n(word, ADAPTWAITED, __ATOMIC_ACQUIRE)) != ADAPTFREE)
+        _cdb_lock_futexwait(word, ADAPTWAITED);
+}
+
+
+static void _cdb_lock_adaptunlock(int *word)
+{
+    if (__atomic_exchange_n(word, ADAPTFREE, __ATOMIC_RELEASE) == ADAPTWAITED)
+        _cdb_lock_futexwake(word);
+}
 
 
 CDBLOCK *cdb_lock_new(int ltype)
 {
     CDBLOCK *lock = NULL;
     if (ltype == CDB_LOCKSPIN) {
-        lock = (CDBLOCK *)malloc(sizeof(CDBLOCK) + sizeof(pthread_spinlock_t));
+        lock = _cdb_lock_alloc(sizeof(CDBLOCK) + sizeof(pthread_spinlock_t));
         pthread_spin_init((pthread_spinlock_t*)&lock->lock, PTHREAD_PROCESS_PRIVATE);
     } else if (ltype == CDB_LOCKMUTEX) {
-        lock = (CDBLOCK *)malloc(sizeof(CDBLOCK) + sizeof(pthread_mutex_t));
+        lock = _cdb_lock_alloc(sizeof(CDBLOCK) + sizeof(pthread_mutex_t));
         pthread_mutex_init((pthread_mutex_t*)&lock->lock, NULL);
+    } else if (ltype == CDB_LOCKADAPT) {
+        lock = _cdb_lock_alloc(sizeof(CDBLOCK) + sizeof(int));
+        *(int *)&lock->lock = ADAPTFREE;
+    } else if (ltype == CDB_LOCKRW) {
+        pthread_rwlockattr_t attr;
+        lock = _cdb_lock_alloc(sizeof(CDBLOCK) + sizeof(pthread_rwlock_t));
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        /* readers come much more often, don't let them starve a writer */
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init((pthread_rwlock_t*)&lock->lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
     }
     lock->ltype = ltype;
+    cdb_lock_resetstat(lock);
 
     return lock;
 }
 
 
+/* a try goes first, only a contended acquisition pays for reading the clock */
 void cdb_lock_lock(CDBLOCK *lock)
 {
+    uint64_t begin;
+
+    if (cdb_lock_trylock(lock) == 0)
+        return;
+
+    begin = _cdb_lock_nsec();
     if (lock->ltype == CDB_LOCKSPIN)
         pthread_spin_lock((pthread_spinlock_t*)&lock->lock);
     else if (lock->ltype == CDB_LOCKMUTEX)
         pthread_mutex_lock((pthread_mutex_t*)&lock->lock);
+    else if (lock->ltype == CDB_LOCKADAPT)
+        _cdb_lock_adaptlock((int *)&lock->lock);
+    else if (lock->ltype == CDB_LOCKRW)
+        pthread_rwlock_wrlock((pthread_rwlock_t*)&lock->lock);
+    lock->acquire++;
+    lock->contended++;
+    lock->waitns += _cdb_lock_nsec() - begin;
+}
+
+
+void cdb_lock_rdlock(CDBLOCK *lock)
+{
+    uint64_t begin;
+
+    if (lock->ltype != CDB_LOCKRW) {
+        cdb_lock_lock(lock);
+        return;
+    }
+
+    if (pthread_rwlock_tryrdlock((pthread_rwlock_t*)&lock->lock) == 0) {
+        __atomic_fetch_add(&lock->acquire, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    begin = _cdb_lock_nsec();
+    pthread_rwlock_rdlock((pthread_rwlock_t*)&lock->lock);
+    __atomic_fetch_add(&lock->acquire, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lock->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&lock->waitns, _cdb_lock_nsec() - begin, __ATOMIC_RELAXED);
 }
 
 
@@ -50,6 +211,10 @@ void cdb_lock_unlock(CDBLOCK *lock)
         pthread_spin_unlock((pthread_spinlock_t*)&lock->lock);
     else if (lock->ltype == CDB_LOCKMUTEX)
         pthread_mutex_unlock((pthread_mutex_t*)&lock->lock);
+    else if (lock->ltype == CDB_LOCKADAPT)
+        _cdb_lock_adaptunlock((int *)&lock->lock);
+    else if (lock->ltype == CDB_LOCKRW)
+        pthread_rwlock_unlock((pthread_rwlock_t*)&lock->lock);
 }
 
 
@@ -59,6 +224,8 @@ void cdb_lock_destory(CDBLOCK *lock)
         pthread_spin_destroy((pthread_spinlock_t*)&lock->lock);
     else if (lock->ltype == CDB_LOCKMUTEX)
         pthread_mutex_destroy((pthread_mutex_t*)&lock->lock);
+    else if (lock->ltype == CDB_LOCKRW)
+        pthread_rwlock_destroy((pthread_rwlock_t*)&lock->lock);
 
     free(lock);
 }
@@ -66,10 +233,23 @@ void cdb_lock_destory(CDBLOCK *lock)
 
 int cdb_lock_trylock(CDBLOCK *lock)
 {
+    int ret = 0;
+
     if (lock->ltype == CDB_LOCKSPIN)
-        return pthread_spin_trylock((pthread_spinlock_t*)&lock->lock);
+        ret = pthread_spin_trylock((pthread_spinlock_t*)&lock->lock);
     else if (lock->ltype == CDB_LOCKMUTEX)
-        return pthread_mutex_trylock((pthread_mutex_t*)&lock->lock);
-    return 0;
+        ret = pthread_mutex_trylock((pthread_mutex_t*)&lock->lock);
+    else if (lock->ltype == CDB_LOCKADAPT)
+        ret = _cdb_lock_adapttry((int *)&lock->lock);
+    else if (lock->ltype == CDB_LOCKRW)
+        ret = pthread_rwlock_trywrlock((pthread_rwlock_t*)&lock->lock);
+    if (ret == 0)
+        lock->acquire++;
+    return ret;
 }
 
+
+void cdb_lock_resetstat(CDBLOCK *lock)
+{
+    lock->acquire = lock->contended = lock->waitns = 0;
+}
@@ -15,6 +15,7 @@
 
 #ifndef _CDB_LOCK_H_
 #define _CDB_LOCK_H_
+#include <stdint.h>
 
 
 enum {
@@ -22,6 +23,11 @@ enum {
     CDB_LOCKSPIN,
     /* mutex, which may cause OS context switch, mainly used in where Disk IO happens */
     CDB_LOCKMUTEX,
+    /* spin for a while, then sleep on a futex, so a preempted holder doesn't make
+     others burn their timeslices. The default for most locks */
+    CDB_LOCKADAPT,
+    /* reader/writer lock, cdb_lock_lock takes it exclusively, cdb_lock_rdlock shares it */
+    CDB_LOCKRW,
 };
 
 /* may be used to indicated whether the area is protected */
@@ -30,18 +36,34 @@ enum {
     CDB_NOTLOCKED,
 };
 
+/* size of a cache line, locks are aligned to it */
+#define CDBLOCKALIGN 64
+/* times an adaptive lock checks the lock word before sleeping */
+#define CDBLOCKSPINNUM 128
+
 typedef struct CDBLOCK
 {
     int ltype;
+    /* statistics, updated by the holder, atomically if the lock is shared */
+    /* number of acquisitions */
+    uint64_t acquire;
+    /* acquisitions which didn't get the lock at first try */
+    uint64_t contended;
+    /* total time waited for the lock, in nanoseconds */
+    uint64_t waitns;
     char lock[0];
 } CDBLOCK;
 
 
 CDBLOCK *cdb_lock_new(int ltype);
 void cdb_lock_lock(CDBLOCK *lock);
+/* take a CDB_LOCKRW lock in shared mode, other types are taken exclusively */
+void cdb_lock_rdlock(CDBLOCK *lock);
 void cdb_lock_unlock(CDBLOCK *lock);
 void cdb_lock_destory(CDBLOCK *lock);
 int cdb_lock_trylock(CDBLOCK *lock);
+/* zero the statistics, may lose counts of a holder at the same time */
+void cdb_lock_resetstat(CDBLOCK *lock);
 
 
 
@@ -0,0 +1,168 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+
+#include "cdb_scratch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* header before every buffer, keeps the data 16 bytes aligned */
+typedef struct {
+    uint32_t size;
+    /* index in the thread's slots, -1 if it is not kept */
+    int32_t slot;
+    uint64_t pad;
+} CDBSCRATCHHEAD;
+
+typedef struct {
+    CDBSCRATCHHEAD *bufs[CDBSCRATCHNUM];
+    uint8_t inuse[CDBSCRATCHNUM];
+} CDBSCRATCHTLS;
+
+#define HEADOF(buf) ((CDBSCRATCHHEAD *)(buf) - 1)
+/* buffers are at least 4KB, rounded up to power of 2 */
+#define SCRATCHMIN 4096
+
+static pthread_once_t _cdb_scratch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _cdb_scratch_key;
+static __thread CDBSCRATCHTLS *_cdb_scratch_tls = NULL;
+
+static void _cdb_scratch_init();
+static void _cdb_scratch_exit(void *arg);
+static CDBSCRATCHTLS *_cdb_scratch_mine();
+static uint32_t _cdb_scratch_round(uint32_t size);
+
+
+static void _cdb_scratch_init()
+{
+    pthread_key_create(&_cdb_scratch_key, _cdb_scratch_exit);
+}
+
+
+/* free the kept buffers when a thread exits */
+static void _cdb_scratch_exit(void *arg)
+{
+    CDBSCRATCHTLS *tls = (CDBSCRATCHTLS *)arg;
+
+    for(int i = 0; i < CDBSCRATCHNUM; i++)
+        free(tls->bufs[i]);
+    free(tls);
+}
+
+
+static CDBSCRATCHTLS *_cdb_scratch_mine()
+{
+    if (_cdb_scratch_tls == NULL) {
+        pthread_once(&_cdb_scratch_once, _cdb_scratch_init);
+        _cdb_scratch_tls = (CDBSCRATCHTLS *)malloc(sizeof(CDBSCRATCHTLS));
+        memset(_cdb_scratch_tls, 0, sizeof(CDBSCRATCHTLS));
+        pthread_setspecific(_cdb_scratch_key, _cdb_scratch_tls);
+    }
+    return _cdb_scratch_tls;
+}
+
+
+static uint32_t _cdb_scratch_round(uint32_t size)
+{
+    if (size <= SCRATCHMIN)
+        return SCRATCHMIN;
+    if (size > (1U << 31))
+        return size;
+    return 1U << (32 - __builtin_clz(size - 1));
+}
+
+
+void *cdb_scratch_get(uint32_t size)
+{
+    CDBSCRATCHTLS *tls = _cdb_scratch_mine();
+    CDBSCRATCHHEAD *head;
+    int slot = -1;
+
+    /* a free one large enough, or else any free one */
+    for(int i = 0; i < CDBSCRATCHNUM; i++) {
+        if (tls->inuse[i])
+            continue;
+        if (tls->bufs[i] && tls->bufs[i]->size >= size) {
+            slot = i;
+            break;
+        }
+        if (slot < 0)
+            slot = i;
+    }
+
+    if (slot >= 0 && tls->bufs[slot] && tls->bufs[slot]->size >= size) {
+        head = tls->bufs[slot];
+    } else {
+        size = _cdb_scratch_round(size);
+        head = (CDBSCRATCHHEAD *)malloc(sizeof(CDBSCRATCHHEAD) + size);
+        if (head == NULL)
+            return NULL;
+        head->size = size;
+        head->slot = slot;
+        if (slot >= 0) {
+            free(tls->bufs[slot]);
+            tls->bufs[slot] = head;
+        }
+    }
+
+    if (slot >= 0)
+        tls->inuse[slot] = 1;
+    return head + 1;
+}
+
+
+uint32_t cdb_scratch_size(void *buf)
+{
+    return HEADOF(buf)->size;
+}
+
+
+void *cdb_scratch_grow(void *buf, uint32_t size)
+{
+    CDBSCRATCHHEAD *head = HEADOF(buf);
+
+    if (head->size >= size)
+        return buf;
+
+    size = _cdb_scratch_round(size);
+    head = (CDBSCRATCHHEAD *)realloc(head, sizeof(CDBSCRATCHHEAD) + size);
+    if (head == NULL)
+        return NULL;
+    head->size = size;
+    if (head->slot >= 0)
+        _cdb_scratch_mine()->bufs[head->slot] = head;
+    return head + 1;
+}
+
+
+void cdb_scratch_put(void *buf)
+{
+    CDBSCRATCHHEAD *head = HEADOF(buf);
+    CDBSCRATCHTLS *tls;
+
+    if (head->slot < 0) {
+        free(head);
+        return;
+    }
+
+    tls = _cdb_scratch_mine();
+    tls->inuse[head->slot] = 0;
+    /* don't keep a huge one for a rare large record */
+    if (head->size > CDBSCRATCHKEEP) {
+        tls->bufs[head->slot] = NULL;
+        free(head);
+    }
+}
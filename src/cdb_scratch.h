@@ -0,0 +1,41 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+
+/*
+Per-thread scratch buffers for reading records and pages, instead of large buffers
+in stack. A thread keeps a few of them, every one grows to the largest size it has
+served, so a buffer is allocated only if all kept ones are taken. They are freed 
+when the thread exits
+*/
+#ifndef _CDB_SCRATCH_H_
+#define _CDB_SCRATCH_H_
+#include <stdint.h>
+
+/* buffers kept by a thread, more than this at the same time are malloc()ed */
+#define CDBSCRATCHNUM 8
+/* a buffer grown larger than this is freed after use */
+#define CDBSCRATCHKEEP (4 * 1024 * 1024)
+
+/* get a buffer of 'size' bytes at least, used by current thread until put back */
+void *cdb_scratch_get(uint32_t size);
+/* usable size of a buffer */
+uint32_t cdb_scratch_size(void *buf);
+/* enlarge a buffer to 'size' bytes at least, the content is kept. Returns its new address */
+void *cdb_scratch_grow(void *buf, uint32_t size);
+/* give the buffer back, it must be called in the same thread as cdb_scratch_get */
+void cdb_scratch_put(void *buf);
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *   
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license. 
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+#include "cdb_sketch.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* the sketch is updated by lock-free readers, a lost increment doesn't matter */
+#define SKLOAD(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define SKSTORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELAXED)
+
+struct CDBSKETCH
+{
+    /* CDBSKETCHDEPTH rows of 'width' counters */
+    uint8_t *counters;
+    /* width - 1, width is a power of 2 */
+    uint64_t mask;
+    /* additions since last aging */
+    uint64_t adds;
+    /* age the counters when 'adds' reaches it */
+    uint64_t maxadds;
+};
+
+
+static uint64_t _cdb_sketch_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+/* position of the key's counter in row i */
+static uint64_t _cdb_sketch_pos(CDBSKETCH *sk, uint64_t h, int i)
+{
+    uint64_t h2 = (h >> 32) | 1;
+    return (uint64_t)i * (sk->mask + 1) + ((h + i * h2) & sk->mask);
+}
+
+
+/* halve all counters, so the sketch forgets old history */
+static void _cdb_sketch_age(CDBSKETCH *sk)
+{
+    uint64_t total = (sk->mask + 1) * CDBSKETCHDEPTH;
+    for(uint64_t i = 0; i < total; i++)
+        SKSTORE(sk->counters[i], SKLOAD(sk->counters[i]) >> 1);
+}
+
+
+CDBSKETCH *cdb_sketch_new(uint64_t width)
+{
+    CDBSKETCH *sk = (CDBSKETCH *)malloc(sizeof(CDBSKETCH));
+    uint64_t w = 1024;
+
+    while(w < width && w < (1ULL << 26))
+        w <<= 1;
+
+    sk->mask = w - 1;
+    sk->adds = 0;
+    sk->maxadds = w * CDBSKETCHAGING;
+    sk->counters = (uint8_t *)malloc(w * CDBSKETCHDEPTH);
+    memset(sk->counters, 0, w * CDBSKETCHDEPTH);
+    return sk;
+}
+
+
+void cdb_sketch_add(CDBSKETCH *sk, uint64_t hash)
+{
+    uint64_t h = _cdb_sketch_mix(hash);
+
+    for(int i = 0; i < CDBSKETCHDEPTH; i++) {
+        uint8_t *c = &sk->counters[_cdb_sketch_pos(sk, h, i)];
+        uint8_t v = SKLOAD(*c);
+        if (v < CDBSKETCHMAXCNT)
+            SKSTORE(*c, v + 1);
+    }
+
+    /* only the thread reaching the limit does the aging */
+    if (__atomic_add_fetch(&sk->adds, 1, __ATOMIC_RELAXED) == sk->maxadds) {
+        _cdb_sketch_age(sk);
+        __atomic_store_n(&sk->adds, 0, __ATOMIC_RELAXED);
+    }
+}
+
+
+uint32_t cdb_sketch_estimate(CDBSKETCH *sk, uint64_t hash)
+{
+    uint64_t h = _cdb_sketch_mix(hash);
+    uint32_t est = CDBSKETCHMAXCNT;
+
+    for(int i = 0; i < CDBSKETCHDEPTH; i++) {
+        uint8_t v = SKLOAD(sk->counters[_cdb_sketch_pos(sk, h, i)]);
+        if (v < est)
+            est = v;
+    }
+    return est;
+}
+
+
+void cdb_sketch_destroy(CDBSKETCH *sk)
+{
+    free(sk->counters);
+    free(sk);
+}
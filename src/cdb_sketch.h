@@ -0,0 +1,41 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *   
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license. 
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+/*
+Count-Min sketch estimating how often a key was accessed recently, 
+used as the TinyLFU admission filter in front of the caches
+*/
+#ifndef _CDB_SKETCH_H_
+#define _CDB_SKETCH_H_
+#include <stdint.h>
+
+typedef struct CDBSKETCH CDBSKETCH;
+
+/* number of counters touched by a key */
+#define CDBSKETCHDEPTH 4
+/* counters saturate here, old history needn't be precise */
+#define CDBSKETCHMAXCNT 15
+/* all counters are halved after so many additions per counter in a row */
+#define CDBSKETCHAGING 10
+
+/* 'width' is the expected number of distinct hot keys */
+CDBSKETCH *cdb_sketch_new(uint64_t width);
+/* record an access to the key with 64-bit hash */
+void cdb_sketch_add(CDBSKETCH *sk, uint64_t hash);
+/* get estimated access count of the key */
+uint32_t cdb_sketch_estimate(CDBSKETCH *sk, uint64_t hash);
+void cdb_sketch_destroy(CDBSKETCH *sk);
+
+#endif
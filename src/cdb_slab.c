@@ -0,0 +1,373 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+#include "cdb_slab.h"
+#include "cdb_hugepage.h"
+#include "cuttdb.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* header at the beginning of every page, objects follow it */
+struct CDBSLABPAGE
+{
+    /* in partial list of its class */
+    CDBSLABPAGE *prev, *next;
+    /* in list of all pages */
+    CDBSLABPAGE *aprev, *anext;
+    /* freed objects */
+    void *freelist;
+    /* chunk it is carved from, NULL if allocated alone */
+    CDBSLABCHUNK *chunk;
+    uint32_t cls;
+    /* objects in use */
+    uint32_t used;
+    /* objects never used are carved from the page lazily */
+    uint32_t carved;
+    uint32_t inpartial;
+};
+
+/* a huge page region split into slab pages */
+struct CDBSLABCHUNK
+{
+    CDBSLABCHUNK *prev, *next;
+    char *base;
+    /* pages ever carved from it */
+    uint32_t carved;
+    /* pages in use */
+    uint32_t used;
+    bool huge;
+};
+
+/* keep objects 16 bytes aligned */
+#define PAGEHSIZE 64
+#define PAGEOF(ptr) ((CDBSLABPAGE *)((uintptr_t)(ptr) & ~(uintptr_t)(CDBSLABPAGESIZE - 1)))
+#define CHUNKPAGES (CDBHUGEPAGESIZE / CDBSLABPAGESIZE)
+
+static uint32_t _cdb_slab_class(uint32_t size);
+static uint32_t _cdb_slab_classsize(uint32_t cls);
+static void _cdb_slab_unpartial(CDBSLABCLASS *c, CDBSLABPAGE *page);
+static void _cdb_slab_freepages(CDBSLAB *slab);
+static CDBSLABPAGE *_cdb_slab_newpage(CDBSLAB *slab);
+static void _cdb_slab_droppage(CDBSLAB *slab, CDBSLABPAGE *page);
+static void _cdb_slab_dropchunk(CDBSLAB *slab, CDBSLABCHUNK *chunk);
+
+
+/* map a size to its class, see CDBSLABCLASSNUM */
+static uint32_t _cdb_slab_class(uint32_t size)
+{
+    uint32_t shift;
+
+    if (size <= 256)
+        return size? (size - 1) / 16: 0;
+
+    /* size in (2^shift, 2^(shift+1)] */
+    shift = 31 - __builtin_clz(size - 1);
+    return 16 + (shift - 8) * 8 + ((size - 1 - (1U << shift)) >> (shift - 3));
+}
+
+
+/* reverse of the above */
+static uint32_t _cdb_slab_classsize(uint32_t cls)
+{
+    uint32_t shift;
+
+    if (cls < 16)
+        return (cls + 1) * 16;
+
+    shift = 8 + (cls - 16) / 8;
+    return (1U << shift) + ((cls - 16) % 8 + 1) * (1U << (shift - 3));
+}
+
+
+static void _cdb_slab_unpartial(CDBSLABCLASS *c, CDBSLABPAGE *page)
+{
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        c->partial = page->next;
+    if (page->next)
+        page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+    page->inpartial = 0;
+}
+
+
+/* get a page from the chunks, or from system directly */
+static CDBSLABPAGE *_cdb_slab_newpage(CDBSLAB *slab)
+{
+    CDBSLABCHUNK *chunk = slab->chunks;
+    CDBSLABPAGE *page;
+
+    if (slab->hugepage == CDB_HUGEPAGEOFF) {
+        if (posix_memalign((void **)&page, CDBSLABPAGESIZE, CDBSLABPAGESIZE))
+            return NULL;
+        page->chunk = NULL;
+        return page;
+    }
+
+    if (slab->freepages) {
+        page = slab->freepages;
+        slab->freepages = page->next;
+        if (page->next)
+            page->next->prev = NULL;
+        page->chunk->used++;
+        return page;
+    }
+
+    if (chunk == NULL || chunk->carved == CHUNKPAGES) {
+        chunk = (CDBSLABCHUNK *)malloc(sizeof(CDBSLABCHUNK));
+        chunk->base = (char *)cdb_hp_alloc(CDBHUGEPAGESIZE, slab->hugepage, &chunk->huge);
+        if (chunk->base == NULL) {
+            free(chunk);
+            return NULL;
+        }
+        chunk->carved = chunk->used = 0;
+        chunk->prev = NULL;
+        chunk->next = slab->chunks;
+        if (slab->chunks)
+            slab->chunks->prev = chunk;
+        slab->chunks = chunk;
+        if (chunk->huge)
+            slab->hugesize += CDBHUGEPAGESIZE;
+    }
+
+    /* carved lazily, pages never used are never touched */
+    page = (CDBSLABPAGE *)(chunk->base + (uint64_t)chunk->carved++ * CDBSLABPAGESIZE);
+    page->chunk = chunk;
+    chunk->used++;
+    return page;
+}
+
+
+/* give a page back to its chunk, the chunk goes to system when it is not used at all,
+ unless it's the only one left */
+static void _cdb_slab_droppage(CDBSLAB *slab, CDBSLABPAGE *page)
+{
+    CDBSLABCHUNK *chunk = page->chunk;
+
+    if (chunk == NULL) {
+        free(page);
+        return;
+    }
+
+    page->prev = NULL;
+    page->next = slab->freepages;
+    if (slab->freepages)
+        slab->freepages->prev = page;
+    slab->freepages = page;
+
+    if (--chunk->used == 0 && (chunk->prev || chunk->next)) {
+        /* its pages in the free list go away with it */
+        for(uint32_t i = 0; i < chunk->carved; i++) {
+            CDBSLABPAGE *fpage = (CDBSLABPAGE *)(chunk->base + (uint64_t)i * CDBSLABPAGESIZE);
+            if (fpage->prev)
+                fpage->prev->next = fpage->next;
+            else
+                slab->freepages = fpage->next;
+            if (fpage->next)
+                fpage->next->prev = fpage->prev;
+        }
+        if (chunk->prev)
+            chunk->prev->next = chunk->next;
+        else
+            slab->chunks = chunk->next;
+        if (chunk->next)
+            chunk->next->prev = chunk->prev;
+        _cdb_slab_dropchunk(slab, chunk);
+    }
+}
+
+
+static void _cdb_slab_dropchunk(CDBSLAB *slab, CDBSLABCHUNK *chunk)
+{
+    if (chunk->huge)
+        slab->hugesize -= CDBHUGEPAGESIZE;
+    cdb_hp_free(chunk->base, CDBHUGEPAGESIZE);
+    free(chunk);
+}
+
+
+static void _cdb_slab_freepages(CDBSLAB *slab)
+{
+    CDBSLABPAGE *page = slab->pages;
+    CDBSLABCHUNK *chunk = slab->chunks;
+
+    while(page) {
+        CDBSLABPAGE *next = page->anext;
+        if (page->chunk == NULL)
+            free(page);
+        page = next;
+    }
+    while(chunk) {
+        CDBSLABCHUNK *next = chunk->next;
+        _cdb_slab_dropchunk(slab, chunk);
+        chunk = next;
+    }
+    slab->pages = NULL;
+    slab->chunks = NULL;
+    slab->freepages = NULL;
+    slab->size = slab->used = 0;
+    slab->idle = NULL;
+    for(int i = 0; i < CDBSLABCLASSNUM; i++)
+        slab->classes[i].partial = NULL;
+}
+
+
+CDBSLAB *cdb_slab_new(int hugepage)
+{
+    CDBSLAB *slab = (CDBSLAB *)malloc(sizeof(CDBSLAB));
+
+    for(int i = 0; i < CDBSLABCLASSNUM; i++) {
+        CDBSLABCLASS *c = &slab->classes[i];
+        c->size = _cdb_slab_classsize(i);
+        c->objnum = (CDBSLABPAGESIZE - PAGEHSIZE) / c->size;
+        c->partial = NULL;
+    }
+    slab->lock = cdb_lock_new(CDB_LOCKADAPT);
+    slab->pages = NULL;
+    slab->size = slab->used = 0;
+    slab->idle = NULL;
+    slab->hugepage = hugepage;
+    slab->chunks = NULL;
+    slab->freepages = NULL;
+    slab->hugesize = 0;
+    slab->ref = 1;
+    return slab;
+}
+
+
+CDBSLAB *cdb_slab_ref(CDBSLAB *slab)
+{
+    slab->ref++;
+    return slab;
+}
+
+
+void cdb_slab_release(CDBSLAB *slab)
+{
+    if (--slab->ref)
+        return;
+
+    _cdb_slab_freepages(slab);
+    cdb_lock_destory(slab->lock);
+    free(slab);
+}
+
+
+uint32_t cdb_slab_objsize(uint32_t size)
+{
+    if (size > CDBSLABMAXOBJ)
+        return size;
+    return _cdb_slab_classsize(_cdb_slab_class(size));
+}
+
+
+void *cdb_slab_alloc(CDBSLAB *slab, uint32_t size)
+{
+    CDBSLABCLASS *c = &slab->classes[_cdb_slab_class(size)];
+    CDBSLABPAGE *page;
+    void *obj;
+
+    cdb_lock_lock(slab->lock);
+    page = c->partial;
+    if (page == NULL) {
+        page = _cdb_slab_newpage(slab);
+        if (page == NULL) {
+            cdb_lock_unlock(slab->lock);
+            return NULL;
+        }
+        page->freelist = NULL;
+        page->cls = c - slab->classes;
+        page->used = page->carved = 0;
+        page->prev = page->next = NULL;
+        page->inpartial = 1;
+        c->partial = page;
+        page->aprev = NULL;
+        page->anext = slab->pages;
+        if (slab->pages)
+            slab->pages->aprev = page;
+        slab->pages = page;
+        slab->size += CDBSLABPAGESIZE;
+    }
+
+    if (page == slab->idle)
+        slab->idle = NULL;
+    if (page->freelist) {
+        obj = page->freelist;
+        page->freelist = *(void **)obj;
+    } else
+        obj = (char *)page + PAGEHSIZE + (uint64_t)page->carved++ * c->size;
+
+    if (++page->used == c->objnum)
+        _cdb_slab_unpartial(c, page);
+    slab->used += c->size;
+    cdb_lock_unlock(slab->lock);
+    return obj;
+}
+
+
+void cdb_slab_free(CDBSLAB *slab, void *ptr)
+{
+    CDBSLABPAGE *page = PAGEOF(ptr);
+    CDBSLABCLASS *c = &slab->classes[page->cls];
+
+    cdb_lock_lock(slab->lock);
+    *(void **)ptr = page->freelist;
+    page->freelist = ptr;
+    if (!page->inpartial) {
+        page->prev = NULL;
+        page->next = c->partial;
+        if (c->partial)
+            c->partial->prev = page;
+        c->partial = page;
+        page->inpartial = 1;
+    }
+
+    slab->used -= c->size;
+    /* an empty page goes back to system, unless it's the first one kept by the slab */
+    if (--page->used == 0 && slab->idle == NULL)
+        slab->idle = page;
+    else if (page->used == 0) {
+        _cdb_slab_unpartial(c, page);
+        if (page->aprev)
+            page->aprev->anext = page->anext;
+        else
+            slab->pages = page->anext;
+        if (page->anext)
+            page->anext->aprev = page->aprev;
+        slab->size -= CDBSLABPAGESIZE;
+        _cdb_slab_droppage(slab, page);
+    }
+    cdb_lock_unlock(slab->lock);
+}
+
+
+uint64_t cdb_slab_idle(CDBSLAB *slab)
+{
+    uint64_t idle;
+
+    cdb_lock_lock(slab->lock);
+    idle = slab->size - slab->used;
+    cdb_lock_unlock(slab->lock);
+    return idle;
+}
+
+
+void cdb_slab_reset(CDBSLAB *slab)
+{
+    cdb_lock_lock(slab->lock);
+    _cdb_slab_freepages(slab);
+    cdb_lock_unlock(slab->lock);
+}
@@ -0,0 +1,93 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+/*
+A size-class slab allocator for cache items. Objects of the same class are carved
+from aligned pages, a page is given back to the system once all its objects are freed,
+except one empty page kept by each slab for the next allocation of its class.
+Callers charge objects by their class size, the rest of the pages is not charged:
+an empty page and the free objects of partly used pages, see cdb_slab_idle().
+Objects larger than CDBSLABMAXOBJ are not handled here, callers should malloc() them.
+It can be shared by several hash tables, every one holds a reference.
+With huge pages enabled, pages are carved from 2MB chunks, and a chunk is given back
+once none of its pages is used
+*/
+#ifndef _CDB_SLAB_H_
+#define _CDB_SLAB_H_
+#include "cdb_lock.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/* size of a slab page, which is also its alignment */
+#define CDBSLABPAGESIZE (64 * 1024)
+/* max size of an object in slab */
+#define CDBSLABMAXOBJ (4 * 1024)
+/* 16 bytes step up to 256, then 8 classes between two powers of 2 */
+#define CDBSLABCLASSNUM 48
+
+typedef struct CDBSLABPAGE CDBSLABPAGE;
+typedef struct CDBSLABCHUNK CDBSLABCHUNK;
+
+typedef struct {
+    /* pages with free objects */
+    CDBSLABPAGE *partial;
+    /* object size of the class */
+    uint32_t size;
+    /* objects in a page */
+    uint32_t objnum;
+} CDBSLABCLASS;
+
+typedef struct CDBSLAB {
+    CDBLOCK *lock;
+    CDBSLABCLASS classes[CDBSLABCLASSNUM];
+    /* all pages, used in bulk release */
+    CDBSLABPAGE *pages;
+    /* memory taken by pages */
+    uint64_t size;
+    /* memory of objects in use */
+    uint64_t used;
+    /* the only empty page kept, it is still in the partial list of its class */
+    CDBSLABPAGE *idle;
+    /* one of CDB_HUGEPAGE*, pages are allocated one by one if it's CDB_HUGEPAGEOFF */
+    int hugepage;
+    /* huge page chunks, the first one is being carved */
+    CDBSLABCHUNK *chunks;
+    /* pages not used in chunks */
+    CDBSLABPAGE *freepages;
+    /* memory of chunks which got huge pages */
+    uint64_t hugesize;
+    /* number of hash tables sharing the slab */
+    uint32_t ref;
+} CDBSLAB;
+
+
+/* create a slab with a reference, 'hugepage' is one of CDB_HUGEPAGE* */
+CDBSLAB *cdb_slab_new(int hugepage);
+/* add a reference */
+CDBSLAB *cdb_slab_ref(CDBSLAB *slab);
+/* drop a reference, all pages are freed in bulk when the last one is dropped */
+void cdb_slab_release(CDBSLAB *slab);
+/* the real size allocated for a request of 'size' bytes */
+uint32_t cdb_slab_objsize(uint32_t size);
+/* allocate an object no larger than CDBSLABMAXOBJ */
+void *cdb_slab_alloc(CDBSLAB *slab, uint32_t size);
+/* free an object, it can be called from any thread */
+void cdb_slab_free(CDBSLAB *slab, void *ptr);
+/* memory of pages not taken by objects in use */
+uint64_t cdb_slab_idle(CDBSLAB *slab);
+/* free all objects at once */
+void cdb_slab_reset(CDBSLAB *slab);
+
+#endif
@@ -24,7 +24,7 @@
 
 #define SI8 8
 #define SI4 4
-/* space reserved in stack for i/o, avoid some malloc/free */
+/* upper limit of a default record read size */
 #define SBUFSIZE (64 * KB)
 
 /* a default disk read size for index page, 3KB is enough(a page with 300 items) */
@@ -47,15 +47,81 @@
 #define CDB_PAGEINCR 4
 
 
-/* if page cache size exceeds the limit */
-#define PCOVERFLOW(db) ((db)->dpcache && (db)->dpcache->size + (db)->pcache->size > (db)->pclimit)
-/* if record cache size exceeds the limit */
-#define RCOVERFLOW(db) ((db)->rcache && (db)->rcache->size > (db)->rclimit)
+/* record cache and page caches are split into shards, each has its own lock and LRU */
+#define CACHESHARDNUM 16
+/* shards of statistics counters, threads are spread over them */
+#define STATSHARDNUM 32
+/* which shard a record belongs to, by its 64-bit key hash */
+#define RCSHARD(hash) (((hash) >> 24) % CACHESHARDNUM)
+/* which shard an index page belongs to, by its bucket id */
+#define PCSHARD(bid) ((bid) % CACHESHARDNUM)
+
+/* cache limits are moved by the background task and the user, read them without lock */
+#define RCLIMIT(db) __atomic_load_n(&(db)->rclimit, __ATOMIC_RELAXED)
+#define PCLIMIT(db) __atomic_load_n(&(db)->pclimit, __ATOMIC_RELAXED)
+/* if a page cache shard size exceeds 'pct' percent of its part of the limit */
+#define PCOVER(db, s, pct) ((db)->dpcache[s] && cdb_ht_size((db)->dpcache[s]) + cdb_ht_size((db)->pcache[s]) > PCLIMIT(db) * (pct) / 100 / CACHESHARDNUM)
+#define PCOVERFLOW(db, s) PCOVER(db, s, 100)
+/* if a record cache shard size exceeds 'pct' percent of its part of the limit */
+#define RCOVER(db, s, pct) ((db)->rcache[s] && cdb_ht_size((db)->rcache[s]) > RCLIMIT(db) * (pct) / 100 / CACHESHARDNUM)
+#define RCOVERFLOW(db, s) RCOVER(db, s, 100)
+/* a cache shard past the high percent of its part of the limit wakes the evictor thread up,
+ which evicts it down to the low percent. Callers evict by themselves only past the limit */
+#define EVICTHIGHRATIO 95
+#define EVICTLOWRATIO 90
 
 /* timeout for a dirty index page stays since last modify */
 #define DPAGETIMEOUT 40
-/* operation on main table are isolated by these locks */
+/* flusher threads start when dirty pages of a shard pass the high watermark, and write
+ them out from the oldest until the low watermark. Both are percents of the page cache limit */
+#define DPHIGHRATIO 50
+#define DPLOWRATIO 25
+/* if dirty pages of a shard pass the high watermark */
+#define DPOVERHIGH(db, s) ((db)->dpcache[s] && cdb_ht_size((db)->dpcache[s]) > PCLIMIT(db) * (db)->dphigh / 100 / CACHESHARDNUM)
+/* background threads writing out dirty pages, every one takes some of the shards */
+#define DPFLUSHERNUM 4
+/* dirty pages written in a row by a flusher thread, their buckets are locked meanwhile */
+#define DPFLUSHBATCH 64
+/* bucket ranges checkpointed in turn, the oldest checkpoint is the recovery point */
+#define CKPRANGENUM 64
+/* default seconds for a round of range checkpoints */
+#define CKPROUNDTIME 300
+/* seconds between two rebalances of the memory budget */
+#define BUDGETINTERVAL 10
+/* memory moved in a rebalance, as a fraction of the budget */
+#define BUDGETSTEPDIV 32
+/* neither cache goes below this fraction of the budget */
+#define BUDGETMINDIV 16
+/* ghost hits needed in an interval to make a decision */
+#define BUDGETMINHITS 64
+/* a ghost set remembers one key per this much budget, at 16 bytes per key */
+#define GHOSTDIV 2048
+/* a cache limit shrinks at least this much per second until it reaches the target */
+#define LIMITSTEPMIN (8 * MB)
+/* under memory pressure, caches don't shrink below this percent of their targets */
+#define CACHESCALEMIN 12
+/* percent of the targets given back to caches per second after pressure is gone */
+#define CACHESCALEUP 2
+/* side files keeping hot records/buckets of the caches, saved at close and periodically */
+#define HOTKEYFILE "hotkeys.cdb"
+#define HOTPAGEFILE "hotpages.cdb"
+/* seconds between two saves of the hot records/buckets */
+#define HOTSAVEINTERVAL 600
+/* threads reading hot records or pages at open, each reads a range sorted by offset */
+#define WARMUPTHREADNUM 4
+/* the main table is walked by this many buckets a time in page warmup, the offsets of a
+ slice are read before the next one is collected */
+#define WARMUPSLICE (1024 * 1024)
+/* threads writing out all dirty pages, each writes a range of buckets in order */
+#define FLUSHTHREADNUM 4
+/* dirty pages written in a row by a flushing thread */
+#define FLUSHBATCHNUM 1024
+/* bucket ids are spread over the bits a fingerprint cache picks its sets with */
+#define PGHOSTHASH(bid) ((uint64_t)(bid) * 0x9E3779B97F4A7C15ull)
+/* operation on main table are isolated by these locks, default number of stripes */
 #define MLOCKNUM 256
+/* the lock stripe of a bucket in main table */
+#define MLOCK(db, bid) ((db)->mlock[(bid) % (db)->mlocknum])
 
 #define CDBHASH64(a, b) cdb_crc64(a, b) 
 
@@ -89,6 +155,26 @@ typedef struct PITEM
 } __attribute__((packed)) PITEM;
 
 
+/* what the offset cache remembers for a key */
+typedef struct OCITEM
+{
+    FOFF off;
+    /* size of the record on disk, not aligned */
+    uint32_t rsize;
+    uint32_t expire;
+} __attribute__((packed)) OCITEM;
+
+
+/* a hot record saved for warming up the record cache, the key is in the record */
+typedef struct HOTKEY
+{
+    uint64_t hash;
+    FOFF off;
+    /* size of the record on disk, not aligned */
+    uint32_t rsize;
+} __attribute__((packed)) HOTKEY;
+
+
 /* data record */
 typedef struct CDBREC{
     /* where the data come from */
@@ -140,5 +226,9 @@ typedef struct CDBPAGE{
 /* in-memory size of an record structure */
 #define MPAGESIZE(p) (sizeof(CDBPAGE) + sizeof(PITEM) * (p)->cap)
 
+/* initial scratch buffer sizes for reading a page/record, they grow if it's larger */
+#define PAGESBUFSIZE (sizeof(CDBPAGE) - PAGEHSIZE + PAGEAREADSIZE)
+#define RECSBUFSIZE(db) (sizeof(CDBREC) - RECHSIZE + (db)->areadsize)
+
 #endif
 
@@ -37,6 +37,9 @@ typedef int (*VIODELETEREC)(CDBVIO*, CDBREC*, FOFF);
 greater than the stack buffer size, it will be changed to points to a space in heap, 
 the last parameter decides whether read the whole record or just read key for comparsion */
 typedef int (*VIOREADREC)(CDBVIO*, CDBREC**, FOFF, bool);
+/* read a whole record in one request, its size on disk is known and passed in the
+last parameter. 2nd parameter is handled the same as VIOREADREC */
+typedef int (*VIOREADREC2)(CDBVIO*, CDBREC**, FOFF, uint32_t);
 /* close the storage */
 typedef int (*VIOCLOSE)(CDBVIO*);
 /* open the storage, pass in the storage path and open mode */
@@ -46,6 +49,9 @@ typedef int (*VIOWRITEPAGE)(CDBVIO*, CDBPAGE *, FOFF*);
 /* read an index page, 2nd parameter default points to stack buffer, if its real size
 greater than the stack buffer size, it will be changed to points to a space in heap */
 typedef int (*VIOREADPAGE)(CDBVIO*, CDBPAGE **, FOFF);
+/* write index pages in a row by large writes, return their virtual offsets at 4th parameter.
+the writes of several callers don't wait for each other */
+typedef int (*VIOWRITEPAGES)(CDBVIO*, CDBPAGE **, uint32_t, FOFF*);
 /* make the storage do an sync operation */
 typedef int (*VIOSYNC)(CDBVIO*);
 /* write db header, which contains main-index */
@@ -54,6 +60,8 @@ typedef int (*VIOWRITEHEAD)(CDBVIO*);
 typedef int (*VIOREADHEAD)(CDBVIO*);
 /* tell that no dirty page exists */
 typedef void (*VIOCLEANPOINT)(CDBVIO*);
+/* tell that the recovery point moved forward, while some dirty pages may still exist */
+typedef void (*VIOCHECKPOINT)(CDBVIO*);
 /* get the record/page iterator at oid */
 typedef void* (*VIOITFIRST)(CDBVIO *, uint64_t oid);
 /* get the next index page by iterator */
@@ -62,6 +70,16 @@ typedef int (*VIOPAGEITNEXT)(CDBVIO *, CDBPAGE **, void *);
 typedef int (*VIORECITNEXT)(CDBVIO *, CDBREC **, void *);
 /* destroy and free the iterator */
 typedef void (*VIOITDESTROY)(CDBVIO *, void *);
+/* called for every page read by VIOREADPAGES, return false to stop reading */
+typedef bool (*VIOPAGECB)(void *, CDBPAGE *);
+/* read index pages at offsets sorted ascending, nearby pages in a file are fetched by
+large reads, and the reads of several callers don't wait for each other. pages failed to
+read are skipped */
+typedef int (*VIOREADPAGES)(CDBVIO *, const FOFF *, uint32_t, VIOPAGECB, void *);
+/* replace a side file by name in the storage as a whole, such as saved cache hints */
+typedef int (*VIOWRITESIDE)(CDBVIO *, const char *, const void *, uint64_t);
+/* read a whole side file by name, the buffer at 3rd parameter is malloc()ed, caller frees it */
+typedef int (*VIOREADSIDE)(CDBVIO *, const char *, void **, uint64_t *);
 
 struct CDBVIO 
 {
@@ -71,15 +89,19 @@ struct CDBVIO
     VIOWRITEREC wrec;
     VIODELETEREC drec;
     VIOREADREC rrec;
+    VIOREADREC2 rrec2;
 
     VIOWRITEPAGE wpage;
+    VIOWRITEPAGES wpages;
     VIOREADPAGE rpage;
+    VIOREADPAGES rpages;
 
     VIOSYNC sync;
     VIOWRITEHEAD whead;
     VIOREADHEAD rhead;
     
     VIOCLEANPOINT cleanpoint;
+    VIOCHECKPOINT checkpoint;
 
     VIOITFIRST pageitfirst;
     VIOPAGEITNEXT pageitnext;
@@ -89,6 +111,9 @@ struct CDBVIO
     VIORECITNEXT recitnext;
     VIOITDESTROY recitdestroy;
 
+    VIOWRITESIDE wside;
+    VIOREADSIDE rside;
+
     CDB *db;
     void *iometa;
 };
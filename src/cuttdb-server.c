@@ -817,7 +817,7 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
     command = tokens[COMMAND_TOKEN].value;
 
     if (ntokens == 2 && strcmp(command, "stats") == 0) {
-        char temp[1024];
+        char temp[4096];
         pid_t pid = getpid();
         uint64_t total = 0, curr = 0;
         CDBSTAT db_stat;
@@ -874,8 +874,37 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         pos += sprintf(pos, "STAT record_cache_misses %lu\r\n", db_stat.rcmiss);
         pos += sprintf(pos, "STAT page_cache_hits %lu\r\n", db_stat.pchit);
         pos += sprintf(pos, "STAT page_cache_misses %lu\r\n", db_stat.pcmiss);
+        pos += sprintf(pos, "STAT record_cache_rejects %lu\r\n", db_stat.rcreject);
+        pos += sprintf(pos, "STAT page_cache_rejects %lu\r\n", db_stat.pcreject);
+        pos += sprintf(pos, "STAT huge_page_bytes %lu\r\n", db_stat.hugesize);
+        pos += sprintf(pos, "STAT slab_idle_bytes %lu\r\n", db_stat.slabidle);
+        pos += sprintf(pos, "STAT record_cache_limit %lu\r\n", db_stat.rclimit);
+        pos += sprintf(pos, "STAT page_cache_limit %lu\r\n", db_stat.pclimit);
+        pos += sprintf(pos, "STAT record_cache_ghost_hits %lu\r\n", db_stat.rcghosthit);
+        pos += sprintf(pos, "STAT page_cache_ghost_hits %lu\r\n", db_stat.pcghosthit);
+        pos += sprintf(pos, "STAT cache_rebalances %u\r\n", db_stat.splitnum);
+        pos += sprintf(pos, "STAT cache_scale_percent %u\r\n", db_stat.cachescale);
+        pos += sprintf(pos, "STAT memory_pressure_shrinks %u\r\n", db_stat.pressurenum);
+        pos += sprintf(pos, "STAT record_cache_warmed %lu\r\n", db_stat.rcwarmnum);
+        pos += sprintf(pos, "STAT eviction_stalls %lu\r\n", db_stat.evstall);
+        pos += sprintf(pos, "STAT eviction_stall_time %lu\r\n", db_stat.evstalltime);
+        pos += sprintf(pos, "STAT record_cache_share_history");
+        for(int i = 0; i < CDB_SPLITHISTNUM && db_stat.splithist[i]; i++)
+            pos += sprintf(pos, "%c%u", i? ',': ' ', db_stat.splithist[i]);
+        pos += sprintf(pos, "\r\n");
         pos += sprintf(pos, "STAT read_latency_avg  %u\r\n", db_stat.rlatcy);
         pos += sprintf(pos, "STAT write_latency_avg %u\r\n", db_stat.wlatcy);
+        {
+            static const char *lockname[CDB_LOCKSTATNUM] = {"mlock", "rcache_lock",
+                "pcache_lock", "dpcache_lock", "misc_lock"};
+            CDBLOCKSTAT lock_stat[CDB_LOCKSTATNUM];
+            cdb_lockstat(db, lock_stat);
+            for(int i = 0; i < CDB_LOCKSTATNUM; i++) {
+                pos += sprintf(pos, "STAT %s_acquires %lu\r\n", lockname[i], lock_stat[i].acquire);
+                pos += sprintf(pos, "STAT %s_contended %lu\r\n", lockname[i], lock_stat[i].contended);
+                pos += sprintf(pos, "STAT %s_wait_us %lu\r\n", lockname[i], lock_stat[i].waittime);
+            }
+        }
         pos += sprintf(pos, "END");
         STATS_UNLOCK();
         out_string(c, temp);
@@ -1168,6 +1197,46 @@ static void process_verbosity_command(conn *c, token_t *tokens, const size_t nto
     return;
 }
 
+/* a cache size in MB, or -1 to keep the limit */
+static bool safe_cachemb(const char *str, int *out) {
+    char *endptr;
+    long l;
+
+    errno = 0;
+    l = strtol(str, &endptr, 10);
+    if (errno == ERANGE || endptr == str || *endptr != '\0')
+        return false;
+    if (l < -1 || l > INT_MAX)
+        return false;
+    *out = (int)l;
+    return true;
+}
+
+/* config cache <rcacheMB> <pcacheMB>, -1 keeps a limit */
+static void process_config_command(conn *c, token_t *tokens, const size_t ntokens) {
+    int rcache, pcache;
+
+    assert(c != NULL);
+
+    if (strcmp(tokens[1].value, "cache") != 0) {
+        out_string(c, "CLIENT_ERROR unknown config option");
+        return;
+    }
+
+    if (!safe_cachemb(tokens[2].value, &rcache) || !safe_cachemb(tokens[3].value, &pcache)) {
+        out_string(c, "CLIENT_ERROR invalid cache size, expect MB from 0 to INT_MAX or -1");
+        return;
+    }
+
+    if (cdb_set_cache_limits(db, rcache, pcache) < 0) {
+        char temp[128];
+        snprintf(temp, sizeof(temp), "SERVER_ERROR %s", cdb_errmsg(cdb_errno(db)));
+        out_string(c, temp);
+        return;
+    }
+    out_string(c, "OK");
+}
+
 static void process_command(conn *c, char *command) {
 
     token_t tokens[MAX_TOKENS];
@@ -1231,6 +1300,10 @@ static void process_command(conn *c, char *command) {
     } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "verbosity") == 0)) {
 
         process_verbosity_command(c, tokens, ntokens);
+
+    } else if (ntokens == 5 && (strcmp(tokens[COMMAND_TOKEN].value, "config") == 0)) {
+
+        process_config_command(c, tokens, ntokens);
     
 /*    } else if (ntokens >= 2 && ntokens <= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "flush_all") == 0)) {
 
@@ -2109,7 +2182,7 @@ int main (int argc, char **argv) {
     cdb_option(db, db_hsize, rcache, pcache);
     cdb_option_areadsize(db, areadsize);
 
-    if (cdb_open(db, dbhome, CDB_CREAT | CDB_PAGEWARMUP) < 0) {
+    if (cdb_open(db, dbhome, CDB_CREAT | CDB_PAGEWARMUP | CDB_RCACHEWARMUP) < 0) {
         fprintf(stderr, "failed to open db %s\n", dbhome);
         exit(1);
     }
@@ -25,6 +25,10 @@ extern "C" {
 typedef struct CDB CDB;
 typedef void (*CDB_ERRCALLBACK)(void *, int, const char *, int);
 typedef bool (*CDB_ITERCALLBACK)(void *, const char *, int, const char *, int, uint32_t, uint64_t);
+typedef void (*CDB_FLUSHCALLBACK)(void *, uint64_t, uint64_t);
+
+/* number of rebalances remembered in CDBSTAT.splithist */
+#define CDB_SPLITHISTNUM 16
 
 /* performance statistical information of an database instance */
 typedef struct {
@@ -48,8 +52,65 @@ typedef struct {
     uint32_t rlatcy;
     /* average disk write latency */
     uint32_t wlatcy;
+    /* records not admitted into record cache, they were less frequently used than the victim */
+    uint64_t rcreject;
+    /* pages not admitted into page cache */
+    uint64_t pcreject;
+    /* memory of main table, bloom filter and cache slabs mapped with huge pages */
+    uint64_t hugesize;
+    /* memory of cache slab pages not taken by cached items, it is not charged to the cache
+     limits: an empty page kept by each slab and free slots in pages partly used */
+    uint64_t slabidle;
+    /* current size limits of record/page cache, they move under a memory budget */
+    uint64_t rclimit;
+    uint64_t pclimit;
+    /* misses of records/pages evicted lately, which a larger cache would have hit.
+     only counted under a memory budget */
+    uint64_t rcghosthit;
+    uint64_t pcghosthit;
+    /* number of rebalances moved memory between record cache and page cache */
+    uint32_t splitnum;
+    /* share of record cache in the budget after the latest rebalances, in percent, 
+     newest first, 0 for unused slots */
+    uint8_t splithist[CDB_SPLITHISTNUM];
+    /* percent of the cache limits allowed now, below 100 after memory pressure */
+    uint32_t cachescale;
+    /* number of times the caches shrank for memory pressure */
+    uint32_t pressurenum;
+    /* records loaded into record cache by CDB_RCACHEWARMUP at open */
+    uint64_t rcwarmnum;
+    /* caches are kept below their limits by a background thread (none in a memdb), these are
+     the times callers had to evict by themselves since it didn't keep up, and microseconds
+     they spent on it */
+    uint64_t evstall;
+    uint64_t evstalltime;
 } CDBSTAT;
 
+/* contention of a group of locks */
+typedef struct {
+    /* number of acquisitions */
+    uint64_t acquire;
+    /* acquisitions which had to wait */
+    uint64_t contended;
+    /* total time waited, in microseconds */
+    uint64_t waittime;
+} CDBLOCKSTAT;
+
+/* lock groups in cdb_lockstat */
+enum {
+    /* locks of the main hash table, held while reading index pages from disk */
+    CDB_LOCKSTATMLOCK,
+    /* locks of record cache shards */
+    CDB_LOCKSTATRCACHE,
+    /* locks of clean page cache shards */
+    CDB_LOCKSTATPCACHE,
+    /* locks of dirty page cache shards */
+    CDB_LOCKSTATDPCACHE,
+    /* lock of bloom filter */
+    CDB_LOCKSTATMISC,
+    CDB_LOCKSTATNUM,
+};
+
 /* options to open a database*/
 enum {
     /* create an database if not exist */
@@ -58,6 +119,18 @@ enum {
     CDB_TRUNC = 0x2,
     /* fill the cache when start up */
     CDB_PAGEWARMUP = 0x4,
+    /* reload records hot at last close into the record cache */
+    CDB_RCACHEWARMUP = 0x8,
+};
+
+/* how the main table, bloom filter and caches are backed, see cdb_option_hugepage */
+enum {
+    /* normal pages */
+    CDB_HUGEPAGEOFF = 0,
+    /* 2MB aligned regions advised to be transparent huge pages */
+    CDB_HUGEPAGETHP,
+    /* huge pages reserved in hugetlbfs, falls back to CDB_HUGEPAGETHP if none left */
+    CDB_HUGEPAGETLB,
 };
 
 /* error codes */
@@ -76,6 +149,7 @@ enum {
     CDB_INTERNALERR,
     CDB_DATAERRMETA,
     CDB_MEMDBNOCACHE,
+    CDB_CACHEDISABLED,
 };
 
 /* record insertion options */
@@ -108,7 +182,8 @@ CDB *cdb_new();
  lead to drop in speed or waste of memory
 
  the third parameter 'rcacheMB' indicates the size limit of record cache (measured by 
- MegaBytes), every record in cache would have about 40 bytes overhead. 
+ MegaBytes), every record in cache would have about 40 bytes overhead, including the 
+ memory allocator's, which is counted in the limit. 
 
  the fourth parameter 'pcacheMB' indicates the size limit of index page cache (measured 
  by MegaBytes). If a record is not in record cache, it will be read by only 1 disk seek
@@ -121,11 +196,51 @@ CDB *cdb_new();
  return 0 if success, or -1 at failure. */
 int cdb_option(CDB *db, int hsize, int rcacheMB, int pcacheMB);
 
+/* Change the cache size limits of an opened database, a negative value keeps the limit.
+ A growing cache takes effect at once, a shrinking one is evicted by the background 
+ thread a step every second, or at once in the caller for a memdb. Under a memory budget, the two limits become the new
+ budget for caches. A cache disabled (limit 0) at cdb_open() can't be enabled here.
+ Before cdb_open(), it is the same as cdb_option().
+ return 0 if success, or -1 at failure. */
+int cdb_set_cache_limits(CDB *db, int rcacheMB, int pcacheMB);
+
 /* Enable bloomfilter, size should be the estimated number of records in database 
  must be called before cdb_open(),
  The value is 100000 at minimum. Memory cost of bloomfilter is size/8 bytes */
 void cdb_option_bloomfilter(CDB *db, uint64_t size);
 
+/* Give the database a total memory budget instead of the separate cache limits in 
+ cdb_option(). The bloom filter, negative cache and offset cache have fixed sizes and
+ are taken from the budget first, the rest is split between record cache and page cache. 
+ The split starts at the ratio of the limits in cdb_option(), and is moved every few 
+ seconds toward the cache which would gain more hits per byte, judged by hits of items
+ recently evicted from it. A budget less than 16MB is ignored.
+ must be called before cdb_open(), disabled by default */
+void cdb_option_membudget(CDB *db, int budgetMB);
+
+/* Set the number of lock stripes over the main hash table. Lookups in a stripe run in
+ parallel, a modification locks the stripe exclusively. More stripes let more writers
+ go at the same time, at 64 bytes each. 
+ must be called before cdb_open(), default is 256 */
+void cdb_option_mlocknum(CDB *db, uint32_t num);
+
+/* Enable negative cache, which remembers up to 'num' keys recently found missing, so 
+ repeated lookups of them are answered without reading index or records.
+ Entries are dropped once the key is inserted. Memory cost is about 16 bytes per key.
+ must be called before cdb_open(), disabled by default */
+void cdb_option_negcache(CDB *db, uint32_t num);
+
+/* Enable offset cache, which remembers the location and size of up to 'num' records
+ recently read or written, so a record cache miss of them is served by one exact disk 
+ read without looking up the index page. Memory cost is about 32 bytes per key.
+ must be called before cdb_open(), disabled by default */
+void cdb_option_offcache(CDB *db, uint32_t num);
+
+/* Values larger than 'size' bytes are never kept in record cache, so that a few huge
+ values won't evict many small hot records. The offset cache still helps them.
+ must be called before cdb_open(), default is 1/1024 of the record cache limit */
+void cdb_option_rcvalmax(CDB *db, uint32_t size);
+
 /* this is an advanced parameter. It is the size for cuttdb making a read from disk.
  CuttDB do not know the record size even if the index is in memory,
  so at least a read with default size will performed while in cdb_get().
@@ -135,9 +250,48 @@ void cdb_option_bloomfilter(CDB *db, uint64_t size);
  The value can only be 65536 at maximum, 1024 at minimum */
 void cdb_option_areadsize(CDB *db, uint32_t size);
 
+/* Watch memory pressure of the system or a cgroup, and shrink the caches when the
+ 'avg10' stall percent of 'some' line in 'psifile' reaches 'avg10'. Every second under
+ pressure takes 1/8 from the caches, down to 1/8 of their limits. They grow back slowly
+ once the pressure is gone. 'psifile' is /proc/pressure/memory if NULL, or it may be 
+ the memory.pressure file of a cgroup v2. Needs Linux 4.20 or later.
+ must be called before cdb_open(), disabled by default */
+void cdb_option_mempressure(CDB *db, const char *psifile, int avg10);
+
+/* Back the main table, bloom filter and cache memory by huge pages. They are large 
+ and accessed randomly, so a lookup may take a TLB miss on every access with normal 
+ pages. 'mode' is one of CDB_HUGEPAGEOFF/CDB_HUGEPAGETHP/CDB_HUGEPAGETLB, CDB_HUGEPAGETLB
+ needs pages reserved in /proc/sys/vm/nr_hugepages. Every cache shard takes 2MB at least,
+ about 64MB with both caches, so it suits large caches only.
+ cdb_stat() reports how much memory got huge pages.
+ must be called before cdb_open(), default is CDB_HUGEPAGEOFF */
+void cdb_option_hugepage(CDB *db, int mode);
+
+/* map the main table from 'mainindex.cdb' shared instead of reading it into memory at open
+ and writing it back at close, a large table is ready at once. buckets are updated in the
+ file in place, written back by the system and synced at clean points and close.
+ recovery after a crash rebuilds the table in the mapped file too. must be called before cdb_open(), huge pages don't apply to a mapped table */
+void cdb_option_mmaptable(CDB *db, bool enable);
+
+/* checkpoint the index by bucket ranges in turn, so the recovery point keeps moving under
+ sustained writes. A round of all ranges takes about 'seconds', and a recovery after crash
+ replays the records written in about the last 'seconds'. 0 disables it, then the recovery
+ point only moves when all dirty pages are written out at once.
+ must be called before cdb_open(), default is 300 */
+void cdb_option_recoverytime(CDB *db, uint32_t seconds);
+
+/* Dirty index pages are written out by background threads from the oldest, once they take
+ more than 'high' percent of the page cache limit, until they are below 'low' percent.
+ Pages dirty for 40 seconds are written out anyway. A lower 'high' keeps more room for clean
+ pages and makes writers less likely to write pages by themselves when the cache is full.
+ must be called before cdb_open(), default is 50 and 25 */
+void cdb_option_dirtyratio(CDB *db, uint32_t high, uint32_t low);
+
 /* open an database, 'file' should be an existing directory, or CDB_MEMDB for temporary store,
-   'mode' should be combination of CDB_CREAT / CDB_TRUNC / CDB_PAGEWARMUP 
+   'mode' should be combination of CDB_CREAT / CDB_TRUNC / CDB_PAGEWARMUP / CDB_RCACHEWARMUP
    CDB_PAGEWARMUP means to warm up page cache while opening 
+   CDB_RCACHEWARMUP means to reload the most frequently used records of the record cache,
+   which are saved to 'hotkeys.cdb' at close and every 10 minutes, as many as the cache holds
    If there is a file called 'force_recovery' in the data directory, even if it might be made by 'touch force_recovery',
    a force recovery will happen to rebuild the index (be aware that some deleted records would reappear after this)
  */
@@ -185,6 +339,10 @@ void cdb_iterate_destroy(CDB *db, void *iter);
    if 'stat' is NULL, the statistic will be reset to zero. */
 void cdb_stat(CDB *db, CDBSTAT *stat);
 
+/* get lock contention of db. 'stat' should be an array of CDB_LOCKSTATNUM elements.
+   if 'stat' is NULL, the statistic will be reset to zero. */
+void cdb_lockstat(CDB *db, CDBLOCKSTAT *stat);
+
 
 /* close the database. IT MUST BE CALLED BEFORE PROGRAM EXITS TO ENSURE DATA COMPLETION */
 int cdb_close(CDB *db);
@@ -208,6 +366,11 @@ void cdb_seterrcb(CDB *db, CDB_ERRCALLBACK errcb, void *arg);
 /* a possible error callback */
 void cdb_deferrorcb(void *arg, int errno, const char *file, int line);
 
+/* set callback for the progress of writing out dirty index pages at cdb_close(), it gets
+ the number of pages written and the total. It is called by the flushing threads, one at
+ a time */
+void cdb_setflushcb(CDB *db, CDB_FLUSHCALLBACK flushcb, void *arg);
+
 #if defined(__cplusplus)
 }
 #endif
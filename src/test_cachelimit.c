@@ -0,0 +1,98 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+/* shrink the record cache at runtime, the records read after it should be cached again */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cuttdb.h"
+
+
+#define RECNUM 100000
+#define HOTNUM 2000
+
+
+static void read_range(CDB *db, int from, int to)
+{
+    char key[32];
+    void *v;
+    int vsize;
+
+    for(int i = from; i < to; i++) {
+        int ksize = snprintf(key, 32, "key%d", i);
+        if (cdb_get(db, key, ksize, &v, &vsize) == 0 && v)
+            cdb_free_val(&v);
+    }
+}
+
+
+int main(int argc, char *argv[])
+{
+    char key[32], value[64];
+    CDBSTAT st;
+    CDB *db;
+    int waited = 0;
+
+    if (argc < 2) {
+        printf("Usage: %s db_path\n", argv[0]);
+        return -1;
+    }
+
+    db = cdb_new();
+    cdb_option(db, RECNUM, 16, 16);
+    if (cdb_open(db, argv[1], CDB_CREAT | CDB_TRUNC) < 0) {
+        printf("DB Open err\n");
+        return -1;
+    }
+    for(int i = 0; i < RECNUM; i++) {
+        int ksize = snprintf(key, 32, "key%d", i);
+        int vsize = snprintf(value, 64, "value-%d-of-the-record", i);
+        cdb_set(db, key, ksize, value, vsize);
+    }
+    read_range(db, 0, RECNUM);
+
+    if (cdb_set_cache_limits(db, 1, -1) < 0) {
+        printf("FAIL: cdb_set_cache_limits\n");
+        return 1;
+    }
+    /* the limit moves in background */
+    for(;;) {
+        cdb_stat(db, &st);
+        if (st.rclimit == 1024 * 1024)
+            break;
+        if (++waited > 60) {
+            printf("FAIL: record cache limit is still %lu\n", st.rclimit);
+            return 1;
+        }
+        sleep(1);
+    }
+
+    /* a working set which fits the small cache */
+    read_range(db, 0, HOTNUM);
+    read_range(db, 0, HOTNUM);
+    cdb_stat(db, NULL);
+    read_range(db, 0, HOTNUM);
+    cdb_stat(db, &st);
+    printf("rcnum %lu rchit %lu rcmiss %lu\n", st.rcnum, st.rchit, st.rcmiss);
+    if (st.rcnum == 0 || st.rchit < HOTNUM * 9 / 10) {
+        printf("FAIL: records are not cached after the shrink\n");
+        return 1;
+    }
+
+    cdb_close(db);
+    cdb_destroy(db);
+    printf("OK\n");
+    return 0;
+}
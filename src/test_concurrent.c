@@ -0,0 +1,205 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+/* threads set/get/delete with caches much smaller than the data, so eviction runs all
+ the time. every thread owns its keys and knows what a get must return, keys of others
+ are read too and must hold a value of their own. all is verified again after reopen */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cuttdb.h"
+
+
+#define THREADNUM 8
+#define KEYNUM 20000
+#define OPNUM 100000
+
+
+CDB *db;
+/* version of every key, 0 if it's deleted */
+static uint32_t versions[THREADNUM][KEYNUM];
+static int errors[THREADNUM];
+
+
+static int make_key(char *key, int t, int k)
+{
+    return snprintf(key, 32, "t%d-key%d", t, k);
+}
+
+
+/* the value starts with its key, and some are long enough to skip the record cache */
+static int make_value(char *value, const char *key, uint32_t ver)
+{
+    int vsize = snprintf(value, 32, "%s:%u:", key, ver);
+    int pad = ver % 5 == 0? 1000: ver % 64;
+
+    memset(value + vsize, 'a' + ver % 26, pad);
+    return vsize + pad;
+}
+
+
+/* the value of a key, NULL if it's not found. return -1 at failure */
+static int get_value(const char *key, int ksize, void **v, int *vsize)
+{
+    int ret = cdb_get(db, key, ksize, v, vsize);
+
+    if (ret == -3) {
+        *v = NULL;
+        return 0;
+    }
+    return ret;
+}
+
+
+static void *test_thread(void *arg)
+{
+    int t = (int)(long)arg;
+    unsigned int seed = t + 1;
+    char key[32], value[1200];
+
+    for(int i = 0; i < OPNUM; i++) {
+        int op = rand_r(&seed) % 8;
+        int k = rand_r(&seed) % KEYNUM;
+        int ksize = make_key(key, t, k);
+        void *v = NULL;
+        int vsize;
+
+        if (op < 3) {
+            uint32_t ver = versions[t][k] + 1;
+            vsize = make_value(value, key, ver);
+            if (cdb_set2(db, key, ksize, value, vsize, CDB_OVERWRITE | (op? CDB_INSERTCACHE: 0), 0) < 0)
+                errors[t]++;
+            versions[t][k] = ver;
+        } else if (op == 3) {
+            /* a missing key is no error */
+            cdb_del(db, key, ksize);
+            versions[t][k] = 0;
+        } else if (op < 6) {
+            if (get_value(key, ksize, &v, &vsize) < 0)
+                errors[t]++;
+            else if (versions[t][k] == 0) {
+                if (v)
+                    errors[t]++;
+            } else {
+                int esize = make_value(value, key, versions[t][k]);
+                if (v == NULL || vsize != esize || memcmp(v, value, esize))
+                    errors[t]++;
+            }
+        } else {
+            /* a key of another thread, it is changing now */
+            ksize = make_key(key, (t + op) % THREADNUM, k);
+            if (get_value(key, ksize, &v, &vsize) < 0)
+                errors[t]++;
+            else if (v && (vsize <= ksize || memcmp(v, key, ksize) || ((char *)v)[ksize] != ':'))
+                errors[t]++;
+        }
+        if (v)
+            cdb_free_val(&v);
+    }
+    return NULL;
+}
+
+
+static int verify_all(const char *stage)
+{
+    char key[32], value[1200];
+    uint64_t num = 0;
+    CDBSTAT st;
+    int bad = 0;
+
+    for(int t = 0; t < THREADNUM; t++) {
+        for(int k = 0; k < KEYNUM; k++) {
+            int ksize = make_key(key, t, k);
+            void *v = NULL;
+            int vsize;
+
+            if (get_value(key, ksize, &v, &vsize) < 0)
+                bad++;
+            else if (versions[t][k] == 0) {
+                if (v)
+                    bad++;
+            } else {
+                int esize = make_value(value, key, versions[t][k]);
+                num++;
+                if (v == NULL || vsize != esize || memcmp(v, value, esize))
+                    bad++;
+            }
+            if (v)
+                cdb_free_val(&v);
+        }
+    }
+    cdb_stat(db, &st);
+    if (st.rnum != num) {
+        printf("FAIL: rnum %lu expected %lu %s\n", st.rnum, num, stage);
+        bad++;
+    }
+    if (bad)
+        printf("FAIL: %d records wrong %s\n", bad, stage);
+    return bad;
+}
+
+
+int main(int argc, char *argv[])
+{
+    pthread_t threads[THREADNUM];
+    CDBSTAT st;
+    int bad = 0;
+
+    if (argc < 2) {
+        printf("Usage: %s db_path\n", argv[0]);
+        return -1;
+    }
+
+    db = cdb_new();
+    /* 1MB record cache and page cache for about 40MB of records */
+    cdb_option(db, THREADNUM * KEYNUM / 8, 1, 1);
+    if (cdb_open(db, argv[1], CDB_CREAT | CDB_TRUNC) < 0) {
+        printf("DB Open err\n");
+        return -1;
+    }
+
+    for(long i = 0; i < THREADNUM; i++)
+        pthread_create(&threads[i], NULL, test_thread, (void *)i);
+    for(int i = 0; i < THREADNUM; i++) {
+        pthread_join(threads[i], NULL);
+        if (errors[i]) {
+            printf("FAIL: thread %d got %d wrong results\n", i, errors[i]);
+            bad++;
+        }
+    }
+    cdb_stat(db, &st);
+    printf("rnum %lu rcnum %lu pcnum %lu rchit %lu pchit %lu\n",
+        st.rnum, st.rcnum, st.pcnum, st.rchit, st.pchit);
+
+    bad += verify_all("after the threads");
+    cdb_close(db);
+    cdb_destroy(db);
+
+    db = cdb_new();
+    cdb_option(db, THREADNUM * KEYNUM / 8, 1, 1);
+    if (cdb_open(db, argv[1], 0) < 0) {
+        printf("DB Open err\n");
+        return -1;
+    }
+    bad += verify_all("after reopen");
+    cdb_close(db);
+    cdb_destroy(db);
+
+    if (bad)
+        return 1;
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+/* a child writes, passes checkpoints and dies without closing the db,
+ then the db is recovered and verified, with and without page cache */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "cuttdb.h"
+
+
+#define RECNUM 30000
+/* buffers are written out by background task every 5 seconds */
+#define FLUSHWAIT 7
+
+
+/* every 7th record is overwritten, every 11th deleted after the checkpoints */
+static int expect_value(int i, char *value)
+{
+    if (i % 11 == 0)
+        return -1;
+    if (i % 7 == 0)
+        return snprintf(value, 64, "new-value-%d", i);
+    return snprintf(value, 64, "value-%d", i);
+}
+
+
+static CDB *open_db(const char *path, int pcacheMB, int mode)
+{
+    CDB *db = cdb_new();
+
+    cdb_option(db, RECNUM / 4, 0, pcacheMB);
+    cdb_option_recoverytime(db, 2);
+    if (cdb_open(db, path, mode) < 0) {
+        printf("DB Open err\n");
+        exit(1);
+    }
+    return db;
+}
+
+
+static void crash_child(const char *path, int pcacheMB)
+{
+    char key[32], value[64];
+    CDB *db = open_db(path, pcacheMB, CDB_CREAT | CDB_TRUNC);
+
+    for(int i = 0; i < RECNUM; i++) {
+        int ksize = snprintf(key, 32, "key%d", i);
+        int vsize = snprintf(value, 64, "value-%d", i);
+        cdb_set(db, key, ksize, value, vsize);
+    }
+    /* some bucket ranges are checkpointed */
+    sleep(3);
+    for(int i = 0; i < RECNUM; i++) {
+        int ksize = snprintf(key, 32, "key%d", i);
+        if (i % 11 == 0)
+            cdb_del(db, key, ksize);
+        else if (i % 7 == 0)
+            cdb_set(db, key, ksize, value, snprintf(value, 64, "new-value-%d", i));
+    }
+    sleep(FLUSHWAIT);
+    _exit(0);
+}
+
+
+static int verify(const char *path, int pcacheMB, const char *stage)
+{
+    char key[32], value[64];
+    CDB *db = open_db(path, pcacheMB, 0);
+    CDBSTAT st;
+    int bad = 0, num = 0;
+
+    for(int i = 0; i < RECNUM; i++) {
+        int ksize = snprintf(key, 32, "key%d", i);
+        int vsize = expect_value(i, value);
+        void *v = NULL;
+        int vlen;
+        int ret = cdb_get(db, key, ksize, &v, &vlen);
+
+        if (vsize < 0) {
+            if (ret == 0 && v) {
+                bad++;
+                cdb_free_val(&v);
+            }
+            continue;
+        }
+        num++;
+        if (ret < 0 || v == NULL || vlen != vsize || memcmp(v, value, vsize))
+            bad++;
+        if (v)
+            cdb_free_val(&v);
+    }
+    cdb_stat(db, &st);
+    if (st.rnum != num) {
+        printf("FAIL: rnum %lu expected %d after %s\n", st.rnum, num, stage);
+        bad++;
+    }
+    cdb_close(db);
+    cdb_destroy(db);
+    if (bad)
+        printf("FAIL: %d records wrong after %s, page cache %dMB\n", bad, stage, pcacheMB);
+    return bad;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int pcaches[] = {4, 0};
+    int bad = 0;
+
+    if (argc < 2) {
+        printf("Usage: %s db_path\n", argv[0]);
+        return -1;
+    }
+
+    for(int i = 0; i < 2; i++) {
+        pid_t pid = fork();
+        int status;
+
+        if (pid < 0) {
+            printf("FAIL: fork\n");
+            return 1;
+        }
+        if (pid == 0)
+            crash_child(argv[1], pcaches[i]);
+        waitpid(pid, &status, 0);
+
+        bad += verify(argv[1], pcaches[i], "recovery");
+        /* the recovered db is closed properly, nothing should change */
+        bad += verify(argv[1], pcaches[i], "reopen");
+    }
+
+    if (bad)
+        return 1;
+    printf("OK\n");
+    return 0;
+}
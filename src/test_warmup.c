@@ -0,0 +1,152 @@
+/*
+ *   CuttDB - a fast key-value storage engine
+ *
+ *
+ *   http://code.google.com/p/cuttdb/
+ *
+ *   Copyright (c) 2012, Siyuan Fu.  All rights reserved.
+ *   Use and distribution licensed under the BSD license.
+ *   See the LICENSE file for full text
+ *
+ *   Author: Siyuan Fu <fusiyuan2010@gmail.com>
+ *
+ */
+
+
+/* hot records and pages saved at close are loaded back by the warmup at open. records
+ changed after the save must not come back with their old values */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cuttdb.h"
+
+
+#define RECNUM 50000
+#define HOTNUM 2000
+/* hot keys overwritten or deleted while the hot file is not saved */
+#define CHANGENUM 100
+
+
+static CDB *open_db(const char *path, int rcacheMB, int mode)
+{
+    CDB *db = cdb_new();
+
+    cdb_option(db, RECNUM / 4, rcacheMB, 4);
+    if (cdb_open(db, path, mode) < 0) {
+        printf("DB Open err\n");
+        exit(1);
+    }
+    return db;
+}
+
+
+/* hot keys are spread over the whole key range */
+static int hot_key(char *key, int i)
+{
+    return snprintf(key, 32, "key%d", i * (RECNUM / HOTNUM));
+}
+
+
+/* the i-th hot key was overwritten if i % 3 == 1, deleted if i % 3 == 2 */
+static int expect_value(char *value, int i)
+{
+    if (i < CHANGENUM * 3 / 2 && i % 3 == 2)
+        return -1;
+    if (i < CHANGENUM * 3 / 2 && i % 3 == 1)
+        return snprintf(value, 64, "changed-%d", i * (RECNUM / HOTNUM));
+    return snprintf(value, 64, "value-%d-of-the-record", i * (RECNUM / HOTNUM));
+}
+
+
+static int read_hot(CDB *db)
+{
+    char key[32], value[64];
+    int bad = 0;
+
+    for(int i = 0; i < HOTNUM; i++) {
+        int ksize = hot_key(key, i);
+        int vsize = expect_value(value, i);
+        void *v = NULL;
+        int vlen;
+        int ret = cdb_get(db, key, ksize, &v, &vlen);
+
+        if (vsize < 0)
+            bad += ret != -3;
+        else if (ret < 0 || v == NULL || vlen != vsize || memcmp(v, value, vsize))
+            bad++;
+        if (v)
+            cdb_free_val(&v);
+    }
+    return bad;
+}
+
+
+int main(int argc, char *argv[])
+{
+    char key[32], value[64];
+    CDBSTAT st;
+    CDB *db;
+    int bad;
+
+    if (argc < 2) {
+        printf("Usage: %s db_path\n", argv[0]);
+        return -1;
+    }
+
+    db = open_db(argv[1], 1, CDB_CREAT | CDB_TRUNC);
+    for(int i = 0; i < RECNUM; i++) {
+        int ksize = snprintf(key, 32, "key%d", i);
+        int vsize = snprintf(value, 64, "value-%d-of-the-record", i);
+        cdb_set(db, key, ksize, value, vsize);
+    }
+    /* only the hot keys are read, and many times */
+    for(int r = 0; r < 5; r++) {
+        for(int i = 0; i < HOTNUM; i++) {
+            void *v;
+            int vlen, ksize = hot_key(key, i);
+            if (cdb_get(db, key, ksize, &v, &vlen) == 0 && v)
+                cdb_free_val(&v);
+        }
+    }
+    /* the hot keys and pages are saved */
+    cdb_close(db);
+    cdb_destroy(db);
+
+    /* without record cache the hot keys file is kept as it is */
+    db = open_db(argv[1], 0, 0);
+    for(int i = 0; i < CHANGENUM * 3 / 2; i++) {
+        int ksize = hot_key(key, i);
+        if (i % 3 == 2)
+            cdb_del(db, key, ksize);
+        else if (i % 3 == 1)
+            cdb_set(db, key, ksize, value, expect_value(value, i));
+    }
+    cdb_close(db);
+    cdb_destroy(db);
+
+    db = open_db(argv[1], 1, CDB_PAGEWARMUP | CDB_RCACHEWARMUP);
+    cdb_stat(db, &st);
+    printf("rcwarmnum %lu rcnum %lu pcnum %lu\n", st.rcwarmnum, st.rcnum, st.pcnum);
+    if (st.rcwarmnum < (HOTNUM - CHANGENUM) * 9 / 10 || st.pcnum == 0) {
+        printf("FAIL: hot records or pages are not loaded\n");
+        return 1;
+    }
+
+    cdb_stat(db, NULL);
+    bad = read_hot(db);
+    cdb_stat(db, &st);
+    printf("rchit %lu rcmiss %lu\n", st.rchit, st.rcmiss);
+    if (bad) {
+        printf("FAIL: %d hot records wrong after warmup\n", bad);
+        return 1;
+    }
+    if (st.rchit < (HOTNUM - CHANGENUM) * 9 / 10) {
+        printf("FAIL: hot records are not cached after warmup\n");
+        return 1;
+    }
+
+    cdb_close(db);
+    cdb_destroy(db);
+    printf("OK\n");
+    return 0;
+}
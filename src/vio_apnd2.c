@@ -22,6 +22,7 @@
 #include "cdb_errno.h"
 #include "cdb_types.h"
 #include "cdb_crc64.h"
+#include "cdb_scratch.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +33,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <pthread.h>
 
 /* record magic bytes */
 #define RECMAGIC 0x19871022
@@ -48,6 +50,10 @@
 #define FIDXMAXSIZE (16 * MB)
 /* data file size limit */
 #define FDATMAXSIZE (128 * MB)
+/* max size of a read covering several pages in warmup */
+#define BULKREADSIZE (1 * MB)
+/* max size of a write of pages in a row */
+#define BULKWRITESIZE (4 * MB)
 /* all meta information are regulated to fix size */
 #define FILEMETASIZE 64
 /* the file opened simultaneously limit, managed by LRU */
@@ -83,6 +89,9 @@
 /* data file space recycle check interval factor (seconds per data file/128MB)*/
 #define DATARCYLECHECKFACTOR 1800
 
+/* threads replaying data files at recovery, also the number of files mapped at once */
+#define RECOVERTHREADNUM 4
+
 
 /* three type of file */
 enum {
@@ -155,6 +164,8 @@ typedef struct VIOAPND2FINFO {
     uint32_t ref;
     /* whether unlink the file after dereference */
     bool unlink;
+    /* pages being written outside the lock, the file mustn't be recycled */
+    uint32_t wpending;
 } VIOAPND2FINFO;
 
 
@@ -196,6 +207,9 @@ typedef struct {
     int mfd;
     /* fd for deletion log */
     int dfd;
+    /* oid when the deletion log was rotated, the previous one is kept until recovery
+     point passes it */
+    uint64_t dloid;
 
     /* lock for all I/O operation */
     CDBLOCK *lock;
@@ -235,9 +249,13 @@ static int _vio_apnd2_writerec(CDBVIO *vio, CDBREC *rec, FOFF *off, int ptrtype)
 static int _vio_apnd2_writerecexternal(CDBVIO *vio, CDBREC *rec, FOFF *off);
 static int _vio_apnd2_writerecinternal(CDBVIO *vio, CDBREC *rec, FOFF *off);
 static int _vio_apnd2_deleterec(CDBVIO *vio, CDBREC *rec, FOFF off);
+static int _vio_apnd2_datafd(CDBVIO *vio, uint32_t fid);
 static int _vio_apnd2_readrec(CDBVIO *vio, CDBREC** rec, FOFF off, bool readval);
+static int _vio_apnd2_readrec2(CDBVIO *vio, CDBREC** rec, FOFF off, uint32_t rsize);
 static int _vio_apnd2_writepage(CDBVIO *vio, CDBPAGE *page, FOFF *off);
+static int _vio_apnd2_writepages(CDBVIO *vio, CDBPAGE **pages, uint32_t num, FOFF *offs);
 static int _vio_apnd2_readpage(CDBVIO *vio, CDBPAGE **page, FOFF off);
+static int _vio_apnd2_readpages(CDBVIO *vio, const FOFF *offs, uint32_t num, VIOPAGECB cb, void *arg);
 static int _vio_apnd2_sync(CDBVIO *vio);
 static int _vio_apnd2_writehead2(CDBVIO *vio);
 static int _vio_apnd2_writehead(CDBVIO *vio, bool wtable);
@@ -252,6 +270,7 @@ static void _vio_apnd2_fixcachepageooff(CDB *db, uint32_t bit, FOFF off);
 static void _vio_apnd2_rcylepagespacetask(void *arg);
 static int _vio_apnd2_shiftnew(CDBVIO *vio, int dtype);
 static int _vio_apnd2_recovery(CDBVIO *vio, bool force);
+static int _vio_apnd2_recoverrecs(CDBVIO *vio);
 static void _vio_apnd2_unlink(CDBVIO *vio, VIOAPND2FINFO *finfo, int dtype);
 static VIOAPND2FINFO* _vio_apnd2_fileiternext(CDBVIO *vio, int dtype, uint64_t oid);
 static int _vio_apnd2_iterfirst(CDBVIO *vio, VIOAPND2ITOR *it, int dtype, int64_t oid);
@@ -263,10 +282,13 @@ static void* _vio_apnd2_pageiterfirst(CDBVIO *vio, uint64_t oid);
 static void _vio_apnd2_reciterdestory(CDBVIO *vio, void *iter);
 static void _vio_apnd2_pageiterdestory(CDBVIO *vio, void *iter);
 static void _vio_apnd2_cleanpoint(CDBVIO *vio);
+static void _vio_apnd2_checkpoint(CDBVIO *vio);
 static int _vio_apnd2_cmpfuncsreorder(const void *p1, const void *p2);
 static int _vio_apnd2_checkopensig(CDBVIO *vio);
 static int _vio_apnd2_setopensig(CDBVIO *vio, int sig);
 static int _vio_apnd2_rcyledatafile(CDBVIO *vio, VIOAPND2FINFO *finfo, bool rcyle);
+static int _vio_apnd2_writeside(CDBVIO *vio, const char *name, const void *buf, uint64_t size);
+static int _vio_apnd2_readside(CDBVIO *vio, const char *name, void **buf, uint64_t *size);
 
 
 /* hook the io methods */
@@ -275,20 +297,26 @@ void vio_apnd2_init(CDBVIO *vio)
     vio->close = _vio_apnd2_close;
     vio->open = _vio_apnd2_open;
     vio->rpage = _vio_apnd2_readpage;
+    vio->rpages = _vio_apnd2_readpages;
     vio->wpage = _vio_apnd2_writepage;
+    vio->wpages = _vio_apnd2_writepages;
     vio->rrec = _vio_apnd2_readrec;
+    vio->rrec2 = _vio_apnd2_readrec2;
     vio->drec = _vio_apnd2_deleterec;
     vio->wrec = _vio_apnd2_writerecexternal;
     vio->sync = _vio_apnd2_sync;
     vio->rhead = _vio_apnd2_readhead2;
     vio->whead = _vio_apnd2_writehead2;
     vio->cleanpoint = _vio_apnd2_cleanpoint;
+    vio->checkpoint = _vio_apnd2_checkpoint;
     vio->pageitfirst = _vio_apnd2_pageiterfirst;
     vio->pageitnext = _vio_apnd2_pageiternext;
     vio->pageitdestroy = _vio_apnd2_pageiterdestory;
     vio->recitfirst = _vio_apnd2_reciterfirst;
     vio->recitnext = _vio_apnd2_reciternext;
     vio->recitdestroy = _vio_apnd2_reciterdestory;
+    vio->wside = _vio_apnd2_writeside;
+    vio->rside = _vio_apnd2_readside;
 }
 
 /* the hash table used in VIOAPND2 need not rehash, just use the key id is OK */
@@ -329,11 +357,12 @@ static void _vio_apnd2_new(CDBVIO *vio)
     myio->mfd = -1;
     myio->hfd = -1;
     myio->dfd = -1;
+    myio->dloid = 0;
 
-    myio->fdcache = cdb_ht_new(true, _directhash);
+    myio->fdcache = cdb_ht_new(CDB_HTLRU | CDB_HTOPENADDR, _directhash);
     /* the following two are look-up table, need not LRU */
-    myio->idxmeta = cdb_ht_new(false, _directhash);
-    myio->datmeta = cdb_ht_new(false, _directhash);
+    myio->idxmeta = cdb_ht_new(CDB_HTPLAIN | CDB_HTOPENADDR, _directhash);
+    myio->datmeta = cdb_ht_new(CDB_HTPLAIN | CDB_HTOPENADDR, _directhash);
 
     myio->lock = cdb_lock_new(CDB_LOCKMUTEX);
 
@@ -501,6 +530,8 @@ static int _vio_apnd2_open(CDBVIO *vio, const char *filepath, int flags)
         _vio_apnd2_shiftnew(vio, VIOAPND2_DATA);
     }
     
+    snprintf(filename, MAX_PATH_LEN, "%s/dellogprev.cdb", myio->filepath);
+    unlink(filename);
     snprintf(filename, MAX_PATH_LEN, "%s/dellog.cdb", myio->filepath);
     myio->dfd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (myio->dfd < 0) {
@@ -616,6 +647,7 @@ static int _vio_apnd2_readmeta(CDBVIO *vio, bool overwrite)
         finfo.ftype = *(uint8_t*)(hbuf + pos); 
         pos += 1;
         finfo.ref = 0;
+        finfo.wpending = 0;
         finfo.unlink = false;
         if (overwrite) {
             /* in recovery mode only fix 'recycled size' */
@@ -653,6 +685,7 @@ static int _vio_apnd2_readmeta(CDBVIO *vio, bool overwrite)
         finfo.ftype = *(uint8_t*)(hbuf + pos); 
         pos += 1;
         finfo.ref = 0;
+        finfo.wpending = 0;
         finfo.unlink = false;
         finfo.lcktime = time(NULL);
         if (overwrite) {
@@ -831,6 +864,7 @@ static int _vio_apnd2_shiftnew(CDBVIO *vio, int dtype)
     finfo.unlink = false;
     finfo.nexpire = 0xffffffff;
     finfo.ref = 0;
+    finfo.wpending = 0;
     /* meta information also be written to disk immediately */
     if (_vio_apnd2_writefmeta(vio, iobuf->fd, &finfo) < 0) {
         close(iobuf->fd);
@@ -1113,6 +1147,8 @@ static int _vio_apnd2_close(CDBVIO *vio)
     /* dellog only be useful for recovery of database unsafety close */
     snprintf(filename, MAX_PATH_LEN, "%s/dellog.cdb", myio->filepath);
     unlink(filename);
+    snprintf(filename, MAX_PATH_LEN, "%s/dellogprev.cdb", myio->filepath);
+    unlink(filename);
     _vio_apnd2_setopensig(vio, VIOAPND2_SIGCLOSED);
     if (myio->hfd > 0)
         close(myio->hfd);
@@ -1159,7 +1195,7 @@ static int _vio_apnd2_loadfd(CDBVIO *vio, uint32_t fid, int dtype)
     while(myio->fdcache->num > myio->maxfds) {
         CDBHTITEM *item = cdb_ht_poptail(myio->fdcache);
         close(*(int*)cdb_ht_itemval(myio->fdcache, item));
-        free(item);
+        cdb_ht_freeitem(myio->fdcache, item);
     }
 
     return fd;
@@ -1172,7 +1208,7 @@ static int _vio_apnd2_readpage(CDBVIO *vio, CDBPAGE **page, FOFF off)
     int ret, fd;
     uint32_t psize;
     uint32_t fid, roff;
-    uint32_t fixbufsize = SBUFSIZE - (sizeof(CDBPAGE) - PAGEHSIZE);
+    uint32_t fixbufsize = cdb_scratch_size(*page) - (sizeof(CDBPAGE) - PAGEHSIZE);
     uint32_t areadsize = PAGEAREADSIZE; //vio->db->areadsize;
 
     VOFF2ROFF(off, fid, roff);
@@ -1220,9 +1256,14 @@ static int _vio_apnd2_readpage(CDBVIO *vio, CDBPAGE **page, FOFF off)
     } else if (psize > areadsize) {
         /* need another read operation since the page is a large than default read size */
         if (psize > fixbufsize) {
-            /* record is larger the stack size */
-            CDBPAGE *npage = (CDBPAGE *)malloc(sizeof(CDBPAGE) + (*page)->num * sizeof(PITEM));
-            memcpy(&npage->magic, &(*page)->magic, areadsize);
+            /* page is larger than the scratch buffer */
+            CDBPAGE *npage = (CDBPAGE *)cdb_scratch_grow(*page, 
+                    sizeof(CDBPAGE) + (*page)->num * sizeof(PITEM));
+            if (npage == NULL) {
+                cdb_lock_unlock(myio->lock);
+                cdb_seterrno(vio->db, CDB_INTERNALERR, __FILE__, __LINE__);
+                return -1;
+            }
             *page = npage;
         }
 
@@ -1244,6 +1285,25 @@ static int _vio_apnd2_readpage(CDBVIO *vio, CDBPAGE **page, FOFF off)
     return 0;
 }
 
+/* get the fd of data file 'fid', must be called under lock protection */
+static int _vio_apnd2_datafd(CDBVIO *vio, uint32_t fid)
+{
+    VIOAPND2 *myio = (VIOAPND2*)vio->iometa;
+    int vfid, *fdret;
+
+    if (fid == myio->dbuf.fid)
+        /* read from current writing file? */
+        return myio->dbuf.fd;
+
+    /* read from old data file */
+    vfid = VFIDDAT(fid);
+    fdret = cdb_ht_get2(myio->fdcache, &vfid, sizeof(vfid), true);
+    if (fdret == NULL)
+        return _vio_apnd2_loadfd(vio, fid, VIOAPND2_DATA);
+    return *fdret;
+}
+
+
 /* read a data record */
 static int _vio_apnd2_readrec(CDBVIO *vio, CDBREC** rec, FOFF off, bool readval)
 {
@@ -1251,9 +1311,9 @@ static int _vio_apnd2_readrec(CDBVIO *vio, CDBREC** rec, FOFF off, bool readval)
     int ret, fd;
     uint32_t rsize;
     uint32_t fid, roff;
-    /* the 'rec' is hoped to be fit in stack, the actually size is a little smaller */
-    /* because some fields in CDBREC structure are not on disk */
-    uint32_t fixbufsize = SBUFSIZE - (sizeof(CDBREC) - RECHSIZE);
+    /* the 'rec' is hoped to be fit in the scratch buffer, the actually size is a little 
+     smaller because some fields in CDBREC structure are not on disk */
+    uint32_t fixbufsize = cdb_scratch_size(*rec) - (sizeof(CDBREC) - RECHSIZE);
     uint32_t areadsize = vio->db->areadsize;
 
     VOFF2ROFF(off, fid, roff);
@@ -1261,22 +1321,10 @@ static int _vio_apnd2_readrec(CDBVIO *vio, CDBREC** rec, FOFF off, bool readval)
     (*rec)->magic = 0;
 
     cdb_lock_lock(myio->lock);
-    if (fid == myio->dbuf.fid)
-        /* read from current writing file? */
-        fd = myio->dbuf.fd;
-    else {
-        /* read from old data file */
-        int vfid, *fdret;
-        vfid = VFIDDAT(fid);
-        fdret = cdb_ht_get2(myio->fdcache, &vfid, sizeof(vfid), true);
-        if (fdret == NULL) {
-            fd = _vio_apnd2_loadfd(vio, fid, VIOAPND2_DATA);
-            if (fd < 0) {
-                cdb_lock_unlock(myio->lock);
-                return -1;
-            }
-        } else 
-            fd = *fdret;
+    fd = _vio_apnd2_datafd(vio, fid);
+    if (fd < 0) {
+        cdb_lock_unlock(myio->lock);
+        return -1;
     }
 
     /* NOTICE: the data on disk actually starts at 'magic' field in structure */
@@ -1305,9 +1353,14 @@ static int _vio_apnd2_readrec(CDBVIO *vio, CDBREC** rec, FOFF off, bool readval)
     } else if (rsize > areadsize) {
         /* need another read */
         if (rsize > fixbufsize) {
-            /* record is larger the stack size */
-            CDBREC *nrec = (CDBREC *)malloc(sizeof(CDBREC)+(*rec)->ksize+(*rec)->vsize);
-            memcpy(&nrec->magic, &(*rec)->magic, areadsize);
+            /* record is larger than the scratch buffer */
+            CDBREC *nrec = (CDBREC *)cdb_scratch_grow(*rec, 
+                    sizeof(CDBREC) + (*rec)->ksize + (*rec)->vsize);
+            if (nrec == NULL) {
+                cdb_lock_unlock(myio->lock);
+                cdb_seterrno(vio->db, CDB_INTERNALERR, __FILE__, __LINE__);
+                return -1;
+            }
             *rec = nrec;
         }
         ret = _vio_apnd2_read(vio, fd, (char*)&(*rec)->magic + areadsize,
@@ -1335,6 +1388,52 @@ static int _vio_apnd2_readrec(CDBVIO *vio, CDBREC** rec, FOFF off, bool readval)
 }
 
 
+/* read a complete data record whose size on disk is already known, in just one read */
+static int _vio_apnd2_readrec2(CDBVIO *vio, CDBREC** rec, FOFF off, uint32_t rsize)
+{
+    VIOAPND2 *myio = (VIOAPND2*)vio->iometa;
+    int ret, fd;
+    uint32_t fid, roff;
+    CDBREC *nrec;
+
+    if (rsize < RECHSIZE) {
+        cdb_seterrno(vio->db, CDB_DATAERRDAT, __FILE__, __LINE__);
+        return -1;
+    }
+
+    VOFF2ROFF(off, fid, roff);
+    nrec = (CDBREC *)cdb_scratch_grow(*rec, sizeof(CDBREC) - RECHSIZE + rsize);
+    if (nrec == NULL) {
+        cdb_seterrno(vio->db, CDB_INTERNALERR, __FILE__, __LINE__);
+        return -1;
+    }
+    *rec = nrec;
+    /* avoid dirty memory */
+    (*rec)->magic = 0;
+
+    cdb_lock_lock(myio->lock);
+    fd = _vio_apnd2_datafd(vio, fid);
+    if (fd < 0) {
+        cdb_lock_unlock(myio->lock);
+        return -1;
+    }
+    ret = _vio_apnd2_read(vio, fd, &(*rec)->magic, rsize, roff);
+    cdb_lock_unlock(myio->lock);
+
+    if (ret != rsize || (*rec)->magic != RECMAGIC || RECSIZE(*rec) != rsize) {
+        cdb_seterrno(vio->db, CDB_DATAERRDAT, __FILE__, __LINE__);
+        return -1;
+    }
+
+    /* fix pointer */
+    (*rec)->key = (*rec)->buf;
+    (*rec)->val = (*rec)->buf + (*rec)->ksize;
+    (*rec)->osize = OFFALIGNED(rsize);
+    (*rec)->ooff = off;
+    return 0;
+}
+
+
 /* write a index page, return the written virtual offset */
 static int _vio_apnd2_writepage(CDBVIO *vio, CDBPAGE *page, FOFF *off)
 {
@@ -1400,6 +1499,128 @@ static int _vio_apnd2_writepage(CDBVIO *vio, CDBPAGE *page, FOFF *off)
 }
 
 
+/* the space for pages in a row is taken at the end of the file being written under lock,
+ and filled by a large write outside it from a duplicated fd */
+static int _vio_apnd2_writepages(CDBVIO *vio, CDBPAGE **pages, uint32_t num, FOFF *offs)
+{
+    VIOAPND2 *myio = (VIOAPND2*)vio->iometa;
+    char *win = (char *)cdb_scratch_get(BULKWRITESIZE);
+    uint32_t i = 0;
+    int ret = 0;
+
+    if (win == NULL) {
+        cdb_seterrno(vio->db, CDB_INTERNALERR, __FILE__, __LINE__);
+        return -1;
+    }
+
+    while(i < num) {
+        VIOAPND2FINFO *finfo;
+        uint32_t fid, roff, poff, ofid, oroff, len = 0, pos = 0, j;
+        char *nwin = win;
+        int fd = -1;
+
+        cdb_lock_lock(myio->lock);
+        if (myio->ibuf.fd < 0 && _vio_apnd2_shiftnew(vio, VIOAPND2_INDEX) < 0) {
+            cdb_lock_unlock(myio->lock);
+            ret = -1;
+            break;
+        }
+        /* buffered pages go first, the space starts at the end of file */
+        if (_vio_apnd2_flushbuf(vio, VIOAPND2_INDEX) < 0) {
+            cdb_lock_unlock(myio->lock);
+            ret = -1;
+            break;
+        }
+        fid = myio->ibuf.fid;
+        roff = myio->ibuf.off;
+
+        /* as many pages as the window and the file can take, one at least */
+        for(j = i; j < num; j++) {
+            uint32_t psize = OFFALIGNED(PAGESIZE(pages[j]));
+            if (j > i && (len + psize > BULKWRITESIZE || roff + len + psize > FIDXMAXSIZE))
+                break;
+            pages[j]->magic = PAGEMAGIC;
+            pages[j]->oid = cdb_genoid(vio->db);
+            poff = roff + len;
+            ROFF2VOFF(fid, poff, offs[j]);
+            len += psize;
+        }
+
+        /* extend the file over the space, the next write goes after it */
+        finfo = (VIOAPND2FINFO *)cdb_ht_get2(myio->idxmeta, &fid, SI4, false);
+        fd = dup(myio->ibuf.fd);
+        if (finfo == NULL || fd < 0 || ftruncate(myio->ibuf.fd, roff + len) < 0) {
+            cdb_lock_unlock(myio->lock);
+            if (fd >= 0)
+                close(fd);
+            cdb_seterrno(vio->db, CDB_WRITEERR, __FILE__, __LINE__);
+            ret = -1;
+            break;
+        }
+        finfo->wpending++;
+        myio->ibuf.oid = pages[j - 1]->oid;
+        _vio_apnd2_flushbuf(vio, VIOAPND2_INDEX);
+        cdb_lock_unlock(myio->lock);
+
+        if (len > cdb_scratch_size(win))
+            nwin = (char *)cdb_scratch_grow(win, len);
+        if (nwin == NULL) {
+            close(fd);
+            cdb_lock_lock(myio->lock);
+            finfo->wpending--;
+            /* give the space back if nothing was written after it, or leave it to recycle */
+            if (myio->ibuf.fid == fid && myio->ibuf.pos == 0 && myio->ibuf.off == roff + len
+                && ftruncate(myio->ibuf.fd, roff) == 0) {
+                myio->ibuf.off = roff;
+                finfo->fsize = roff;
+                myio->ibuf.limit = CDBMIN(IOBUFSIZE, FIDXMAXSIZE - roff);
+            } else
+                finfo->rcyled += len;
+            cdb_lock_unlock(myio->lock);
+            cdb_seterrno(vio->db, CDB_INTERNALERR, __FILE__, __LINE__);
+            ret = -1;
+            break;
+        }
+        win = nwin;
+        for(uint32_t k = i; k < j; k++) {
+            uint32_t psize = PAGESIZE(pages[k]);
+            memcpy(win + pos, &pages[k]->magic, psize);
+            memset(win + pos + psize, 0, OFFALIGNED(psize) - psize);
+            pos += OFFALIGNED(psize);
+        }
+        if (pwrite(fd, win, len, roff) != len) {
+            cdb_seterrno(vio->db, CDB_WRITEERR, __FILE__, __LINE__);
+            ret = -1;
+        }
+        close(fd);
+        /* the file info stays, it can't be recycled with pending pages */
+        cdb_lock_lock(myio->lock);
+        finfo->wpending--;
+        if (ret < 0) {
+            cdb_lock_unlock(myio->lock);
+            break;
+        }
+
+        for(uint32_t k = i; k < j; k++) {
+            /* if it was modified from existing page, remember the wasted space */
+            if (OFFNOTNULL(pages[k]->ooff)) {
+                VOFF2ROFF(pages[k]->ooff, ofid, oroff);
+                finfo = (VIOAPND2FINFO *)cdb_ht_get2(myio->idxmeta, &ofid, SI4, false);
+                if (finfo)
+                    finfo->rcyled += pages[k]->osize;
+            }
+            /* remember last wrote offset */
+            pages[k]->ooff = offs[k];
+            pages[k]->osize = OFFALIGNED(PAGESIZE(pages[k]));
+        }
+        cdb_lock_unlock(myio->lock);
+        i = j;
+    }
+    cdb_scratch_put(win);
+    return ret;
+}
+
+
 /* delete a record */
 static int _vio_apnd2_deleterec(CDBVIO *vio, CDBREC *rec, FOFF off)
 {
@@ -1559,7 +1780,7 @@ static int _vio_apnd2_writehead(CDBVIO *vio, bool wtable)
     pos += FILEMAGICLEN;
     *(uint32_t*)(buf + pos) = db->hsize;
     pos += SI4;
-    *(uint64_t*)(buf + pos) = db->oid;
+    *(uint64_t*)(buf + pos) = __atomic_load_n(&db->oid, __ATOMIC_RELAXED);
     pos += SI8;
     *(uint64_t*)(buf + pos) = db->roid;
     pos += SI8;
@@ -1573,7 +1794,13 @@ static int _vio_apnd2_writehead(CDBVIO *vio, bool wtable)
         return -1;
     }
 
-    if (wtable && pwrite(myio->hfd, db->mtable, sizeof(FOFF) * db->hsize, FILEMETASIZE)
+    if (wtable && db->mtmap) {
+        /* the mapped table is in the file already */
+        if (msync(db->mtmap, db->mtmapsize, MS_SYNC) < 0) {
+            cdb_seterrno(vio->db, CDB_WRITEERR, __FILE__, __LINE__);
+            return -1;
+        }
+    } else if (wtable && pwrite(myio->hfd, db->mtable, sizeof(FOFF) * db->hsize, FILEMETASIZE)
         != sizeof(FOFF) * db->hsize) {
             cdb_seterrno(vio->db, CDB_WRITEERR, __FILE__, __LINE__);
             return -1;
@@ -1599,10 +1826,11 @@ static int _vio_apnd2_readhead(CDBVIO *vio, bool rtable)
 
     if (myio->create) {
         /* the db is just created, allocate a empty main index table for db */
-        db->mtable = (FOFF *)malloc(sizeof(FOFF) * db->hsize);
-        memset(db->mtable, 0, sizeof(FOFF) * db->hsize);
         _vio_apnd2_writehead(vio, false);
-        return 0;
+        /* drop anything left behind the header, the mapped buckets must be empty */
+        if (db->mtmmap && ftruncate(myio->hfd, FILEMETASIZE) == 0)
+            return cdb_mapmtable(db, myio->hfd, FILEMETASIZE);
+        return cdb_newmtable(db);
     }
 
     if (pread(myio->hfd, buf, FILEMETASIZE, 0) != FILEMETASIZE) {
@@ -1629,13 +1857,15 @@ static int _vio_apnd2_readhead(CDBVIO *vio, bool rtable)
 
     if (!rtable)
         return 0;
-        
-    if (db->mtable)
-        free(db->mtable);
-    db->mtable = (FOFF *)malloc(sizeof(FOFF) * db->hsize);
+
+    /* recovery may have mapped it already */
+    if (db->mtmmap)
+        return db->mtmap? 0: cdb_mapmtable(db, myio->hfd, FILEMETASIZE);
+    if (cdb_newmtable(db) < 0)
+        return -1;
     if (pread(myio->hfd, db->mtable, sizeof(FOFF) * db->hsize, FILEMETASIZE) !=
         sizeof(FOFF) * db->hsize) {
-            free(db->mtable);
+            cdb_freemtable(db);
             cdb_seterrno(db, CDB_READERR, __FILE__, __LINE__);
             return -1;
     }
@@ -1722,22 +1952,21 @@ static void _vio_apnd2_rcyledataspacetask(void *arg)
 static void _vio_apnd2_fixcachepageooff(CDB *db, uint32_t bid, FOFF off)
 {
     CDBPAGE *page = NULL;
+    uint32_t sid = PCSHARD(bid);
 
-    if (db->pcache) {
-        cdb_lock_lock(db->pclock);
-        page = cdb_ht_get2(db->pcache, &bid, SI4, true);
-        cdb_lock_unlock(db->pclock);
-    }
+    if (db->pcache[sid] == NULL)
+        return;
 
+    /* mlock is holding, the page won't be modified by others */
+    cdb_epoch_enter(db->epoch);
+    page = cdb_ht_rdget(db->pcache[sid], &bid, SI4, NULL, false);
     /* not in pcache, exists in dirty page cache? */
-    if (page == NULL && db->dpcache) {
-        cdb_lock_lock(db->dpclock);
-        page = cdb_ht_get2(db->dpcache, &bid, SI4, true);
-        cdb_lock_unlock(db->dpclock);
-    }
+    if (page == NULL)
+        page = cdb_ht_rdget(db->dpcache[sid], &bid, SI4, NULL, false);
 
     if (page)
         page->ooff = off;
+    cdb_epoch_exit(db->epoch);
 }
 
 /* check if some index file has too large junk space */
@@ -1754,7 +1983,7 @@ static void _vio_apnd2_rcylepagespacetask(void *arg)
         uint32_t fid = finfo->fid;
 
         /* do not work on the writing file or file to be deleted */
-        if (finfo->fstatus != VIOAPND2_FULL || finfo->unlink) {
+        if (finfo->fstatus != VIOAPND2_FULL || finfo->unlink || finfo->wpending) {
             item = cdb_ht_iternext(myio->idxmeta, item);
             continue;
         }
@@ -1793,12 +2022,12 @@ static void _vio_apnd2_rcylepagespacetask(void *arg)
                     FOFF noff;
                     _vio_apnd2_writepage(vio, page, &noff);
                     /* lock and double check */
-                    cdb_lock_lock(vio->db->mlock[page->bid % MLOCKNUM]);
+                    cdb_lock_lock(MLOCK(vio->db, page->bid));
                     if (OFFEQ(vio->db->mtable[page->bid], off)) {
                         vio->db->mtable[page->bid] = noff;
                         _vio_apnd2_fixcachepageooff(vio->db, page->bid, noff);
                     }
-                    cdb_lock_unlock(vio->db->mlock[page->bid % MLOCKNUM]);
+                    cdb_lock_unlock(MLOCK(vio->db, page->bid));
                 }
                 pos += OFFALIGNED(PAGESIZE(page));
             }
@@ -1856,7 +2085,7 @@ static void _vio_apnd2_unlink(CDBVIO *vio, VIOAPND2FINFO *finfo, int dtype)
     fditem = cdb_ht_del(myio->fdcache, &vfid, SI4);
     if (fditem != NULL) {
         close(*(int*)cdb_ht_itemval(myio->fdcache, fditem));
-        free(fditem);
+        cdb_ht_freeitem(myio->fdcache, fditem);
     } 
     (*fnum)--;
     unlink(filename);
@@ -1889,6 +2118,307 @@ static int _vio_apnd2_cmpfuncsreorder(const void *p1, const void *p2)
 }
 
 
+/* a record found by recovery scanning */
+typedef struct {
+    uint64_t hash;
+    uint64_t oid;
+    /* record in the mapped file */
+    CDBREC *crec;
+    FOFF off;
+    /* a newer record with the same key is in the batch */
+    bool stale;
+} VIOAPND2RCENT;
+
+
+/* a data file to be replayed */
+typedef struct {
+    VIOAPND2FINFO *finfo;
+    char *mmap;
+    uint64_t fsize;
+    VIOAPND2RCENT *ents;
+    uint32_t num;
+    uint32_t limit;
+    uint64_t maxoid;
+    /* out of memory */
+    bool err;
+} VIOAPND2RCFILE;
+
+
+/* work of a recovery thread, files and buckets are taken in turn by thread index */
+typedef struct {
+    CDBVIO *vio;
+    VIOAPND2RCFILE *files;
+    uint32_t fnum;
+    VIOAPND2RCENT *ents;
+    uint32_t num;
+    uint32_t tid;
+    uint32_t tnum;
+} VIOAPND2RCTASK;
+
+
+static void _vio_apnd2_rcthreads(void *(*fn)(void *), VIOAPND2RCTASK *tasks, uint32_t tnum)
+{
+    pthread_t threads[RECOVERTHREADNUM];
+    bool started[RECOVERTHREADNUM];
+
+    for(uint32_t i = 0; i < tnum; i++) {
+        /* do it here if no more thread can be created */
+        started[i] = pthread_create(&threads[i], NULL, fn, &tasks[i]) == 0;
+        if (!started[i])
+            fn(&tasks[i]);
+    }
+    for(uint32_t i = 0; i < tnum; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+    }
+}
+
+
+/* collect records of a data file from the first one not older than roid */
+static void _vio_apnd2_rcscanfile(CDBVIO *vio, VIOAPND2RCFILE *rf)
+{
+    VIOAPND2 *myio = (VIOAPND2 *)vio->iometa;
+    char filename[MAX_PATH_LEN];
+    uint64_t roid = vio->db->roid;
+    uint64_t off = FILEMETASIZE;
+    bool started = false;
+    int fd;
+
+    snprintf(filename, MAX_PATH_LEN, "%s/dat%08d.cdb", myio->filepath, rf->finfo->fid);
+    /* an unreadable file is skipped, as the iterator does */
+    fd = open(filename, O_RDONLY, 0644);
+    if (fd < 0)
+        return;
+    rf->fsize = lseek(fd, 0, SEEK_END);
+    if (rf->fsize > FILEMETASIZE) {
+        rf->mmap = mmap(NULL, rf->fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (rf->mmap == MAP_FAILED)
+            rf->mmap = NULL;
+    }
+    close(fd);
+
+    while(rf->mmap && off + RECHSIZE <= rf->fsize) {
+        CDBREC *crec = (CDBREC *)(rf->mmap + off - (sizeof(CDBREC) - RECHSIZE));
+        VIOAPND2RCENT *ent;
+
+        if (crec->magic != RECMAGIC && crec->magic != DELRECMAGIC) {
+            off += ALIGNBYTES;
+            continue;
+        }
+        /* partial written record at the tail */
+        if (off + RECHSIZE + (uint64_t)crec->ksize + crec->vsize > rf->fsize)
+            break;
+        if (!started && crec->oid < roid) {
+            off += OFFALIGNED(RECSIZE(crec));
+            continue;
+        }
+        started = true;
+
+        if (rf->num == rf->limit) {
+            uint32_t nlimit = rf->limit? rf->limit * 2: 4096;
+            VIOAPND2RCENT *tmp = (VIOAPND2RCENT *)realloc(rf->ents, nlimit * sizeof(VIOAPND2RCENT));
+            if (tmp == NULL) {
+                rf->err = true;
+                break;
+            }
+            rf->ents = tmp;
+            rf->limit = nlimit;
+        }
+        ent = &rf->ents[rf->num++];
+        ent->hash = CDBHASH64(crec->buf, crec->ksize);
+        ent->oid = crec->oid;
+        ent->crec = crec;
+        ent->stale = false;
+        ROFF2VOFF(rf->finfo->fid, off, ent->off);
+        if (crec->oid > rf->maxoid)
+            rf->maxoid = crec->oid;
+        off += OFFALIGNED(RECSIZE(crec));
+    }
+}
+
+
+static void *_vio_apnd2_rcscanthread(void *arg)
+{
+    VIOAPND2RCTASK *task = (VIOAPND2RCTASK *)arg;
+
+    for(uint32_t i = task->tid; i < task->fnum; i += task->tnum)
+        _vio_apnd2_rcscanfile(task->vio, &task->files[i]);
+    return NULL;
+}
+
+
+/* same hash, then in write order */
+static int _vio_apnd2_rcentcmp(const void *p1, const void *p2)
+{
+    const VIOAPND2RCENT *e1 = (const VIOAPND2RCENT *)p1;
+    const VIOAPND2RCENT *e2 = (const VIOAPND2RCENT *)p2;
+
+    if (e1->hash != e2->hash)
+        return e1->hash < e2->hash? -1: 1;
+    if (e1->oid != e2->oid)
+        return e1->oid < e2->oid? -1: 1;
+    if (e1->off.i4 != e2->off.i4)
+        return e1->off.i4 < e2->off.i4? -1: 1;
+    if (e1->off.i2 != e2->off.i2)
+        return e1->off.i2 < e2->off.i2? -1: 1;
+    return 0;
+}
+
+
+static bool _vio_apnd2_rckeyeq(CDBREC *r1, CDBREC *r2)
+{
+    return r1->ksize == r2->ksize && memcmp(r1->buf, r2->buf, r1->ksize) == 0;
+}
+
+
+/* put the newest record of every key into index, a bucket is only touched by one thread */
+static void *_vio_apnd2_rcapplythread(void *arg)
+{
+    VIOAPND2RCTASK *task = (VIOAPND2RCTASK *)arg;
+    CDBVIO *vio = task->vio;
+    CDB *db = vio->db;
+    VIOAPND2RCENT *ents = task->ents;
+    CDBREC *rrec = (CDBREC *)cdb_scratch_get(RECSBUFSIZE(db));
+    uint32_t gs, ge;
+
+    for(gs = 0; gs < task->num; gs = ge) {
+        for(ge = gs + 1; ge < task->num && ents[ge].hash == ents[gs].hash; ge++);
+        if ((uint32_t)((ents[gs].hash >> 24) % db->hsize) % task->tnum != task->tid)
+            continue;
+
+        /* older versions in the batch are skipped */
+        for(uint32_t i = gs; i < ge; i++)
+            for(uint32_t j = i + 1; j < ge && !ents[i].stale; j++)
+                if (_vio_apnd2_rckeyeq(ents[i].crec, ents[j].crec))
+                    ents[i].stale = true;
+
+        for(uint32_t i = gs; i < ge; i++) {
+            VIOAPND2RCENT *ent = &ents[i];
+            FOFF soffs[SFOFFNUM];
+            FOFF *soff = soffs, ooff;
+            int retnum;
+
+            if (ent->stale)
+                continue;
+            OFFZERO(ooff);
+            /* check record with duplicate key(old version/overwritten maybe */
+            retnum = cdb_getoff(db, ent->hash, &soff, CDB_NOTLOCKED);
+            for(int k = 0; k < retnum && OFFNULL(ooff); k++) {
+                bool inbatch = false;
+                /* records in the batch are compared in place */
+                for(uint32_t j = gs; j < ge; j++) {
+                    if (OFFEQ(ents[j].off, soff[k])) {
+                        inbatch = true;
+                        if (_vio_apnd2_rckeyeq(ents[j].crec, ent->crec))
+                            ooff = soff[k];
+                        break;
+                    }
+                }
+                if (inbatch || _vio_apnd2_readrec(vio, &rrec, soff[k], false) < 0)
+                    continue;
+                if (_vio_apnd2_rckeyeq(rrec, ent->crec))
+                    ooff = rrec->ooff;
+            }
+            if (soff != soffs)
+                free(soff);
+
+            if (OFFNOTNULL(ooff))
+                /* replace offset in index */
+                cdb_replaceoff(db, ent->hash, ooff, ent->off, CDB_NOTLOCKED);
+            else
+                cdb_updatepage(db, ent->hash, ent->off, CDB_PAGEINSERTOFF, CDB_NOTLOCKED);
+        }
+    }
+    cdb_scratch_put(rrec);
+    return NULL;
+}
+
+
+/* replay records after roid into index. Data files are mapped RECOVERTHREADNUM at once
+ and scanned in parallel, then the newest record of every key is applied in parallel
+ by buckets. Batches go in oid order, so newer records always win */
+static int _vio_apnd2_recoverrecs(CDBVIO *vio)
+{
+    VIOAPND2 *myio = (VIOAPND2 *)vio->iometa;
+    CDB *db = vio->db;
+    VIOAPND2FINFO *finfo = myio->datfhead;
+    VIOAPND2RCFILE files[RECOVERTHREADNUM];
+    VIOAPND2RCTASK tasks[RECOVERTHREADNUM];
+    int ret = 0;
+
+    while(finfo && ret == 0) {
+        VIOAPND2RCENT *ents = NULL;
+        uint32_t fnum = 0, num = 0, tnum;
+
+        while(finfo && fnum < RECOVERTHREADNUM) {
+            /* nothing after the checkpoint */
+            if (finfo->fstatus == VIOAPND2_FULL && finfo->oidl < db->roid) {
+                finfo = finfo->fnext;
+                continue;
+            }
+            memset(&files[fnum], 0, sizeof(VIOAPND2RCFILE));
+            files[fnum++].finfo = finfo;
+            finfo = finfo->fnext;
+        }
+        if (fnum == 0)
+            break;
+
+        for(uint32_t i = 0; i < fnum; i++) {
+            tasks[i].vio = vio;
+            tasks[i].files = files;
+            tasks[i].fnum = fnum;
+            tasks[i].tid = i;
+            tasks[i].tnum = fnum;
+        }
+        _vio_apnd2_rcthreads(_vio_apnd2_rcscanthread, tasks, fnum);
+
+        for(uint32_t i = 0; i < fnum; i++) {
+            if (files[i].err) {
+                cdb_seterrno(db, CDB_INTERNALERR, __FILE__, __LINE__);
+                ret = -1;
+            }
+            num += files[i].num;
+            if (files[i].maxoid > db->oid)
+                db->oid = files[i].maxoid;
+        }
+
+        if (ret == 0 && num) {
+            ents = (VIOAPND2RCENT *)malloc(num * sizeof(VIOAPND2RCENT));
+            if (ents == NULL) {
+                cdb_seterrno(db, CDB_INTERNALERR, __FILE__, __LINE__);
+                ret = -1;
+            }
+        }
+
+        if (ents) {
+            num = 0;
+            for(uint32_t i = 0; i < fnum; i++) {
+                memcpy(ents + num, files[i].ents, files[i].num * sizeof(VIOAPND2RCENT));
+                num += files[i].num;
+            }
+            qsort(ents, num, sizeof(VIOAPND2RCENT), _vio_apnd2_rcentcmp);
+            tnum = num < 4096? 1: RECOVERTHREADNUM;
+            for(uint32_t i = 0; i < tnum; i++) {
+                tasks[i].vio = vio;
+                tasks[i].ents = ents;
+                tasks[i].num = num;
+                tasks[i].tid = i;
+                tasks[i].tnum = tnum;
+            }
+            _vio_apnd2_rcthreads(_vio_apnd2_rcapplythread, tasks, tnum);
+            free(ents);
+        }
+
+        for(uint32_t i = 0; i < fnum; i++) {
+            if (files[i].mmap)
+                munmap(files[i].mmap, files[i].fsize);
+            free(files[i].ents);
+        }
+    }
+    return ret;
+}
+
+
 /* recovery the database if it was not close properly 
  * or force recovery from roid = 0
  * the procedure runs with no lock protection */
@@ -1905,6 +2435,8 @@ static int _vio_apnd2_recovery(CDBVIO *vio, bool force)
     int datpos, datlimit;
     uint32_t imaxfid = 0, dmaxfid = 0;
     bool gotmindex = false;
+    /* deletion log before the last rotation */
+    int pdfd = -1;
     
 
     idxpos = datpos = 0;
@@ -1925,6 +2457,11 @@ static int _vio_apnd2_recovery(CDBVIO *vio, bool force)
         if (strcmp(cstr, "dellog.cdb") == 0) {
             snprintf(filename, MAX_PATH_LEN, "%s/%s", myio->filepath, cstr);
             myio->dfd = open(filename, O_RDONLY, 0644);
+        } else if (strcmp(cstr, "dellogprev.cdb") == 0) {
+            /* the path is too long to open */
+            if (snprintf(filename, MAX_PATH_LEN, "%s/%s", myio->filepath, cstr) >= MAX_PATH_LEN)
+                continue;
+            pdfd = open(filename, O_RDONLY, 0644);
         } else if (strcmp(cstr, "mainindex.cdb") == 0) {
             gotmindex = true;
 //            snprintf(filename, MAX_PATH_LEN, "%s/%s", myio->filepath, cstr);
@@ -1960,6 +2497,7 @@ static int _vio_apnd2_recovery(CDBVIO *vio, bool force)
             fsize = lseek(fd, 0, SEEK_END);
             finfo.rcyled = 0;
             finfo.ref = 0;
+            finfo.wpending = 0;
             finfo.unlink = false;
             finfo.fprev = finfo.fnext = NULL;
             if (finfo.ftype == VIOAPND2_INDEX) {
@@ -2102,21 +2640,26 @@ static int _vio_apnd2_recovery(CDBVIO *vio, bool force)
         _vio_apnd2_shiftnew(vio, VIOAPND2_DATA);
     } 
  
-    /* fix offsets in main index table */
-    db->mtable = (FOFF *)malloc(db->hsize * sizeof(FOFF));
-    memset(db->mtable, 0, db->hsize * sizeof(FOFF));
+    /* fix offsets in main index table, a mapped one is emptied and rebuilt in the file */
+    if (db->mtmmap) {
+        if (ftruncate(myio->hfd, FILEMETASIZE) < 0) {
+            cdb_seterrno(db, CDB_WRITEERR, __FILE__, __LINE__);
+            goto ERRRET;
+        }
+        if (cdb_mapmtable(db, myio->hfd, FILEMETASIZE) < 0)
+            goto ERRRET;
+    } else if (cdb_newmtable(db) < 0)
+        goto ERRRET;
     void *it = _vio_apnd2_pageiterfirst(vio, 0);
     if (it) {
-        char sbuf[SBUFSIZE];
-        CDBPAGE *page = (CDBPAGE *)sbuf;
+        CDBPAGE *page = (CDBPAGE *)cdb_scratch_get(PAGESBUFSIZE);
+        CDBPAGE *opage = (CDBPAGE *)cdb_scratch_get(PAGESBUFSIZE);
         /* need not use iterator since don't care about contents in page */
         /* I'm just lazy, cpu time is cheap */
         while(_vio_apnd2_pageiternext(vio, &page, it) == 0) {
             if (OFFNOTNULL(db->mtable[page->bid])) {
                 /* recalculate the space to be recycled */
                 uint32_t ofid, roff;
-                char sbuf[SBUFSIZE];
-                CDBPAGE *opage = (CDBPAGE *)sbuf;
                 _vio_apnd2_readpage(vio, &opage, db->mtable[page->bid]);
                 if (OFFNOTNULL(opage->ooff)) {
                     VOFF2ROFF(opage->ooff, ofid, roff);
@@ -2126,97 +2669,47 @@ static int _vio_apnd2_recovery(CDBVIO *vio, bool force)
                 }
                 /* fix impaction of old page */
                 db->rnum -= opage->num;
-                if (opage != (CDBPAGE *)sbuf)
-                    free(opage);
             }
             db->mtable[page->bid] = page->ooff;
             db->rnum += page->num;
-            if (page != (CDBPAGE *)sbuf) {
-                free(page);
-                page = (CDBPAGE *)sbuf;
-            }
         }
+        cdb_scratch_put(opage);
+        cdb_scratch_put(page);
         _vio_apnd2_pageiterdestory(vio, it);
     }
     
-    /* like what was did just now */
-    it = _vio_apnd2_reciterfirst(vio, db->roid);
-    if (it) {
-        char sbuf[SBUFSIZE];
-        CDBREC *rec = (CDBREC *)sbuf;
-        while(_vio_apnd2_reciternext(vio, &rec, it) == 0) {
-            FOFF soffs[SFOFFNUM];
-            FOFF *soff = soffs, ooff;
-            char sbuf2[SBUFSIZE];
-            OFFZERO(ooff);
-            CDBREC *rrec = (CDBREC*)sbuf2;
-            uint64_t hash = CDBHASH64(rec->buf, rec->ksize);
-
-            /* check record with duplicate key(old version/overwritten maybe */
-            int retnum = cdb_getoff(db, hash, &soff, CDB_NOTLOCKED);
-            for(int i = 0; i < retnum; i++) {
-                if (rrec != (CDBREC*)sbuf2) {
-                    free(rrec);
-                    rrec = (CDBREC*)sbuf2;
-                }
-                
-                int cret = _vio_apnd2_readrec(db->vio, &rrec, soff[i], false);
-                if (cret < 0)
-                    continue;
-                    
-                if (rec->ksize == rrec->ksize && memcmp(rrec->key, rec->key, rec->ksize) == 0) {
-                    ooff = rrec->ooff;
-                    break;
-                }
-            }
-            if (soff != soffs)
-                free(soff);
-            if (rrec != (CDBREC*)sbuf2) 
-                free(rrec);
-
-            if (OFFNOTNULL(ooff))
-                /* replace offset in index */
-                cdb_replaceoff(db, hash, ooff, rec->ooff, CDB_NOTLOCKED);
-            else
-                cdb_updatepage(vio->db, hash, rec->ooff, CDB_PAGEINSERTOFF, CDB_NOTLOCKED);
-
-            if (rec->oid > db->oid)
-                db->oid = rec->oid;
-            if (rec != (CDBREC *)sbuf) {
-                free(rec);
-                rec = (CDBREC *)sbuf;
-            }
-        }
-        _vio_apnd2_reciterdestory(vio, it);
-    }
+    /* replay records after the checkpoint, data files are scanned in parallel */
+    if (_vio_apnd2_recoverrecs(vio) < 0)
+        goto ERRRET;
     
-    /* replay deletion logs */
+    /* replay deletion logs, the previous one goes first */
     FOFF delitems[1024];
-    for(; myio->dfd > 0;) {
-        int ret = read(myio->dfd, delitems, 1024 * sizeof(FOFF));
+    CDBREC *drec = (CDBREC *)cdb_scratch_get(RECSBUFSIZE(db));
+    for(int *dfd = pdfd > 0? &pdfd: &myio->dfd; *dfd > 0;) {
+        int ret = read(*dfd, delitems, 1024 * sizeof(FOFF));
         if (ret > 0) {
             for(int j = 0; j * sizeof(FOFF) < ret; j++) {
-                char sbuf[SBUFSIZE];
                 uint32_t ofid, roff;
-                CDBREC *rec = (CDBREC *)sbuf;
-                if (_vio_apnd2_readrec(vio, &rec, delitems[j], false) < 0)
+                if (_vio_apnd2_readrec(vio, &drec, delitems[j], false) < 0)
                     continue;
-                if (cdb_updatepage(db, CDBHASH64(rec->key, rec->ksize),
+                if (cdb_updatepage(db, CDBHASH64(drec->key, drec->ksize),
                                    delitems[j], CDB_PAGEDELETEOFF, CDB_NOTLOCKED) == 0)
                 VOFF2ROFF(delitems[j], ofid, roff);
                 VIOAPND2FINFO *finfo = (VIOAPND2FINFO *)cdb_ht_get2(myio->datmeta, &ofid, SI4, false);
                 if (finfo)
-                    finfo->rcyled += rec->osize;
-                if (rec != (CDBREC *)sbuf)
-                    free(rec);
+                    finfo->rcyled += drec->osize;
             }
         } else {
-            close(myio->dfd);
-            myio->dfd = -1;
+            close(*dfd);
+            *dfd = -1;
+            dfd = &myio->dfd;
         }
     }
+    cdb_scratch_put(drec);
     
     cdb_flushalldpage(db);
+    /* without page cache, pages are written one by one into the buffer */
+    _vio_apnd2_flushbuf(vio, VIOAPND2_INDEX);
     _vio_apnd2_writemeta(vio);
     _vio_apnd2_writehead(vio, true);
     cdb_ht_clean(myio->idxmeta);
@@ -2250,6 +2743,8 @@ ERRRET:
         close(myio->mfd);
     if (myio->dfd > 0)
         close(myio->dfd);
+    if (pdfd > 0)
+        close(pdfd);
     free(datorders);
     free(idxorders);
     return -1;
@@ -2373,8 +2868,7 @@ static int _vio_apnd2_iterfirst(CDBVIO *vio, VIOAPND2ITOR *it, int dtype, int64_
 static int _vio_apnd2_pageiternext(CDBVIO *vio, CDBPAGE **page, void *iter)
 {
     VIOAPND2ITOR *it = (VIOAPND2ITOR *)iter;
-    CDBPAGE *cpage;
-    uint32_t fixbufsize = SBUFSIZE - (sizeof(CDBPAGE) - PAGEHSIZE);
+    CDBPAGE *cpage, *npage;
 
     for(;;) {
         if (it->off >= it->fsize) {
@@ -2388,12 +2882,11 @@ static int _vio_apnd2_pageiternext(CDBVIO *vio, CDBPAGE **page, void *iter)
             it->off += ALIGNBYTES;
             continue;
         }
-        if (PAGESIZE(cpage) <= fixbufsize)
-            memcpy(&(*page)->magic, &cpage->magic, PAGESIZE(cpage));
-        else {
-            *page = (CDBPAGE *)malloc(sizeof(CDBPAGE) + (*page)->num * sizeof(PITEM));
-            memcpy(&(*page)->magic, &cpage->magic, PAGESIZE(cpage));
-        }
+        npage = (CDBPAGE *)cdb_scratch_grow(*page, sizeof(CDBPAGE) + cpage->num * sizeof(PITEM));
+        if (npage == NULL)
+            return -1;
+        *page = npage;
+        memcpy(&(*page)->magic, &cpage->magic, PAGESIZE(cpage));
         (*page)->osize = PAGESIZE(cpage);
         (*page)->cap = (*page)->num;
         ROFF2VOFF(it->finfo->fid, it->off, (*page)->ooff);
@@ -2408,8 +2901,7 @@ static int _vio_apnd2_pageiternext(CDBVIO *vio, CDBPAGE **page, void *iter)
 static int _vio_apnd2_reciternext(CDBVIO *vio, CDBREC **rec, void *iter)
 {
     VIOAPND2ITOR *it = (VIOAPND2ITOR *)iter;
-    CDBREC *crec;
-    uint32_t fixbufsize = SBUFSIZE - (sizeof(CDBREC) - RECHSIZE);
+    CDBREC *crec, *nrec;
 
     for(;;) {
         if (it->off >= it->fsize) {
@@ -2423,12 +2915,11 @@ static int _vio_apnd2_reciternext(CDBVIO *vio, CDBREC **rec, void *iter)
             it->off += ALIGNBYTES;
             continue;
         }
-        if (RECSIZE(crec) <= fixbufsize)
-            memcpy(&(*rec)->magic, &crec->magic, RECSIZE(crec));
-        else {
-            *rec = (CDBREC *)malloc(sizeof(CDBREC) + crec->ksize + crec->vsize);
-            memcpy(&(*rec)->magic, &crec->magic, RECSIZE(crec));
-        }
+        nrec = (CDBREC *)cdb_scratch_grow(*rec, sizeof(CDBREC) + crec->ksize + crec->vsize);
+        if (nrec == NULL)
+            return -1;
+        *rec = nrec;
+        memcpy(&(*rec)->magic, &crec->magic, RECSIZE(crec));
 
         (*rec)->osize = RECSIZE(crec);
         (*rec)->expire = crec->expire;
@@ -2605,8 +3096,14 @@ static void _vio_apnd2_cleanpoint(CDBVIO *vio)
     _vio_apnd2_flushbuf(vio, VIOAPND2_DATA);
     _vio_apnd2_flushbuf(vio, VIOAPND2_INDEX);
     _vio_apnd2_writehead(vio, false);
+    /* start writing back the mapped table, close won't have much to wait for */
+    if (vio->db->mtmap)
+        msync(vio->db->mtmap, vio->db->mtmapsize, MS_ASYNC);
     if (myio->dfd > 0) 
         close(myio->dfd);
+    snprintf(filename, MAX_PATH_LEN, "%s/dellogprev.cdb", myio->filepath);
+    unlink(filename);
+    myio->dloid = 0;
     snprintf(filename, MAX_PATH_LEN, "%s/dellog.cdb", myio->filepath);
     /* clean the previous deletion log */
     myio->dfd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
@@ -2617,6 +3114,235 @@ static void _vio_apnd2_cleanpoint(CDBVIO *vio)
 }
 
 
+/* recovery point moved by checkpoints of bucket ranges. deletions can't be forgotten
+ before every range is checkpointed after them, so the deletion log is rotated instead of
+ truncated. the previous one is dropped when recovery point passes the rotation */
+static void _vio_apnd2_checkpoint(CDBVIO *vio)
+{
+    VIOAPND2 *myio = (VIOAPND2 *)vio->iometa;
+    char filename[MAX_PATH_LEN];
+    char pfilename[MAX_PATH_LEN];
+    
+    cdb_lock_lock(myio->lock);
+    _vio_apnd2_flushbuf(vio, VIOAPND2_DATA);
+    _vio_apnd2_flushbuf(vio, VIOAPND2_INDEX);
+    _vio_apnd2_flushbuf(vio, VIOAPND2_DELLOG);
+    _vio_apnd2_writehead(vio, false);
+    if (vio->db->mtmap)
+        msync(vio->db->mtmap, vio->db->mtmapsize, MS_ASYNC);
+    if (vio->db->roid >= myio->dloid) {
+        snprintf(filename, MAX_PATH_LEN, "%s/dellog.cdb", myio->filepath);
+        snprintf(pfilename, MAX_PATH_LEN, "%s/dellogprev.cdb", myio->filepath);
+        if (myio->dfd > 0) 
+            close(myio->dfd);
+        rename(filename, pfilename);
+        myio->dfd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (myio->dfd < 0)
+            cdb_seterrno(vio->db, CDB_OPENERR, __FILE__, __LINE__);
+        myio->dloid = __atomic_load_n(&vio->db->oid, __ATOMIC_RELAXED);
+    }
+    cdb_lock_unlock(myio->lock);
+}
+
+
+/* pages in the file being written are read one by one through its buffer. for the others,
+ a window covering as many pages as possible is read at a time, from a duplicated fd
+ outside the lock, the file stays readable even if it is closed or unlinked meanwhile */
+static int _vio_apnd2_readpages(CDBVIO *vio, const FOFF *offs, uint32_t num, VIOPAGECB cb, void *arg)
+{
+    VIOAPND2 *myio = (VIOAPND2 *)vio->iometa;
+    char *win = (char *)cdb_scratch_get(BULKREADSIZE);
+    CDBPAGE *page = (CDBPAGE *)cdb_scratch_get(PAGESBUFSIZE);
+    bool stop = false;
+    uint32_t i = 0;
+
+    while(i < num && !stop) {
+        uint32_t fid, roff, end;
+        int fd = -1;
+
+        VOFF2ROFF(offs[i], fid, roff);
+        /* pages in the same file */
+        for(end = i + 1; end < num; end++) {
+            uint32_t nfid, nroff;
+            VOFF2ROFF(offs[end], nfid, nroff);
+            if (nfid != fid)
+                break;
+        }
+
+        cdb_lock_lock(myio->lock);
+        if (fid != myio->ibuf.fid) {
+            int vfid = VFIDIDX(fid);
+            int *fdret = cdb_ht_get2(myio->fdcache, &vfid, sizeof(vfid), true);
+            fd = fdret? *fdret: _vio_apnd2_loadfd(vio, fid, VIOAPND2_INDEX);
+            if (fd >= 0)
+                fd = dup(fd);
+        }
+        cdb_lock_unlock(myio->lock);
+
+        if (fd < 0) {
+            for(; i < end && !stop; i++) {
+                if (_vio_apnd2_readpage(vio, &page, offs[i]) == 0)
+                    stop = !cb(arg, page);
+            }
+            continue;
+        }
+
+        while(i < end && !stop) {
+            uint32_t start, last, wsize, nroff;
+            int ret;
+
+            /* the window ends a default page read after the last page starts in it */
+            VOFF2ROFF(offs[i], fid, start);
+            last = start;
+            for(uint32_t j = i + 1; j < end; j++) {
+                VOFF2ROFF(offs[j], fid, nroff);
+                if (nroff + PAGEAREADSIZE - start > BULKREADSIZE)
+                    break;
+                last = nroff;
+            }
+            wsize = CDBMIN(last + PAGEAREADSIZE - start, BULKREADSIZE);
+            ret = pread(fd, win, wsize, start);
+            if (ret <= 0) {
+                cdb_seterrno(vio->db, CDB_READERR, __FILE__, __LINE__);
+                i++;
+                continue;
+            }
+
+            while(i < end && !stop) {
+                uint32_t boff, psize;
+
+                VOFF2ROFF(offs[i], fid, nroff);
+                boff = nroff - start;
+                if (boff + PAGEHSIZE > ret) {
+                    /* truncated file */
+                    if (boff == 0) {
+                        cdb_seterrno(vio->db, CDB_DATAERRIDX, __FILE__, __LINE__);
+                        i++;
+                    }
+                    break;
+                }
+                /* the page on disk starts at 'magic', followed by 'bid' and 'num' */
+                if (*(uint32_t *)(win + boff) != PAGEMAGIC) {
+                    cdb_seterrno(vio->db, CDB_DATAERRIDX, __FILE__, __LINE__);
+                    i++;
+                    continue;
+                }
+                psize = PAGEHSIZE + sizeof(PITEM) * *(uint32_t *)(win + boff + SI4 * 2);
+                if (boff + psize > ret) {
+                    /* larger than a window, read it alone */
+                    if (boff == 0) {
+                        if (_vio_apnd2_readpage(vio, &page, offs[i]) == 0)
+                            stop = !cb(arg, page);
+                        i++;
+                    }
+                    break;
+                }
+
+                if (cdb_scratch_size(page) < sizeof(CDBPAGE) - PAGEHSIZE + psize) {
+                    CDBPAGE *npage = (CDBPAGE *)cdb_scratch_grow(page, 
+                            sizeof(CDBPAGE) - PAGEHSIZE + psize);
+                    if (npage == NULL) {
+                        cdb_seterrno(vio->db, CDB_INTERNALERR, __FILE__, __LINE__);
+                        i++;
+                        continue;
+                    }
+                    page = npage;
+                }
+                memcpy(&page->magic, win + boff, psize);
+                page->osize = OFFALIGNED(psize);
+                page->ooff = offs[i];
+                page->cap = page->num;
+                i++;
+                stop = !cb(arg, page);
+            }
+        }
+        close(fd);
+    }
+
+    cdb_scratch_put(page);
+    cdb_scratch_put(win);
+    return 0;
+}
+
+
+/* write to a temporary file then rename it, a reader never sees a partial file */
+static int _vio_apnd2_writeside(CDBVIO *vio, const char *name, const void *buf, uint64_t size)
+{
+    VIOAPND2 *myio = (VIOAPND2 *)vio->iometa;
+    char filename[MAX_PATH_LEN];
+    char tmpname[MAX_PATH_LEN];
+    uint64_t pos = 0;
+    int fd;
+
+    snprintf(filename, MAX_PATH_LEN, "%s/%s", myio->filepath, name);
+    snprintf(tmpname, MAX_PATH_LEN, "%s/%s.tmp", myio->filepath, name);
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cdb_seterrno(vio->db, CDB_OPENERR, __FILE__, __LINE__);
+        return -1;
+    }
+
+    while(pos < size) {
+        ssize_t ret = write(fd, (const char *)buf + pos, size - pos);
+        if (ret <= 0) {
+            close(fd);
+            unlink(tmpname);
+            cdb_seterrno(vio->db, CDB_WRITEERR, __FILE__, __LINE__);
+            return -1;
+        }
+        pos += ret;
+    }
+    close(fd);
+
+    if (rename(tmpname, filename) < 0) {
+        unlink(tmpname);
+        cdb_seterrno(vio->db, CDB_WRITEERR, __FILE__, __LINE__);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* a missing side file is not an error */
+static int _vio_apnd2_readside(CDBVIO *vio, const char *name, void **buf, uint64_t *size)
+{
+    VIOAPND2 *myio = (VIOAPND2 *)vio->iometa;
+    char filename[MAX_PATH_LEN];
+    struct stat st;
+    uint64_t pos = 0;
+    int fd;
+
+    *buf = NULL;
+    *size = 0;
+    snprintf(filename, MAX_PATH_LEN, "%s/%s", myio->filepath, name);
+    fd = open(filename, O_RDONLY, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        cdb_seterrno(vio->db, CDB_READERR, __FILE__, __LINE__);
+        return -1;
+    }
+
+    *buf = malloc(st.st_size? st.st_size: 1);
+    while(pos < (uint64_t)st.st_size) {
+        ssize_t ret = read(fd, (char *)*buf + pos, st.st_size - pos);
+        if (ret <= 0) {
+            close(fd);
+            free(*buf);
+            *buf = NULL;
+            cdb_seterrno(vio->db, CDB_READERR, __FILE__, __LINE__);
+            return -1;
+        }
+        pos += ret;
+    }
+    close(fd);
+    *size = pos;
+    return 0;
+}
+
+
 static int _vio_apnd2_checkopensig(CDBVIO *vio)
 {
     VIOAPND2 *myio = (VIOAPND2 *)vio->iometa;